@@ -0,0 +1,20 @@
+#!/bin/sh
+# Measures how many script lines per second kush reads and runs in batch mode. Every line of the script is a cd
+# builtin, so no process is started and the time goes to reading, parsing and prompting. Builds before and after a
+# change can be compared:
+#
+#     bench/batch.sh before/kush build/kush
+#
+# The number of lines defaults to 100000 and can be set with N.
+
+n=${N:-100000}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) print (i % 2 ? "cd /" : "cd /tmp") }' > "$script"
+
+for kush in "$@"; do
+    start=$(date +%s%N)
+    "$kush" < "$script" > /dev/null
+    ms=$((($(date +%s%N) - start) / 1000000))
+    echo "$kush: $n lines in $ms ms, $((n * 1000 / (ms > 0 ? ms : 1))) lines/s"
+done
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compares the built-in echo and test with the programs of the same name. Each kush given runs the same loop twice,
+# once calling echo and test and once /bin/echo and /usr/bin/test, 10^N times each:
+#
+#     bench/builtins.sh build/kush
+#
+# The loops are nested for loops over 0 to 9, as kush has no arithmetic. N defaults to 4.
+
+n=${N:-4}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+iterations=$(awk -v n="$n" 'BEGIN { printf "%d", 10 ^ n }')
+
+for sh in "$@"; do
+    for commands in 'echo test' '/bin/echo /usr/bin/test'; do
+        awk -v n="$n" -v commands="$commands" 'BEGIN {
+            split(commands, command, " ")
+            for (i = 0; i < n; i++) printf "%*sfor d%d in 0 1 2 3 4 5 6 7 8 9; do\n", 4 * i, "", i
+            printf "%*s%s \"$d0\" != x && %s \"$d0$d1\" > /dev/null\n", 4 * n, "", command[2], command[1]
+            for (i = n - 1; i >= 0; i--) printf "%*sdone\n", 4 * i, ""
+        }' > "$script"
+        start=$(date +%s%N)
+        "$sh" < "$script"
+        ms=$((($(date +%s%N) - start) / 1000000))
+        echo "$sh: $iterations iterations with $commands in $ms ms, $((iterations * 1000 / (ms > 0 ? ms : 1)))/s"
+    done
+done
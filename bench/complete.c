@@ -0,0 +1,125 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of command completion. It puts 10000 executables into a directory in $TMPDIR (or /tmp) in front of
+// /usr/bin and /bin in PATH, waits for the completion worker to publish its table of command names and times
+// kush_compl_commands() for prefixes matching everything, thousands, a handful and nothing. Then it adds one more
+// executable and measures how long the worker takes to pick it up.
+
+#define main kush_main
+#include "../kush.c"
+#undef main
+
+// Number of executables put into the PATH directory
+#define BENCH_EXECUTABLES 10000
+
+// Returns the time of the monotonic clock in nanoseconds
+long bench_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Creates an empty executable named name in dir
+void bench_executable(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        perror("bench_complete: Error creating an executable");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+// Waits until the worker has published a table with at least num names and returns the time that took
+double bench_wait_table(size_t num) {
+    long start = bench_ns();
+
+    do {
+        usleep(100);
+        kush_compl_sync();
+    } while (!compl_table || compl_table->num < num);
+
+    return (bench_ns() - start) / 1e6;
+}
+
+// Times the completion of prefix and prints the mean time of one completion
+void bench_prefix(const char *prefix) {
+    size_t len = strlen(prefix);
+    long start = bench_ns();
+    long elapsed;
+    kush_compl compl;
+    int runs = 0;
+
+    do { // As many runs as fit into 200 ms
+        memset(&compl, 0, sizeof(compl));
+        kush_compl_commands(&compl, prefix, len);
+        runs++;
+    } while ((elapsed = bench_ns() - start) < 200000000L);
+
+    printf("'%s'%*s %8.2f us  %zu candidates\n", prefix, (int) (12 - len), "", elapsed / 1e3 / runs, compl.num);
+}
+
+int main() {
+    const char *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX];
+    char path[PATH_MAX + 16];
+    char name[32];
+    size_t num;
+
+    kush_vars_init();
+    snprintf(dir, sizeof(dir), "%s/kush-bench-complete-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    if (!mkdtemp(dir)) {
+        perror("bench_complete: Error creating the PATH directory");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < BENCH_EXECUTABLES; i++) {
+        snprintf(name, sizeof(name), "%s-%d", i % 2 ? "tool" : "cmd", i);
+        bench_executable(dir, name);
+    }
+    snprintf(path, sizeof(path), "%s:/usr/bin:/bin", dir);
+    kush_var_set("PATH", strlen("PATH"), path, 0);
+
+    kush_compl_init();
+    printf("table published after %.1f ms\n", bench_wait_table(BENCH_EXECUTABLES));
+    num = compl_table->num;
+    printf("%zu command names\n", num);
+
+    bench_prefix("");
+    bench_prefix("tool-");
+    bench_prefix("cmd-12");
+    bench_prefix("tool-9999");
+    bench_prefix("zzz");
+
+    bench_executable(dir, "tool-new");
+    printf("new executable picked up after %.1f ms\n", bench_wait_table(num + 1));
+    bench_prefix("tool-n");
+
+    for (int i = 0; i < BENCH_EXECUTABLES; i++) {
+        snprintf(path, sizeof(path), "%s/%s-%d", dir, i % 2 ? "tool" : "cmd", i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/tool-new", dir);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of the built-in lookup. It is built twice, with the built-ins of kush and with the 128 of
+// bench/dispatch.def, and times the generated perfect hash against a scan of all names with strcmp(), which is how
+// kush looked built-ins up before. Half of the names looked up are built-ins and half are programs.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kush_builtins.h"
+
+#ifndef KUSH_BUILTINS_DEF
+#define KUSH_BUILTINS_DEF "builtins.def"
+#endif
+
+// Names of all built-ins
+const char *names[] = {
+#define KUSH_BUILTIN(name, func, flags) #name,
+#include KUSH_BUILTINS_DEF
+#undef KUSH_BUILTIN
+};
+
+// Programs that are looked up as well and found in neither table
+const char *programs[] = {
+        "ls", "grep", "git", "make", "cat", "sed", "awk", "find", "sort", "xargs", "cp", "mv", "rm", "mkdir",
+        "tar", "gcc", "cmake", "ssh", "curl", "python3", "head", "tail", "wc", "cut", "tr", "uniq", "diff", "less"
+};
+
+#define NUM_NAMES ((int) (sizeof(names) / sizeof(names[0])))
+#define NUM_PROGRAMS ((int) (sizeof(programs) / sizeof(programs[0])))
+#define ROUNDS 200000
+
+// Lookup through the generated perfect hash, as kush_find_builtin() does it
+int find_hashed(const char *name) {
+    int builtin = kush_builtin_index(name);
+
+    return builtin >= 0 && strcmp(name, names[builtin]) == 0 ? builtin : -1;
+}
+
+// Lookup by comparing name with every built-in
+int find_scanned(const char *name) {
+    for (int i = 0; i < NUM_NAMES; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// Returns the nanoseconds per lookup of find, checking that it finds every built-in and no program
+double bench(int (*find)(const char *)) {
+    struct timespec start, end;
+    long found = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < NUM_NAMES; i++) found += find(names[i]) == i;
+        for (int i = 0; i < NUM_NAMES; i++) found += find(programs[i % NUM_PROGRAMS]) < 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (found != 2L * ROUNDS * NUM_NAMES) {
+        fprintf(stderr, "bench_dispatch: Wrong lookup result\n");
+        return -1;
+    }
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (2.0 * ROUNDS * NUM_NAMES);
+}
+
+int main() {
+    printf("%d built-ins: perfect hash %.1f ns, strcmp() scan %.1f ns per lookup\n",
+           NUM_NAMES, bench(find_hashed), bench(find_scanned));
+
+    return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Times pathname expansion on a directory of N entries in kush and other shells. Every shell given expands the same
+# patterns in a generated directory, so kush can be compared with e.g.
+#
+#     bench/glob.sh build/kush bash
+#
+# Half of the names end in .log and half in .txt. N defaults to 1000000, the directory is made once per run in
+# $TMPDIR and takes a while to fill.
+
+n=${N:-1000000}
+dir=$(mktemp -d)
+script=$(mktemp)
+trap 'rm -rf "$dir" "$script"' EXIT
+(cd "$dir" && awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) printf "f%d.%s\n", i, i % 2 ? "log" : "txt" }' |
+    xargs touch)
+
+for pattern in '*' '*.log' 'f1?7*.txt'; do
+    echo "cd $dir && echo $pattern > /dev/null" > "$script"
+    for sh in "$@"; do
+        start=$(date +%s%N)
+        "$sh" < "$script"
+        ms=$((($(date +%s%N) - start) / 1000000))
+        echo "$sh: '$pattern' over $n entries in $ms ms"
+    done
+done
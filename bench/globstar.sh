@@ -0,0 +1,32 @@
+#!/bin/sh
+# Times '**/*.json' in kush for every number of walker threads from 1 to 32 on a generated tree of N directories
+# with ten files each, a fifth of them .json files:
+#
+#     bench/globstar.sh build/kush
+#
+# Every thread count has to give the same paths as a single thread, the script fails otherwise. N defaults to 20000.
+# With COLD=1 the page cache is dropped before each run, which needs root.
+
+kush=$1
+n=${N:-20000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+(cd "$dir" && awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) print "d" i % 20 "/e" int(i / 20) % 50 "/f" i }' |
+    xargs mkdir -p)
+(cd "$dir" && awk -v n="$n" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < 10; j++) printf "d%d/e%d/f%d/%d.%s\n", i % 20, int(i / 20) % 50, i, j, j % 5 ? "txt" : "json"
+    }
+}' | xargs touch)
+
+for threads in 1 2 4 8 16 32; do
+    if [ "$COLD" = 1 ]; then
+        sync
+        echo 3 > /proc/sys/vm/drop_caches
+    fi
+    start=$(date +%s%N)
+    printf 'cd %s\nKUSH_GLOB_THREADS=%d\necho **/*.json\n' "$dir" "$threads" | "$kush" > "$dir/out$threads"
+    ms=$((($(date +%s%N) - start) / 1000000))
+    echo "$threads threads: $(wc -w < "$dir/out$threads") paths in $ms ms"
+    cmp -s "$dir/out1" "$dir/out$threads" || { echo "$threads threads gave other paths than 1" >&2; exit 1; }
+done
@@ -0,0 +1,131 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of the history search. It writes a history file of 1M records to $TMPDIR (or /tmp), maps it like
+// an interactive session does and times kush_hist_search() for a few kinds of queries once the index is built:
+// queries found in old entries through the trigram index, ones many entries contain, ones with no match and ones
+// shorter than a trigram, which have to look at every entry.
+
+#define main kush_main
+#include "../kush.c"
+#undef main
+
+// Number of records in the generated history
+#define BENCH_ENTRIES 1000000
+
+// Commands the history is made of, with a number that makes most entries differ
+const char *bench_commands[] = {"git checkout branch-%d", "make -j8 target%d", "ssh host%d.example.org",
+                                "grep -rn pattern%d src", "cd /srv/project%d", "vim notes-%d.txt"};
+
+// Returns the time of the monotonic clock in nanoseconds
+long bench_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Writes a history file of BENCH_ENTRIES records to path, in the format kush_hist_add() writes
+void bench_write_history(const char *path) {
+    size_t size = (size_t) BENCH_ENTRIES * kush_hist_record_size(32);
+    char *buff = calloc(1, size);
+    size_t pos = 0;
+    int fd;
+
+    if (!buff) exit(EXIT_FAILURE);
+    for (int i = 0; i < BENCH_ENTRIES; i++) {
+        char text[64];
+        size_t len = snprintf(text, sizeof(text), bench_commands[i % 6], i / 6 % 100000);
+        kush_hist_head head = {.magic = KUSH_HIST_MAGIC, .len = len, .time = i};
+        kush_hist_tail tail = {.check = kush_hist_check(text, len), .size = kush_hist_record_size(len)};
+
+        memcpy(buff + pos, &head, sizeof(head));
+        memcpy(buff + pos + sizeof(head), text, len);
+        memcpy(buff + pos + tail.size - sizeof(tail), &tail, sizeof(tail));
+        pos += tail.size;
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, buff, pos) != (ssize_t) pos || close(fd) != 0) {
+        perror("bench_history: Error writing the history");
+        exit(EXIT_FAILURE);
+    }
+    free(buff);
+}
+
+// Returns the newest entry containing query (of length len), found by looking at every entry
+ssize_t bench_scan(const char *query, size_t len) {
+    for (ssize_t pos = (ssize_t) hist_size; (pos = kush_hist_prev(pos)) >= 0;) {
+        if (kush_hist_matches(pos, query, len)) return pos;
+    }
+    return -1;
+}
+
+// Times the search for query from the newest entry on and prints the mean time of one search. Exits if the result
+// differs from the one of a scan.
+void bench_query(const char *query) {
+    size_t len = strlen(query);
+    long start = bench_ns();
+    long elapsed;
+    ssize_t found;
+    int runs = 0;
+
+    do { // As many runs as fit into 200 ms
+        found = kush_hist_search(query, len, hist_size);
+        runs++;
+    } while ((elapsed = bench_ns() - start) < 200000000L);
+
+    printf("%-24s %9.1f us  %s\n", query, elapsed / 1e3 / runs, found < 0 ? "no match" : "found");
+    if (found != bench_scan(query, len)) {
+        fprintf(stderr, "bench_history: The search for '%s' found another entry than a scan\n", query);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main() {
+    const char *tmp = getenv("TMPDIR");
+    char path[PATH_MAX];
+    long start;
+
+    kush_vars_init();
+    snprintf(path, sizeof(path), "%s/kush-bench-history-%d", tmp && *tmp ? tmp : "/tmp", getpid());
+    bench_write_history(path);
+    kush_var_set("KUSH_HISTFILE", strlen("KUSH_HISTFILE"), path, 0);
+
+    start = bench_ns();
+    kush_hist_init();
+    printf("%d entries, %zu MiB\n", BENCH_ENTRIES, hist_size >> 20);
+    bench_query("host4242.example");
+    do { // The index is built in the background, until then every search looks at the entries one by one
+        usleep(1000);
+        kush_index_sync();
+    } while (!hist_index);
+    printf("index built in %.0f ms\n", (bench_ns() - start) / 1e6);
+
+    bench_query("host4242.example"); // An old entry
+    bench_query("branch-99999"); // The newest of its kind
+    bench_query("checkout branch-1"); // Many entries contain this
+    bench_query("pattern1234 src"); // Few entries contain this, none of them new
+    bench_query("make"); // Every sixth entry contains this
+    bench_query("no such command"); // Has trigrams no entry has
+    bench_query("-j9"); // Every trigram is common, the combination never occurs
+    bench_query("zq"); // Shorter than a trigram, no match
+
+    unlink(path);
+    return 0;
+}
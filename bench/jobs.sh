@@ -0,0 +1,21 @@
+#!/bin/sh
+# Measures how many short background jobs per second kush launches and reaps. Every kush given is fed the same
+# script, which starts /bin/true in the background on each line and waits for all of them at the end:
+#
+#     bench/jobs.sh before/kush build/kush
+#
+# The number of jobs defaults to 10000 and can be set with N. JOB sets the command, e.g. JOB="sleep 1" keeps
+# all jobs running at the same time.
+
+n=${N:-10000}
+job=${JOB:-/bin/true}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$n" -v job="$job" 'BEGIN { for (i = 0; i < n; i++) print job " &"; print "wait"; print "echo $?" }' > "$script"
+
+for kush in "$@"; do
+    start=$(date +%s%N)
+    status=$("$kush" < "$script" 2> /dev/null | tail -n 1)
+    ms=$((($(date +%s%N) - start) / 1000000))
+    echo "$kush: $n jobs in $ms ms, $((n * 1000 / (ms > 0 ? ms : 1))) jobs/s, wait status $status"
+done
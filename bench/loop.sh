@@ -0,0 +1,30 @@
+#!/bin/sh
+# Times a tight loop of built-ins in kush and other shells. Every shell given is fed the same script, whose loops
+# run a body of true, test, case and an assignment 10^N times, so kush can be compared with e.g.
+#
+#     bench/loop.sh build/kush dash bash
+#
+# The loops are nested for loops over 0 to 9, as kush has no arithmetic or command substitution. A single loop
+# over a million generated words would be unfair to bash, which slows down quadratically with the length of the
+# list. N defaults to 6.
+
+n=${N:-6}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$n" 'BEGIN {
+    for (i = 0; i < n; i++) printf "%*sfor d%d in 0 1 2 3 4 5 6 7 8 9; do\n", 4 * i, "", i
+    for (i = 0; i < n; i++) word = word "$d" i
+    printf "%*strue\n", 4 * n, ""
+    printf "%*stest \"$d0\" = x && echo never\n", 4 * n, ""
+    printf "%*scase $d%d in 9) last=%s ;; esac\n", 4 * n, "", n - 1, word
+    for (i = n - 1; i >= 0; i--) printf "%*sdone\n", 4 * i, ""
+    print "echo $last"
+}' > "$script"
+iterations=$(awk -v n="$n" 'BEGIN { printf "%d", 10 ^ n }')
+
+for sh in "$@"; do
+    start=$(date +%s%N)
+    last=$("$sh" < "$script" 2> /dev/null | tail -n 1)
+    ms=$((($(date +%s%N) - start) / 1000000))
+    echo "$sh: $iterations iterations in $ms ms, $((iterations * 1000 / (ms > 0 ? ms : 1))) iterations/s, last $last"
+done
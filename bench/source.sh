@@ -0,0 +1,36 @@
+#!/bin/sh
+# Times how long kush takes to start and source a large generated rc file, with a cold cache (emptied before every
+# run, so the file is compiled) and a warm one (the bytecode of the file is loaded from the cache):
+#
+#     bench/source.sh build/kush
+#
+# The rc file defines N functions and variables, 8 lines each. N defaults to 5000. Each case runs five times.
+
+kush=$1
+n=${N:-5000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+awk -v n="$n" 'BEGIN {
+    for (i = 0; i < n; i++) {
+        printf "OPTION_%d=\"value %d\"\n", i, i
+        printf "func_%d() {\n", i
+        printf "    if test -n \"$1\"; then\n"
+        printf "        echo \"func_%d: $1 ${OPTION_%d:-unset}\" > /dev/null\n", i, i
+        printf "    else\n"
+        printf "        case $OPTION_%d in *9) return 1 ;; esac\n", i
+        printf "    fi\n"
+        printf "}\n"
+    }
+}' > "$dir/rc"
+echo "source $dir/rc" > "$dir/script"
+
+for cache in cold warm; do
+    times=""
+    for run in 1 2 3 4 5; do
+        [ "$cache" = cold ] && rm -rf "$dir/cache"
+        start=$(date +%s%N)
+        XDG_CACHE_HOME="$dir/cache" "$kush" < "$dir/script"
+        times="$times $((($(date +%s%N) - start) / 1000000))"
+    done
+    echo "$cache cache: $(wc -l < "$dir/rc") lines sourced in$times ms"
+done
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Measures how many commands per second kush launches. Every kush given is fed the same script, whose lines each
+# start /bin/true, so builds before and after a change can be compared:
+#
+#     bench/spawn.sh before/kush build/kush
+#
+# The number of commands defaults to 5000 and can be set with N.
+
+n=${N:-5000}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$n" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }' > "$script"
+
+for kush in "$@"; do
+    start=$(date +%s%N)
+    "$kush" < "$script" > /dev/null
+    ms=$((($(date +%s%N) - start) / 1000000))
+    echo "$kush: $n commands in $ms ms, $((n * 1000 / (ms > 0 ? ms : 1))) commands/s"
+done
@@ -0,0 +1,85 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of kush_tokenize() on generated command lines of 1 to 16 MiB. The time per byte stays the same
+// for every size if the tokenizer scales linearly. Three kinds of lines are tokenized: many short words with quotes
+// and escapes mixed in, a single quoted argument spanning the whole line, and words with parameters, which are
+// written to a buffer of their own.
+
+#define main kush_main
+#include "../kush.c"
+#undef main
+
+// Pieces the lines are made of, repeated until the line has the size asked for
+const char *bench_pieces[][2] = {
+        {"words", "foo\"bar baz\"qux 'single quoted' plain esc\\ aped -flag=value "},
+        {"quoted", "a long quoted argument with spaces "},
+        {"params", "pre$HOME \"${USER:-nobody} x\" $1 plain "}
+};
+
+// Returns a line of size bytes made of piece, as one quoted argument if quoted is true
+char *bench_line(const char *piece, size_t size, int quoted) {
+    char *line = malloc(size + 1);
+    size_t piece_len = strlen(piece);
+    size_t len = 0;
+
+    if (!line) exit(EXIT_FAILURE);
+    if (quoted) line[len++] = '"';
+    while (len + piece_len + 1 < size) {
+        memcpy(line + len, piece, piece_len);
+        len += piece_len;
+    }
+    if (quoted) line[len++] = '"';
+    line[len] = '\0';
+
+    return line;
+}
+
+int main() {
+    kush_vars_init();
+    printf("%-7s %9s %10s %8s\n", "line", "MiB", "ms", "ns/byte");
+    for (size_t kind = 0; kind < sizeof(bench_pieces) / sizeof(bench_pieces[0]); kind++) {
+        for (size_t mib = 1; mib <= 16; mib *= 2) {
+            size_t size = mib << 20;
+            char *line = bench_line(bench_pieces[kind][1], size, kind == 1);
+            char *copy = malloc(size + 1);
+            long best = -1;
+
+            if (!copy) exit(EXIT_FAILURE);
+            for (int run = 0; run < 3; run++) { // The best of three runs
+                struct timespec start, end;
+                int incomplete;
+                long ns;
+
+                strcpy(copy, line); // The tokenizer writes over its input
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (!kush_tokenize(copy, &incomplete)) exit(EXIT_FAILURE);
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                kush_arena_reset(&line_arena);
+
+                ns = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+                if (best < 0 || ns < best) best = ns;
+            }
+            printf("%-7s %9zu %10.1f %8.2f\n", bench_pieces[kind][0], mib, best / 1e6, (double) best / size);
+            free(copy);
+            free(line);
+        }
+    }
+
+    return 0;
+}
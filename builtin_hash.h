@@ -0,0 +1,36 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Hash of the built-in names. gen_builtins.c builds the perfect hash with it and the header it generates includes
+// this file, so the table and the lookups in kush always use the same function.
+
+#ifndef KUSH_BUILTIN_HASH_H
+#define KUSH_BUILTIN_HASH_H
+
+#include <stdint.h>
+
+static inline uint32_t kush_builtin_hash(const char *name) {
+    uint32_t hash = 2166136261u; // FNV-1a
+
+    while (*name) hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    hash ^= hash >> 15;
+    hash *= 0x2c1b3c6du;
+    return hash ^ (hash >> 12);
+}
+
+#endif
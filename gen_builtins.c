@@ -0,0 +1,167 @@
+/*
+ * kush - The knowable unix shell
+ * Copyright (C) 2023  Yannic Wehner
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Build-time generator for the lookup table of the built-in commands listed in builtins.def.
+// It writes a header with a minimal perfect hash of the names, built with hash-and-displace: the names are
+// hashed into buckets, and for every bucket a displacement is searched that moves all its names into free slots
+// of the table. A lookup then costs one hash of the name, two table reads and a single strcmp().
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "builtin_hash.h"
+
+// List of the built-ins. Benchmarks build the generator with a longer list of their own.
+#ifndef KUSH_BUILTINS_DEF
+#define KUSH_BUILTINS_DEF "builtins.def"
+#endif
+
+// Names of all built-ins
+const char *names[] = {
+#define KUSH_BUILTIN(name, func, flags) #name,
+#include KUSH_BUILTINS_DEF
+#undef KUSH_BUILTIN
+};
+
+#define NUM_NAMES ((int) (sizeof(names) / sizeof(names[0])))
+
+// Slot of a name with the given hash and displacement. The step is odd, so every displacement of a bucket
+// reaches a different slot until the table has been walked through.
+static inline uint32_t slot_of(uint32_t hash, uint32_t disp, uint32_t mask) {
+    return ((hash >> 16) + disp * ((hash & 0xffff) | 1)) & mask;
+}
+
+// Returns the smallest power of two that is at least n
+int pow2_at_least(int n) {
+    int size = 1;
+
+    while (size < n) size *= 2;
+    return size;
+}
+
+int main(int argc, char **argv) {
+    int num_buckets = pow2_at_least(NUM_NAMES / 2 + 1);
+    int num_slots = pow2_at_least(NUM_NAMES + NUM_NAMES / 4 + 1);
+    uint32_t hashes[NUM_NAMES];
+    int *bucket_of = malloc(NUM_NAMES * sizeof(int));
+    int *bucket_size = calloc(num_buckets, sizeof(int));
+    int *order = malloc(num_buckets * sizeof(int));
+    unsigned *disp = calloc(num_buckets, sizeof(unsigned));
+    int *slots = malloc(num_slots * sizeof(int));
+    FILE *out;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <output header>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!bucket_of || !bucket_size || !order || !disp || !slots) {
+        fprintf(stderr, "gen_builtins: Allocation error\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < NUM_NAMES; i++) {
+        hashes[i] = kush_builtin_hash(names[i]);
+        for (int j = 0; j < i; j++) {
+            if (hashes[i] == hashes[j]) {
+                fprintf(stderr, "gen_builtins: '%s' and '%s' have the same hash\n", names[j], names[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        bucket_of[i] = (int) (hashes[i] % (uint32_t) num_buckets);
+        bucket_size[bucket_of[i]]++;
+    }
+
+    // Place the largest buckets first, while there is still plenty of room
+    for (int i = 0; i < num_buckets; i++) order[i] = i;
+    for (int i = 1; i < num_buckets; i++) {
+        for (int j = i; j > 0 && bucket_size[order[j]] > bucket_size[order[j - 1]]; j--) {
+            int tmp = order[j];
+
+            order[j] = order[j - 1];
+            order[j - 1] = tmp;
+        }
+    }
+
+    for (int i = 0; i < num_slots; i++) slots[i] = -1;
+    for (int i = 0; i < num_buckets && bucket_size[order[i]] > 0; i++) {
+        int bucket = order[i];
+        unsigned d;
+
+        for (d = 0; d < 65536; d++) { // Try displacements until all names of the bucket fit
+            int fits = 1;
+
+            for (int j = 0; j < NUM_NAMES && fits; j++) {
+                if (bucket_of[j] != bucket) continue;
+
+                uint32_t slot = slot_of(hashes[j], d, num_slots - 1);
+
+                if (slots[slot] >= 0) fits = 0;
+                // Names of the same bucket mustn't collide with each other either
+                for (int k = 0; k < j && fits; k++) {
+                    if (bucket_of[k] == bucket && slot_of(hashes[k], d, num_slots - 1) == slot) fits = 0;
+                }
+            }
+            if (fits) break;
+        }
+        if (d == 65536) {
+            fprintf(stderr, "gen_builtins: No displacement found for bucket %d\n", bucket);
+            return EXIT_FAILURE;
+        }
+
+        disp[bucket] = d;
+        for (int j = 0; j < NUM_NAMES; j++) {
+            if (bucket_of[j] == bucket) slots[slot_of(hashes[j], d, num_slots - 1)] = j;
+        }
+    }
+
+    out = fopen(argv[1], "w");
+    if (!out) {
+        perror("gen_builtins: Error opening the output header");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out, "// Generated by gen_builtins from %s, do not edit.\n\n", KUSH_BUILTINS_DEF);
+    fprintf(out, "#include \"builtin_hash.h\"\n\n");
+    fprintf(out, "#define KUSH_NUM_BUILTINS %d\n\n", NUM_NAMES);
+    fprintf(out, "static const uint16_t kush_builtin_disp[%d] = {", num_buckets);
+    for (int i = 0; i < num_buckets; i++) {
+        fprintf(out, "%s%u", i % 16 ? ", " : i ? ",\n        " : "\n        ", disp[i]); // 16 values per line
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "static const int16_t kush_builtin_slots[%d] = {", num_slots);
+    for (int i = 0; i < num_slots; i++) {
+        fprintf(out, "%s%d", i % 16 ? ", " : i ? ",\n        " : "\n        ", slots[i]);
+    }
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "// Returns the index in builtins.def of the only built-in name could be, or -1.\n"
+                 "// The caller still has to compare the names.\n"
+                 "static inline int kush_builtin_index(const char *name) {\n"
+                 "    uint32_t hash = kush_builtin_hash(name);\n"
+                 "    uint32_t disp = kush_builtin_disp[hash %% %d];\n\n"
+                 "    return kush_builtin_slots[((hash >> 16) + disp * ((hash & 0xffff) | 1)) & %d];\n"
+                 "}\n", num_buckets, num_slots - 1);
+
+    if (fclose(out) != 0) {
+        perror("gen_builtins: Error writing the output header");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -16,13 +16,41 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <ctype.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <limits.h>
 #include <pwd.h>
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <termios.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+
+#include "kush_builtins.h"
 
 #define LOGO_ART    "Welcome to\n" \
                     "  _              _     \n" \
@@ -38,274 +66,8543 @@
 #define KUSH_PROMPT "[%s@%s:%s]> "
 // Initial size for token buffer
 #define KUSH_TOK_BUFF_SIZE 64
-// Characters that will delimit one token from the next
-#define KUSH_TOK_DELIM " \t\r\n\a"
+// Size of the buffer input is read into from stdin
+#define KUSH_IN_BUFF_SIZE 4096
+// Size of the buffer for output written by kush itself
+#define KUSH_OUT_BUFF_SIZE (64 * 1024)
+// Size of pipes that are written by programs in a pipeline
+#define KUSH_PIPE_SIZE (1024 * 1024)
 
 
-// Boolean value used to look up if the prompt already has been printed
-int printed_prompt = 0;
-// Boolean value used to look up if a child process is currently running
-int child_running = 0;
+// Boolean value telling if kush reads its commands from a terminal. Set once at startup.
+int interactive = 0;
+// Exit status of the last command
+int last_status = 0;
+// Exit status of every stage of the last pipeline, pipe_num_status is 0 if the last command wasn't a pipeline
+int *pipe_status = NULL;
+int pipe_num_status = 0;
+// Boolean value for the pipefail option. If set, a pipeline fails if any of its stages fails.
+int opt_pipefail = 0;
 
-// Will try to look up the needed values like the username, system-name and working directory
-// and print the prompt line on success. If the lookup of the current working directory fails,
-// the program will exit with a failure exit code.
-// For the username and system-name '<UNKNOWN>' will be used if the lookup fails.
-void kush_print_prompt() {
-    int errcode;
-    char hostname[HOST_NAME_MAX + 1];
-    struct passwd *p = NULL;
-    char *username = NULL;
-    char cwd[PATH_MAX + 1];
-    char *unknown = "<UNKNOWN>"; // Default name used if username or system-name lookup fails
+// Per-line arena allocator
+// -----------------------------------------------------------------------------------------
+// Everything allocated while handling one command line (the line itself, the token list, ...) comes from an arena.
+// Allocating is a pointer bump, and once the line has been handled the whole arena is dropped at once in O(1).
+// The blocks of the arena are kept for the next line, so in the steady state handling a line doesn't call malloc().
 
-    if (!printed_prompt) { // If the prompt for the current iteration hasn't been printed yet...
-        // Try to look up the current working directory.
-        if (getcwd(cwd, sizeof(cwd))) { // If the working directory lookup was successful...
-            // Get username
-            p = getpwuid(geteuid());
-            if (p == NULL) username = unknown;
-            else username = p->pw_name;
+// Default size of a single arena block
+#define KUSH_ARENA_BLOCK_SIZE (64 * 1024)
+// Alignment of every arena allocation
+#define KUSH_ARENA_ALIGN 16
 
-            // Get hostname
-            errcode = gethostname(hostname, sizeof(hostname));
-            if (errcode > 0) strcpy(hostname, unknown);
+// A block of memory owned by an arena
+typedef struct kush_arena_block {
+    struct kush_arena_block *next; // Next block of the arena, already allocated but not in use yet
+    size_t size; // Usable size of data
+    size_t used; // Number of bytes of data in use
+    _Alignas(KUSH_ARENA_ALIGN) char data[];
+} kush_arena_block;
 
-            // Print prompt to stdout
-            printf(KUSH_PROMPT, username, hostname, cwd);
-            fflush(stdout);
-        } else exit(EXIT_FAILURE);
+// Arena allocator with some counters to check how well it is doing
+typedef struct kush_arena {
+    kush_arena_block *first; // First block of the arena
+    kush_arena_block *cur; // Block allocations are currently taken from
+    char *last; // Start of the most recent allocation, which can be grown in place
+    size_t in_use; // Bytes handed out since the last reset
+    size_t peak; // Highest value in_use has ever reached
+    size_t reserved; // Bytes allocated for blocks
+    unsigned long mallocs; // Number of malloc() calls done for blocks
+    unsigned long resets; // Number of resets
+} kush_arena;
+
+// Arena backing all allocations needed to handle the current command line
+kush_arena line_arena = {0};
+
+// Rounds size up to the arena alignment
+size_t kush_arena_round(size_t size) {
+    return (size + KUSH_ARENA_ALIGN - 1) & ~(size_t) (KUSH_ARENA_ALIGN - 1);
+}
+
+// Returns size bytes of memory from the arena. The memory stays valid until the arena is reset.
+void *kush_arena_alloc(kush_arena *arena, size_t size) {
+    kush_arena_block *block = arena->cur;
+
+    size = kush_arena_round(size ? size : 1);
+
+    // Move on to the next block until one has enough space left. Blocks after cur have been released by a reset.
+    while (block == NULL || block->used + size > block->size) {
+        if (block && block->next) {
+            block = block->next;
+            block->used = 0;
+            continue;
+        }
+
+        // No block left that is large enough, so a new one is needed
+        size_t block_size = size > KUSH_ARENA_BLOCK_SIZE ? size : KUSH_ARENA_BLOCK_SIZE;
+        kush_arena_block *new_block = malloc(sizeof(kush_arena_block) + block_size);
+        if (!new_block) {
+            fprintf(stderr, "kush: Arena allocation error");
+            exit(EXIT_FAILURE);
+        }
+        new_block->size = block_size;
+        new_block->used = 0;
+        new_block->next = NULL;
+        arena->mallocs++;
+        arena->reserved += block_size;
+
+        if (block) block->next = new_block;
+        else if (arena->first) { // Only happens if the first block is too small, keep the others behind the new one
+            new_block->next = arena->first;
+            arena->first = new_block;
+        } else arena->first = new_block;
+        block = new_block;
     }
+
+    arena->cur = block;
+    arena->last = block->data + block->used;
+    block->used += size;
+    arena->in_use += size;
+    if (arena->in_use > arena->peak) arena->peak = arena->in_use;
+
+    return arena->last;
 }
 
-// Function to catch and handle signals
-void sig_handler(int signum) {
+// Grows an allocation of the arena from old_size to new_size bytes and returns its new address.
+// The most recent allocation is grown in place if its block still has room, otherwise the data is copied.
+void *kush_arena_grow(kush_arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    kush_arena_block *block = arena->cur;
+    void *new_ptr;
 
-    // Handle 'SIGINT' signal
-    if (signum == SIGINT) {
+    if (ptr != NULL && ptr == arena->last) {
+        size_t offset = arena->last - block->data;
+        size_t old_end = block->used;
+        size_t new_end = offset + kush_arena_round(new_size);
 
-        // Only show the exit text if no child process is running
-        if (!child_running) puts("\nTo exit kush type 'exit'.");
-        else puts("");
+        if (new_end <= block->size) {
+            block->used = new_end;
+            arena->in_use += new_end - old_end;
+            if (arena->in_use > arena->peak) arena->peak = arena->in_use;
+            return ptr;
+        }
+    }
 
-        // At this point a new prompt always should be printed, so we set printed_prompt to false.
-        printed_prompt = 0;
-        kush_print_prompt();
-        // Prompt has been printed, so we set it back to true.
-        printed_prompt = 1;
+    new_ptr = kush_arena_alloc(arena, new_size);
+    if (ptr) memcpy(new_ptr, ptr, old_size);
+    return new_ptr;
+}
+
+// Releases everything allocated from the arena at once. The blocks themselves are kept for reuse.
+void kush_arena_reset(kush_arena *arena) {
+    arena->cur = arena->first;
+    if (arena->cur) arena->cur->used = 0;
+    arena->last = NULL;
+    arena->in_use = 0;
+    arena->resets++;
+}
+
+// Position in an arena, see kush_arena_mark()
+typedef struct kush_arena_mark {
+    kush_arena_block *block;
+    size_t used;
+    size_t in_use;
+} kush_arena_mark;
+
+// Returns the current position of the arena. Releasing the mark later frees everything allocated after it, which
+// keeps loops in scripts from growing the arena with every iteration.
+kush_arena_mark kush_arena_mark_get(kush_arena *arena) {
+    return (kush_arena_mark) {arena->cur, arena->cur ? arena->cur->used : 0, arena->in_use};
+}
+
+// Releases everything allocated from the arena since mark was taken
+void kush_arena_release(kush_arena *arena, kush_arena_mark mark) {
+    arena->cur = mark.block ? mark.block : arena->first;
+    if (arena->cur) arena->cur->used = mark.used;
+    arena->last = NULL;
+    arena->in_use = mark.in_use;
+}
+// -----------------------------------------------------------------------------------------
+
+// Variables
+// -----------------------------------------------------------------------------------------
+// Shell and environment variables live in one open addressing hash table. Variable names are interned: every name
+// is stored exactly once in a pool that is never freed, so an entry stays in the table for good once its name has
+// been seen, and unsetting a variable only drops its value. That way the table never needs tombstones.
+// The environment handed to programs is built from the exported variables. It is only rebuilt after an exported
+// variable has changed, so launching a program never has to copy the environment.
+
+// The variable is part of the environment of launched programs
+#define KUSH_VAR_EXPORT 0x1
+
+// Initial number of slots in the variable table, has to be a power of two
+#define KUSH_VAR_TABLE_SIZE 128
+
+// A shell variable
+typedef struct kush_var {
+    const char *name; // Interned name, NULL if the slot is empty
+    size_t name_len;
+    char *value; // NULL if the variable is unset
+    int flags; // Combination of KUSH_VAR_* flags
+    struct kush_function *func; // Function defined with this name, NULL if there is none
+} kush_var;
+
+kush_arena name_pool = {0}; // Interned variable names, never reset
+kush_var *var_table = NULL; // Open addressing table of all variables
+size_t var_size = 0; // Number of slots in var_table
+size_t var_used = 0; // Number of occupied slots in var_table
+int env_dirty = 1; // Boolean value telling if an exported variable changed since the environment was built
+char **env_block = NULL; // Environment built by kush_env_update(), NULL while environ is the one we started with
+// Held while environ is replaced and by the prompt segment worker while it launches a program with it
+pthread_mutex_t env_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns true if c may appear in a variable name, first tells if it is the first character of the name
+int kush_var_char(char c, int first) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
+
+// Returns the length of the variable name str starts with, 0 if it doesn't start with one
+size_t kush_var_name_len(const char *str) {
+    size_t len = 0;
+
+    while (kush_var_char(str[len], len == 0)) len++;
+
+    return len;
+}
+
+// FNV-1a hash of a variable name of the given length
+size_t kush_var_hash(const char *name, size_t len) {
+    size_t hash = 14695981039346656037UL;
+
+    for (size_t i = 0; i < len; i++) hash = (hash ^ (unsigned char) name[i]) * 1099511628211UL;
+
+    return hash;
+}
+
+// Returns the slot of the variable name (of length len). The slot is empty if the name has never been seen.
+kush_var *kush_var_slot(const char *name, size_t len) {
+    size_t i = kush_var_hash(name, len) & (var_size - 1);
+
+    while (var_table[i].name && (var_table[i].name_len != len || memcmp(var_table[i].name, name, len) != 0)) {
+        i = (i + 1) & (var_size - 1);
     }
+
+    return &var_table[i];
 }
 
-// Reads a whole line from stdin into a dynamically sized buffer and returns a pointer to the buffer
-char *kush_read_line() {
-    char *line = NULL; // getline() will allocate buffer and set memory address accordingly
-    size_t buff_size = 0; // getline() will set size accordingly
+// Returns the variable name (of length len), adding an unset variable with an interned copy of the name if it
+// doesn't exist yet
+kush_var *kush_var_intern(const char *name, size_t len) {
+    kush_var *var;
 
-    if (getline(&line, &buff_size, stdin) == -1) { // Handle failure to read a line
-        // Buffer should be freed when getline() fails
-        free(line);
+    if (var_used * 2 >= var_size) { // Keep the table at most half full
+        kush_var *old = var_table;
+        size_t old_size = var_size;
 
-        // If eof was reached (for example when reading commands from a file) the read was finished successfully.
-        if (feof(stdin)) exit(EXIT_SUCCESS);
+        var_size = old_size ? old_size * 2 : KUSH_VAR_TABLE_SIZE;
+        var_table = calloc(var_size, sizeof(kush_var));
+        if (!var_table) {
+            fprintf(stderr, "kush: Variable table allocation error");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].name) *kush_var_slot(old[i].name, old[i].name_len) = old[i];
+        }
+        free(old);
+    }
 
-        // Else the read failed, and we exit with a failure.
-        perror("kush: Error reading line");
+    var = kush_var_slot(name, len);
+    if (!var->name) {
+        char *interned = kush_arena_alloc(&name_pool, len + 1);
+
+        memcpy(interned, name, len);
+        interned[len] = '\0';
+        var->name = interned;
+        var->name_len = len;
+        var_used++;
+    }
+
+    return var;
+}
+
+// Returns the value of the variable name (of length len) or NULL if it isn't set
+const char *kush_var_lookup(const char *name, size_t len) {
+    kush_var *var;
+
+    if (!var_table) return NULL;
+    var = kush_var_slot(name, len);
+
+    return var->name ? var->value : NULL;
+}
+
+// Returns the value of the variable name or NULL if it isn't set
+const char *kush_var_get(const char *name) {
+    return kush_var_lookup(name, strlen(name));
+}
+
+// Sets the variable name (of length len) to a copy of value, or unsets it if value is NULL. flags are added to the
+// flags of the variable.
+void kush_var_set(const char *name, size_t len, const char *value, int flags) {
+    kush_var *var = kush_var_intern(name, len);
+    char *copy = value ? strdup(value) : NULL; // Copied first, value may be the current value of the variable
+
+    if (value && !copy) {
+        fprintf(stderr, "kush: Variable allocation error");
         exit(EXIT_FAILURE);
     }
+    free(var->value);
+    var->value = copy;
+    if ((var->flags | flags) & KUSH_VAR_EXPORT) env_dirty = 1;
+    var->flags = value ? var->flags | flags : 0; // An unset variable is forgotten completely
+}
 
-    // If we have read a line from stdin we need to print a new prompt after, so we set printed_prompt to false
-    printed_prompt = 0;
-    return line;
+// Imports the environment kush was started with
+void kush_vars_init() {
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+
+        if (eq) kush_var_set(*env, eq - *env, eq + 1, KUSH_VAR_EXPORT);
+    }
+    env_dirty = 0; // environ still is exactly what was imported
 }
 
-// Splits the given string into a list of tokens. Splits on characters defined by KUSH_TOK_DELIM.
-char **kush_tokenize(char *user_in) {
-    int buff_size = KUSH_TOK_BUFF_SIZE; // Current buffer size
-    int pos = 0; // Current token position in the token list
-    char **tokens = malloc(buff_size * sizeof(char *)); // Buffer for the token list
-    char *token = NULL; // Will hold the pointer to start of the current token
+// Rebuilds the environment from the exported variables if one of them has changed since the last time. The new
+// environment is a single allocation holding both the vector and its strings, and it replaces environ.
+void kush_env_update() {
+    size_t num_vars = 0;
+    size_t size = 0;
+    char **vector;
+    char *str;
 
-    if (!tokens) {
-        fprintf(stderr, "kush: Token allocation error");
+    if (!env_dirty) return;
+
+    for (size_t i = 0; i < var_size; i++) {
+        if (!var_table[i].value || !(var_table[i].flags & KUSH_VAR_EXPORT)) continue;
+        num_vars++;
+        size += var_table[i].name_len + strlen(var_table[i].value) + 2;
+    }
+
+    vector = malloc((num_vars + 1) * sizeof(char *) + size);
+    if (!vector) {
+        fprintf(stderr, "kush: Environment allocation error");
         exit(EXIT_FAILURE);
     }
+    str = (char *) (vector + num_vars + 1);
+    num_vars = 0;
+    for (size_t i = 0; i < var_size; i++) {
+        if (!var_table[i].value || !(var_table[i].flags & KUSH_VAR_EXPORT)) continue;
+        vector[num_vars++] = str;
+        str += sprintf(str, "%s=%s", var_table[i].name, var_table[i].value) + 1;
+    }
+    vector[num_vars] = NULL;
 
-    // Get the first token. strtok() will return a pointer to the start of the first token
-    // and replaces the first occurrence of a defined delimiter with '/0' to end the string there.
-    token = strtok(user_in, KUSH_TOK_DELIM);
-    while (token != NULL) { // while there are new tokens...
-        // Check if token starts with a singe-quote or double-quote
-        if (strncmp(token, "\"", 1) == 0 || strncmp(token, "'", 1) == 0) { // If so...
-            char quote_type = token[0]; // Save first character to determine quote type (single or double)
-            // Advance the start of the string by one character as we no longer need the quote sign in the token string
-            char *start = token + 1;
-            while (token != NULL // While there are still new tokens...
-                   && (
-                           (quote_type == '"' && strcmp(&token[strlen(token) - 1], "\"") != 0)
-                           || // and the tokens don't end with another quote character to terminate the token...
-                           (quote_type == '\'' && strcmp(&token[strlen(token) - 1], "'") != 0)
-                   )) {
-                // Replace the string terminator with a space again to keep the token from ending at that position...
-                token[strlen(token)] = ' ';
-                // and try to get the next token.
-                token = strtok(NULL, KUSH_TOK_DELIM);
-            }
-
-            unsigned long last = strlen(start) - 1; // Last character of the token string
-            // If last character is the matching closing quote...
-            if (quote_type == '"' && strcmp(&start[last], "\"") == 0
-                || quote_type == '\'' && strcmp(&start[last], "'") == 0) {
-                start[last] = '\0'; // Replace last space with a string terminator to let the token string end.
-                tokens[pos] = start; // Add the pointer to the start of the whole token to the token list.
-            } else {
-                fprintf(stderr, "kush: Missing closing ");
-                if (quote_type == '"') fprintf(stderr, "'\"'. Input invalid.\n");
-                else if (quote_type == '\'') fprintf(stderr, "\"'\". Input invalid.\n");
-                return NULL;
-            }
-        } else { // If token doesn't start with a quote...
-            tokens[pos] = token; // Directly add its pointer to the token list.
-        }
-
-        pos++; // In any case we advance the position
-
-        token = strtok(NULL, KUSH_TOK_DELIM); // Get the next token
-
-        // Try to increase token list buffer size if the buffer is full and there still is a next token
-        if (pos >= buff_size && token != NULL) {
-            buff_size += KUSH_TOK_BUFF_SIZE;
-            tokens = realloc(tokens, buff_size * sizeof(char *)); // NOLINT(bugprone-suspicious-realloc-usage)
-            if (!tokens) {
-                fprintf(stderr, "kush: Token allocation error");
-                exit(EXIT_FAILURE);
-            }
-        }
+    pthread_mutex_lock(&env_lock);
+    free(env_block);
+    env_block = environ = vector;
+    pthread_mutex_unlock(&env_lock);
+    env_dirty = 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// Everything needed to print the prompt, looked up once and kept until it changes
+typedef struct kush_prompt_ctx {
+    char username[LOGIN_NAME_MAX + 1];
+    char hostname[HOST_NAME_MAX + 1];
+    char cwd[PATH_MAX + 1];
+    char buff[sizeof(KUSH_PROMPT) + LOGIN_NAME_MAX + HOST_NAME_MAX + PATH_MAX]; // The rendered prompt
+    int len; // Length of the rendered prompt
+} kush_prompt_ctx;
+
+kush_prompt_ctx prompt_ctx = {0};
+
+// Renders the prompt into the prompt buffer, so printing it is a single write()
+void kush_prompt_render() {
+    prompt_ctx.len = snprintf(prompt_ctx.buff, sizeof(prompt_ctx.buff), KUSH_PROMPT,
+                              prompt_ctx.username, prompt_ctx.hostname, prompt_ctx.cwd);
+    if (prompt_ctx.len >= (int) sizeof(prompt_ctx.buff)) prompt_ctx.len = sizeof(prompt_ctx.buff) - 1;
+}
+
+// Looks up the current working directory for the prompt. The lookup fails if the directory has been removed, then
+// the prompt keeps the directory it showed last. At startup there is none, so $PWD or '<UNKNOWN>' is used.
+void kush_prompt_update_cwd() {
+    char cwd[sizeof(prompt_ctx.cwd)];
+
+    if (getcwd(cwd, sizeof(cwd))) {
+        strcpy(prompt_ctx.cwd, cwd);
+    } else if (prompt_ctx.cwd[0] == '\0') {
+        const char *pwd = kush_var_get("PWD");
+
+        snprintf(prompt_ctx.cwd, sizeof(prompt_ctx.cwd), "%s", pwd && *pwd ? pwd : "<UNKNOWN>");
     }
+    kush_prompt_render();
+}
+
+// Looks up the username and system-name for the prompt. '<UNKNOWN>' will be used if a lookup fails.
+// kush never changes its own user or system-name, so this only has to be done once at startup. That keeps
+// getpwuid(), which might have to ask a network service, off the path of every single prompt.
+void kush_prompt_update_identity() {
+    struct passwd *p = getpwuid(geteuid());
+    char *unknown = "<UNKNOWN>"; // Default name used if username or system-name lookup fails
 
-    tokens[pos] = NULL; // Terminate the token list with NULL.
-    return tokens;
+    snprintf(prompt_ctx.username, sizeof(prompt_ctx.username), "%s", p ? p->pw_name : unknown);
+    if (gethostname(prompt_ctx.hostname, sizeof(prompt_ctx.hostname)) != 0) strcpy(prompt_ctx.hostname, unknown);
+    prompt_ctx.hostname[sizeof(prompt_ctx.hostname) - 1] = '\0'; // gethostname() doesn't terminate truncated names
+    kush_prompt_render();
 }
 
-// Built-in function definitions
-int kush_exit(char **args);
+// Prompt segments
+// -----------------------------------------------------------------------------------------
+// Segments add extra information like the git branch, the exit status and the duration of the last command to the
+// right end of the prompt line. Cheap segments are rendered together with the prompt. Expensive ones run on a worker
+// thread with a time budget each, so they can never block the input. Until the worker is done, the prompt shows the
+// value cached for the current directory (or a placeholder) and is redrawn in place once the result arrives.
 
-int kush_cd(char **args);
+// Maximum length of the text of a single segment
+#define KUSH_SEG_TEXT_SIZE 128
+// Number of directories the results of asynchronous segments are cached for
+#define KUSH_SEG_CACHE_SIZE 32
+// Text shown for an asynchronous segment that has no cached value yet
+#define KUSH_SEG_PLACEHOLDER "..."
+// Time budget of the git segment in milliseconds
+#define KUSH_GIT_BUDGET_MS 200
+// Minimum duration in milliseconds for a command to get the duration segment
+#define KUSH_DURATION_MIN_MS 500
+// Room taken by the status of one pipeline stage in the exit segment, a separator and an int
+#define KUSH_SEG_STATUS_SIZE 12
+// Room kept free behind the exit segment for the duration segment, with up to 20 digits of seconds
+#define KUSH_SEG_TOOK_SIZE (sizeof(" took:.0s") + 20)
 
-int kush_help(char **args);
+// A segment that is computed on the worker thread
+typedef struct kush_async_segment {
+    // Computes the text of the segment for the directory cwd into out. An empty text hides the segment.
+    // Has to give up after budget_ms milliseconds and return -1 in that case, 0 otherwise.
+    int (*compute)(const char *cwd, char *out, size_t size, long budget_ms);
+    long budget_ms;
+} kush_async_segment;
 
-// Built-in function commands list
-char *builtin_cmds[] = {
-        "exit",
-        "cd",
-        "help"
-};
+int kush_segment_git(const char *cwd, char *out, size_t size, long budget_ms);
 
-// List of corresponding functions
-int (*builtin_func[])(char **) = {
-        &kush_exit,
-        &kush_cd,
-        &kush_help
+// List of asynchronous segments in the order they are shown in
+kush_async_segment async_segments[] = {
+        {&kush_segment_git, KUSH_GIT_BUDGET_MS}
 };
 
-// Function that returns the number of builtin functions
-int kush_num_builtins() {
-    return sizeof(builtin_cmds) / sizeof(char *);
+#define KUSH_NUM_ASYNC_SEGS (sizeof(async_segments) / sizeof(kush_async_segment))
+
+// Results of the asynchronous segments for one directory
+typedef struct kush_seg_cache_entry {
+    char cwd[PATH_MAX + 1]; // Directory the results belong to, empty if the entry is unused
+    char text[KUSH_NUM_ASYNC_SEGS][KUSH_SEG_TEXT_SIZE];
+    unsigned long used; // Value of seg_clock when the entry was last used, to find the least recently used one
+} kush_seg_cache_entry;
+
+// State shared between the shell and the segment worker. Everything in here is protected by seg_lock.
+pthread_mutex_t seg_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t seg_cond = PTHREAD_COND_INITIALIZER;
+kush_seg_cache_entry seg_cache[KUSH_SEG_CACHE_SIZE];
+unsigned long seg_clock = 0;
+char seg_request[PATH_MAX + 1]; // Directory the worker should compute the segments for
+int seg_pending = 0; // Boolean value telling if seg_request has to be handled by the worker
+int prompt_active = 0; // Boolean value telling if the prompt is on screen and still waiting for input
+char prompt_line[2 * sizeof(prompt_ctx.buff)]; // The prompt including its segments, as last written to the terminal
+int prompt_line_len = 0;
+int term_cols = 0; // Width of the terminal, 0 if unknown
+int term_resized = 1; // Set on SIGWINCH, so the width is looked up again
+
+// How long the last command took
+long last_duration_ms = 0;
+
+// Returns true if any stage of the last pipeline failed
+int pipe_status_failed() {
+    for (int i = 0; i < pipe_num_status; i++) {
+        if (pipe_status[i] != 0) return 1;
+    }
+
+    return 0;
 }
 
-// Built-in function implementations
-// -----------------------------------------------------------------------------------------
-int kush_exit(char **args) {
-    (void) args; // Suppress 'unused parameter' warning
+// Returns the number of terminal columns a UTF-8 string takes up
+int kush_text_width(const char *text, int len) {
+    int width = 0;
 
-    return 1;
+    for (int i = 0; i < len; i++) {
+        if (((unsigned char) text[i] & 0xC0) != 0x80) width++; // Count everything but continuation bytes
+    }
+
+    return width;
 }
 
-int kush_cd(char **args) {
-    if (args[1] == NULL) {
-        fprintf(stderr, "kush: Expected argument to `cd` command\n");
-    } else {
-        if (chdir(args[1]) != 0) {
-            perror("kush: Failed to change directory");
+// Returns the cache entry for cwd or NULL if there is none. Has to be called with seg_lock held.
+kush_seg_cache_entry *kush_seg_cache_find(const char *cwd) {
+    for (int i = 0; i < KUSH_SEG_CACHE_SIZE; i++) {
+        if (strcmp(seg_cache[i].cwd, cwd) == 0) {
+            seg_cache[i].used = ++seg_clock;
+            return &seg_cache[i];
         }
     }
 
-    return 0;
+    return NULL;
 }
 
-int kush_help(char **args) {
-    (void) args; // Suppress 'unused parameter' warning
+// Replaces the least recently used cache entry with an empty one for cwd. Has to be called with seg_lock held.
+kush_seg_cache_entry *kush_seg_cache_insert(const char *cwd) {
+    kush_seg_cache_entry *oldest = &seg_cache[0];
 
-    puts(LOGO_ART);
-    puts("Type the program name and arguments and hit enter to start a program.\n"
-         "The usage of single-quotes and double-quotes (e.g. cd 'some dir') is supported.\n");
-    puts("The following built-in commands are supported:");
-    for (int i = 0; i < kush_num_builtins(); ++i) {
-        printf("- %s\n", builtin_cmds[i]);
+    for (int i = 1; i < KUSH_SEG_CACHE_SIZE; i++) {
+        if (seg_cache[i].used < oldest->used) oldest = &seg_cache[i];
     }
-    puts("");
 
+    memset(oldest, 0, sizeof(kush_seg_cache_entry));
+    snprintf(oldest->cwd, sizeof(oldest->cwd), "%s", cwd);
+    oldest->used = ++seg_clock;
+
+    return oldest;
+}
+
+// Renders the prompt followed by the right-aligned segments into prompt_line. entry holds the results of the
+// asynchronous segments or is NULL to show placeholders. Has to be called with seg_lock held.
+void kush_seg_render(kush_seg_cache_entry *entry) {
+    char right[(KUSH_NUM_ASYNC_SEGS + 2) * (KUSH_SEG_TEXT_SIZE + 1)];
+    int right_len = 0;
+    int col;
+
+    for (size_t i = 0; i < KUSH_NUM_ASYNC_SEGS; i++) {
+        const char *text = entry ? entry->text[i] : KUSH_SEG_PLACEHOLDER;
+
+        if (*text) right_len += sprintf(right + right_len, "%s%s", right_len ? " " : "", text);
+    }
+    if (last_status != 0 || pipe_status_failed()) { // Pipelines show the status of every stage
+        right_len += sprintf(right + right_len, "%sexit:", right_len ? " " : "");
+        if (pipe_num_status == 0) right_len += sprintf(right + right_len, "%d", last_status);
+        // Drop the statuses of the last stages rather than the duration if the line is full
+        for (int i = 0; i < pipe_num_status &&
+                        right_len + KUSH_SEG_STATUS_SIZE + KUSH_SEG_TOOK_SIZE <= sizeof(right); i++) {
+            right_len += sprintf(right + right_len, "%s%d", i ? "|" : "", pipe_status[i]);
+        }
+    }
+    if (last_duration_ms >= KUSH_DURATION_MIN_MS) {
+        right_len += sprintf(right + right_len, "%stook:%ld.%lds", right_len ? " " : "",
+                             last_duration_ms / 1000, last_duration_ms % 1000 / 100);
+    }
+
+    memcpy(prompt_line, prompt_ctx.buff, prompt_ctx.len);
+    prompt_line_len = prompt_ctx.len;
+
+    // Only draw the segments if they fit on the line next to the prompt.
+    // The cursor is saved and restored around them, so it stays right behind the prompt.
+    col = term_cols - kush_text_width(right, right_len) + 1;
+    if (right_len > 0 && col > kush_text_width(prompt_ctx.buff, prompt_ctx.len) + 1) {
+        prompt_line_len += sprintf(prompt_line + prompt_line_len, "\0337\033[%dG%s\0338", col, right);
+    }
+}
+
+// Draws the segments of the prompt that is currently on screen again, after the worker has updated them.
+// Has to be called with seg_lock held.
+void kush_seg_redraw(kush_seg_cache_entry *entry) {
+    char buff[sizeof(prompt_line) + 16];
+    int len;
+
+    kush_seg_render(entry);
+    // Clear the old segments right of the prompt and write the new ones, without moving the cursor
+    len = sprintf(buff, "\0337\033[%dG\033[K\0338", kush_text_width(prompt_ctx.buff, prompt_ctx.len) + 1);
+    memcpy(buff + len, prompt_line + prompt_ctx.len, prompt_line_len - prompt_ctx.len);
+    len += prompt_line_len - prompt_ctx.len;
+    write(STDOUT_FILENO, buff, len);
+}
+
+// Main function of the segment worker thread. Waits for requests and computes the asynchronous segments.
+void *kush_seg_worker(void *arg) {
+    char cwd[PATH_MAX + 1];
+    char text[KUSH_NUM_ASYNC_SEGS][KUSH_SEG_TEXT_SIZE];
+    int timed_out[KUSH_NUM_ASYNC_SEGS];
+    (void) arg; // Suppress 'unused parameter' warning
+
+    while (1) {
+        pthread_mutex_lock(&seg_lock);
+        while (!seg_pending) pthread_cond_wait(&seg_cond, &seg_lock);
+        seg_pending = 0;
+        strcpy(cwd, seg_request);
+        pthread_mutex_unlock(&seg_lock);
+
+        for (size_t i = 0; i < KUSH_NUM_ASYNC_SEGS; i++) {
+            text[i][0] = '\0';
+            timed_out[i] = async_segments[i].compute(cwd, text[i], KUSH_SEG_TEXT_SIZE,
+                                                     async_segments[i].budget_ms) != 0;
+        }
+
+        pthread_mutex_lock(&seg_lock);
+        kush_seg_cache_entry *entry = kush_seg_cache_find(cwd);
+        int found = entry != NULL;
+        int changed = !found;
+
+        if (!found) entry = kush_seg_cache_insert(cwd);
+        for (size_t i = 0; i < KUSH_NUM_ASYNC_SEGS; i++) {
+            // A segment that ran out of time keeps its previous value, if there is one
+            if (timed_out[i] && found) continue;
+            if (timed_out[i]) strcpy(text[i], "?");
+            if (strcmp(entry->text[i], text[i]) != 0) changed = 1;
+            strcpy(entry->text[i], text[i]);
+        }
+
+        // Only redraw if the prompt the results are for is still waiting for input
+        if (changed && prompt_active && !seg_pending && strcmp(cwd, prompt_ctx.cwd) == 0) kush_seg_redraw(entry);
+        pthread_mutex_unlock(&seg_lock);
+    }
+
+    return NULL;
+}
+
+// Starts the segment worker thread. Signals are blocked in the worker, so they are always handled by the shell.
+void kush_seg_init() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, &kush_seg_worker, NULL) != 0) {
+        fprintf(stderr, "kush: Failed to start the prompt segment worker\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Shows the current git branch and whether the working tree is dirty ('*'), using 'git status'.
+int kush_segment_git(const char *cwd, char *out, size_t size, long budget_ms) {
+    char *argv[] = {"git", "--no-optional-locks", "status", "--porcelain=v1", "--branch", "--untracked-files=no",
+                    NULL};
+    char buff[4096];
+    size_t len = 0;
+    char dir[PATH_MAX + 1];
+    struct stat st;
+    struct timespec start, now;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    int pipefd[2];
+    pid_t pid;
+    int errcode;
+    int timed_out = 0;
+
+    // Don't even start git if there is no repository in cwd or any of its parents
+    snprintf(dir, sizeof(dir), "%s", cwd);
+    while (1) {
+        size_t dir_len = strlen(dir);
+
+        snprintf(dir + dir_len, sizeof(dir) - dir_len, "/.git");
+        if (stat(dir, &st) == 0) break;
+        dir[dir_len] = '\0';
+
+        char *slash = strrchr(dir, '/');
+        if (!slash || dir_len == 0) return 0;
+        *slash = '\0';
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pipe2(pipefd, O_CLOEXEC) != 0) return 0;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addchdir_np(&actions, cwd);
+    // The worker blocks all signals, which git must not inherit
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    pthread_mutex_lock(&env_lock); // environ may be replaced by the main thread otherwise
+    errcode = posix_spawnp(&pid, "git", &actions, &attr, argv, environ);
+    pthread_mutex_unlock(&env_lock);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+    if (errcode != 0) {
+        close(pipefd[0]);
+        return 0;
+    }
+
+    // Read the output of git until it is done or its time is up
+    while (len < sizeof(buff) - 1) {
+        struct pollfd pfd = {.fd = pipefd[0], .events = POLLIN};
+        long left;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = budget_ms - ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0 || poll(&pfd, 1, (int) left) == 0) {
+            timed_out = 1;
+            break;
+        }
+
+        ssize_t num_read = read(pipefd[0], buff + len, sizeof(buff) - 1 - len);
+        if (num_read < 0 && errno == EINTR) continue;
+        if (num_read <= 0) break;
+        len += num_read;
+    }
+    close(pipefd[0]);
+    if (timed_out) kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    if (timed_out) return -1;
+    buff[len] = '\0';
+
+    // The first line looks like '## main...origin/main [ahead 1]', every other line is a modified file.
+    // If there were more modified files than fit into buff, git has been cut off, which is fine.
+    if (strncmp(buff, "## ", 3) != 0) return 0;
+    char *branch = buff + 3;
+    char *branch_end = strpbrk(branch, "\n");
+    if (branch_end) *branch_end = '\0';
+    if (strncmp(branch, "No commits yet on ", 18) == 0) branch += 18;
+    char *dots = strstr(branch, "...");
+    if (dots) *dots = '\0';
+
+    snprintf(out, size, "git:%s%s", branch, branch_end && branch_end[1] ? "*" : "");
     return 0;
 }
 // -----------------------------------------------------------------------------------------
 
-// Tries to execute the first entry in args as a child process and blocks until execution is finished
-int kush_exec(char **args) {
-    pid_t pid;
+// Prints the prompt line rendered from the prompt context, together with the prompt segments. The asynchronous
+// segments show the values cached for the current directory while the worker is asked to update them.
+// Nothing is printed if kush isn't running interactively, as nobody would see the prompt.
+void kush_print_prompt() {
+    struct winsize size;
 
-    pid = fork(); // Forks a child process
+    if (!interactive) return;
+    kush_env_update(); // The worker launches programs with environ
 
-    if (pid == 0) { // If we are in the child process...
-        execvp(args[0], args); // Try to execute the given file and pass it all the other parameters.
+    pthread_mutex_lock(&seg_lock);
+    if (term_resized) {
+        term_resized = 0;
+        term_cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 ? size.ws_col : 0;
+    }
 
-        // execvp will only return on error so if we get here we print the error message and exit the child process
-        perror("kush: Error executing the desired program");
+    kush_seg_render(kush_seg_cache_find(prompt_ctx.cwd));
+    write(STDOUT_FILENO, prompt_line, prompt_line_len);
+    prompt_active = 1;
+
+    // Let the worker update the asynchronous segments
+    strcpy(seg_request, prompt_ctx.cwd);
+    seg_pending = 1;
+    pthread_cond_signal(&seg_cond);
+    pthread_mutex_unlock(&seg_lock);
+}
+
+// Tells the segment worker that the prompt isn't waiting for input anymore, so it must not be redrawn
+void kush_prompt_done() {
+    if (!interactive) return;
+
+    pthread_mutex_lock(&seg_lock);
+    prompt_active = 0;
+    pthread_mutex_unlock(&seg_lock);
+}
+
+
+// Event loop
+// -----------------------------------------------------------------------------------------
+// The shell never does any work in a signal handler. In interactive mode the signals it cares about are blocked
+// and delivered through a signalfd instead, which is registered with one epoll instance together with stdin and
+// the pidfds of background processes. Whenever the shell waits for something, it waits on that instance and
+// handles whatever is ready synchronously, with the whole of libc at its disposal.
+
+int event_epoll = -1; // epoll instance with the signalfd, stdin and the pidfds of background processes
+int signal_fd = -1; // signalfd the blocked signals are read from, -1 in batch mode
+sigset_t shell_signals; // Signals delivered through signal_fd
+int stdin_ready = 0; // Boolean value telling if the last wait found input on stdin
+int child_changed = 1; // Boolean value telling if a SIGCHLD arrived, so stopped children have to be looked for
+
+// Creates the epoll instance and, in interactive mode, routes SIGINT, SIGWINCH and SIGCHLD through a signalfd.
+// Has to be called before any thread is started, so every thread inherits the blocked signals.
+void kush_event_init() {
+    struct epoll_event event = {.events = EPOLLIN};
+
+    event_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (event_epoll < 0) {
+        perror("kush: Error creating the epoll instance");
         exit(EXIT_FAILURE);
-    } else if (pid < 0) perror("kush: Error forking a child process");
-    else { // If we are in the parent process...
-        child_running = 1; // Set to true to indicate a child process is currently running.
-        waitpid(pid, NULL, 0); // Wait for the child process to end.
-        child_running = 0; // Set back to false as the child process has ended.
     }
 
-    return 0;
+    if (!interactive) return; // Without a terminal signals keep their default actions
+
+    sigemptyset(&shell_signals);
+    sigaddset(&shell_signals, SIGINT);
+    sigaddset(&shell_signals, SIGWINCH);
+    sigaddset(&shell_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &shell_signals, NULL);
+
+    signal_fd = signalfd(-1, &shell_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("kush: Error creating the signalfd");
+        exit(EXIT_FAILURE);
+    }
+    event.data.ptr = &signal_fd;
+    epoll_ctl(event_epoll, EPOLL_CTL_ADD, signal_fd, &event);
+    event.data.ptr = &stdin_ready;
+    epoll_ctl(event_epoll, EPOLL_CTL_ADD, STDIN_FILENO, &event);
 }
 
-// Tries to run the first entry in args as a build-in function and if it doesn't match any passes it on to kush_exec()
-int kush_run(char **args) {
-    if (args[0] == NULL) return 0;
+// Reads all pending signals from signal_fd and handles them. Returns true if a SIGINT was among them.
+int kush_signals_read() {
+    struct signalfd_siginfo info[16];
+    ssize_t num_read;
+    int interrupted = 0;
 
-    for (int i = 0; i < kush_num_builtins(); i++) {
-        if (strcmp(args[0], builtin_cmds[i]) == 0) return (*builtin_func[i])(args);
+    while ((num_read = read(signal_fd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < (size_t) num_read / sizeof(info[0]); i++) {
+            switch (info[i].ssi_signo) {
+                case SIGINT:
+                    interrupted = 1;
+                    break;
+                case SIGWINCH: // The terminal width is looked up again before the next prompt
+                    pthread_mutex_lock(&seg_lock);
+                    term_resized = 1;
+                    pthread_mutex_unlock(&seg_lock);
+                    break;
+                case SIGCHLD:
+                    child_changed = 1;
+                    break;
+                default:
+                    break;
+            }
+        }
     }
 
-    return kush_exec(args);
+    return interrupted;
 }
 
-// Main command loop for the shell
-void kush_loop() {
-    int exit; // Boolean value to check if the shell should exit
-    char *user_in = NULL; // Raw user input
-    char **tokens = NULL; // List of parsed tokens
+// Waits up to timeout milliseconds (-1 for no limit) for events and handles them. Defined with the job control,
+// as most events are about background jobs. Returns -1 if a SIGINT arrived.
+int kush_event_wait(int timeout);
+// -----------------------------------------------------------------------------------------
 
-    do {
-        kush_print_prompt(); // Print the prompt
+// Input read from stdin that hasn't been returned as part of a line yet
+char in_buff[KUSH_IN_BUFF_SIZE];
+size_t in_start = 0; // Start of the unread input in in_buff
+size_t in_end = 0; // End of the unread input in in_buff
 
-        user_in = kush_read_line(); // Get user input
-        tokens = kush_tokenize(user_in); // Parse to token list
+// Boolean value telling if a SIGINT discarded input while kush_read_line() waited for a line
+int line_interrupted = 0;
 
-        if (tokens == NULL) continue; // If tokens is NULL a parsing error has occurred and we start over.
+// Reads more input into in_buff, which has to be used up. In interactive mode it waits in the event loop, so signals
+// and jobs are handled meanwhile. Returns the number of bytes read, 0 at the end of the input and -1 if a SIGINT
+// arrived while waiting.
+ssize_t kush_read_input() {
+    ssize_t num_read;
 
-        exit = kush_run(tokens); // Try to run the given user command
+    while (interactive && !stdin_ready) {
+        if (kush_event_wait(-1) < 0) return -1;
+    }
+    stdin_ready = 0;
 
-        // Free buffers
-        free(user_in);
-        free(tokens);
-    } while (!exit);
+    do num_read = read(STDIN_FILENO, in_buff, sizeof(in_buff));
+    while (num_read < 0 && errno == EINTR);
+    if (num_read < 0) { // The read failed, and we exit with a failure.
+        perror("kush: Error reading line");
+        exit(EXIT_FAILURE);
+    }
+
+    in_start = 0;
+    in_end = num_read;
+    return num_read;
 }
 
-int main() {
-    signal(SIGINT, sig_handler); // Binds the signal to our handler function
-    kush_help(NULL); // Print help text on startup
+extern struct termios shell_tmodes; // See the job control section
+
+// The history is kept further down, see the history section
+extern ino_t hist_ino;
+void kush_hist_refresh();
+ssize_t kush_hist_search(const char *query, size_t len, size_t before);
+ssize_t kush_hist_adjacent(ssize_t start, int older);
+const char *kush_hist_text(size_t start, size_t *len);
+
+
+// Line editor
+// -----------------------------------------------------------------------------------------
+// Interactive shells read lines with a line editor of their own, which puts the terminal into non-canonical mode
+// and interprets every key itself. The editor remembers what the terminal shows after the prompt and where its
+// cursor is, so after a batch of keys it only sends what differs: the cursor is moved to the first changed
+// character, the rest of the line is written from there and anything the old line had beyond it is cleared. All
+// of that goes out with one write(). Pastes are bracketed by the terminal and inserted as a whole.
+
+// Maximum length of a history search
+#define KUSH_SEARCH_SIZE 256
+
+// State of the line editor
+typedef struct kush_editor {
+    char *line; // Line being edited, allocated from the line arena like everything else of the editor
+    size_t len;
+    size_t size;
+    size_t pos; // Offset of the cursor in the line
+    const char *prompt; // Prompt of the line, NULL for the prompt line of the shell
+    int prompt_width; // Number of columns the prompt takes up
+    int prompt_live; // Boolean value telling if the segment worker may still redraw the prompt line
+    int cols; // Width of the terminal
+    char *shown; // Text after the prompt as the terminal shows it
+    size_t shown_len;
+    size_t shown_size;
+    size_t shown_pos; // Offset in shown the cursor of the terminal is at
+    char *view; // Text shown during a history search
+    size_t view_size;
+    char *out; // Output collected for the next write()
+    size_t out_len;
+    size_t out_size;
+    char seq[16]; // Escape sequence being read, without its ESC
+    int seq_len; // Length of the escape sequence, -1 outside of one
+    int pasting; // Boolean value telling if the keys are part of a bracketed paste
+    int paste_cr; // Boolean value telling if the last pasted character was a carriage return
+    ssize_t browse; // History entry shown with Up and Down, -1 for the line being edited
+    ino_t browse_ino; // History file the entry is in
+    char *saved; // The line being edited while history entries are shown
+    size_t saved_len;
+    int searching; // Boolean value telling if a reverse history search (Ctrl-R) is active
+    char search[KUSH_SEARCH_SIZE]; // Text searched for
+    size_t search_len;
+    ssize_t match; // Offset of the history entry the search has found, -1 if there is none
+    ino_t match_ino; // History file the offset is in
+    int failed; // Boolean value telling if the last search found nothing
+    int tabbed; // Boolean value telling if the last key was Tab
+} kush_editor;
+
+// Position on the terminal, relative to the first row of the prompt
+typedef struct kush_cell {
+    int row;
+    int col;
+    int wrapped; // Boolean value telling if the character before filled the row above
+} kush_cell;
+
+// Makes sure buff, which holds len of its size bytes, has room for extra more
+void kush_edit_reserve(char **buff, size_t *size, size_t len, size_t extra) {
+    if (len + extra <= *size) return;
+
+    size_t new_size = *size ? *size * 2 : KUSH_IN_BUFF_SIZE; // Grown geometrically to keep long lines linear
+
+    if (new_size < len + extra) new_size = len + extra;
+    *buff = kush_arena_grow(&line_arena, *buff, len, new_size);
+    *size = new_size;
+}
+
+// Adds len bytes of str to the output
+void kush_edit_out(kush_editor *ed, const char *str, size_t len) {
+    kush_edit_reserve(&ed->out, &ed->out_size, ed->out_len, len);
+    memcpy(ed->out + ed->out_len, str, len);
+    ed->out_len += len;
+}
+
+// Adds a string formatted like with printf() to the output
+__attribute__((format(printf, 2, 3)))
+void kush_edit_outf(kush_editor *ed, const char *format, ...) {
+    char buff[64];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buff, sizeof(buff), format, args);
+    va_end(args);
+    kush_edit_out(ed, buff, len);
+}
+
+// Writes the collected output to the terminal
+void kush_edit_flush(kush_editor *ed) {
+    for (size_t done = 0; done < ed->out_len;) {
+        ssize_t num_written = write(STDOUT_FILENO, ed->out + done, ed->out_len - done);
+
+        if (num_written < 0 && errno != EINTR) break; // Nothing sensible is left to do if the terminal is gone
+        if (num_written > 0) done += num_written;
+    }
+    ed->out_len = 0;
+}
+
+// Returns where the character at offset end of text is shown, if text follows the prompt. Newlines start a new
+// row, every other character takes up a column, and a full row wraps to the next.
+kush_cell kush_edit_cell(const kush_editor *ed, const char *text, size_t end) {
+    kush_cell cell = {.row = ed->prompt_width / ed->cols, .col = ed->prompt_width % ed->cols, .wrapped = 0};
+
+    for (size_t i = 0; i < end; i++) {
+        if (text[i] == '\n') {
+            if (!cell.wrapped) cell.row++; // After a wrap the row has been started already
+            cell.col = 0;
+            cell.wrapped = 0;
+        } else if (((unsigned char) text[i] & 0xC0) != 0x80) {
+            cell.wrapped = ++cell.col == ed->cols;
+            if (cell.wrapped) {
+                cell.row++;
+                cell.col = 0;
+            }
+        }
+    }
+
+    return cell;
+}
+
+// Moves the cursor of the terminal from one cell to another
+void kush_edit_move(kush_editor *ed, kush_cell from, kush_cell to) {
+    if (to.row < from.row) kush_edit_outf(ed, "\x1b[%dA", from.row - to.row);
+    if (to.row > from.row) kush_edit_outf(ed, "\x1b[%dB", to.row - from.row);
+
+    if (to.col == from.col) return;
+    if (to.col == 0) kush_edit_out(ed, "\r", 1);
+    else if (to.col == from.col - 1) kush_edit_out(ed, "\b", 1);
+    else if (to.col < from.col) kush_edit_outf(ed, "\x1b[%dD", from.col - to.col);
+    else kush_edit_outf(ed, "\x1b[%dC", to.col - from.col);
+}
+
+// Brings the terminal from showing shown to showing len bytes of text, with the cursor at offset pos. Only the part
+// after the first difference is written.
+void kush_edit_render(kush_editor *ed, const char *text, size_t len, size_t pos) {
+    size_t same = 0; // Length of the part shown already
+    kush_cell end;
+
+    while (same < len && same < ed->shown_len && text[same] == ed->shown[same]) same++;
+    while (same > 0 && same < len && ((unsigned char) text[same] & 0xC0) == 0x80) same--; // Whole characters only
+
+    if (same < len || same < ed->shown_len) {
+        kush_cell cell = kush_edit_cell(ed, ed->shown, same);
+        // After filling the last column the terminal keeps the cursor there until the next character comes, so
+        // it's only at the start of the next row, where it's assumed to be, once that happened
+        int pending = 0;
+
+        kush_edit_move(ed, kush_edit_cell(ed, ed->shown, ed->shown_pos), cell);
+        for (size_t i = same; i < len; i++) {
+            if (text[i] == '\n') { // The rest of the row may still show old text
+                if (pending) kush_edit_out(ed, "\r\n", 2);
+                else if (cell.wrapped) kush_edit_out(ed, "\x1b[K", 3);
+                else kush_edit_out(ed, "\x1b[K\r\n", 5);
+                cell.row += !cell.wrapped;
+                cell.col = 0;
+                cell.wrapped = 0;
+                pending = 0;
+                continue;
+            }
+            kush_edit_out(ed, (unsigned char) text[i] < 0x20 ? " " : text + i, 1); // Control characters are blanks
+            if (((unsigned char) text[i] & 0xC0) == 0x80) continue;
+
+            cell.wrapped = ++cell.col == ed->cols;
+            pending = cell.wrapped;
+            if (cell.wrapped) {
+                cell.row++;
+                cell.col = 0;
+            }
+        }
+        if (pending) kush_edit_out(ed, "\r\n", 2);
+
+        end = kush_edit_cell(ed, ed->shown, ed->shown_len);
+        if (ed->shown_len > same && (end.row > cell.row || (end.row == cell.row && end.col > cell.col))) {
+            kush_edit_out(ed, "\x1b[J", 3);
+        }
+
+        kush_edit_reserve(&ed->shown, &ed->shown_size, 0, len);
+        memcpy(ed->shown + same, text + same, len - same);
+        ed->shown_len = len;
+        ed->shown_pos = len;
+    }
+
+    kush_edit_move(ed, kush_edit_cell(ed, ed->shown, ed->shown_pos), kush_edit_cell(ed, ed->shown, pos));
+    ed->shown_pos = pos;
+}
+
+// Clears everything the editor shows, including the prompt, and leaves the cursor where the prompt started
+void kush_edit_clear(kush_editor *ed) {
+    kush_cell cell = kush_edit_cell(ed, ed->shown, ed->shown_pos);
+
+    if (ed->prompt_live) kush_prompt_done(); // The segments mustn't be drawn into the rows cleared
+    ed->prompt_live = 0;
+    if (cell.row > 0) kush_edit_outf(ed, "\x1b[%dA", cell.row);
+    kush_edit_out(ed, "\r\x1b[J", 4);
+    ed->shown_len = 0;
+    ed->shown_pos = 0;
+}
+
+// Prints the prompt of the line at the cursor. The line itself follows with the next kush_edit_update().
+void kush_edit_prompt(kush_editor *ed) {
+    ed->shown_len = 0;
+    ed->shown_pos = 0;
+    if (ed->prompt) {
+        kush_edit_out(ed, ed->prompt, strlen(ed->prompt));
+        ed->prompt_width = kush_text_width(ed->prompt, (int) strlen(ed->prompt));
+    } else {
+        kush_edit_flush(ed); // kush_print_prompt() writes by itself
+        kush_print_prompt();
+        ed->prompt_width = kush_text_width(prompt_ctx.buff, prompt_ctx.len);
+        ed->prompt_live = 1;
+    }
+    ed->cols = term_cols > 0 ? term_cols : 80;
+}
+
+// Shows the state of the history search in place of the prompt and the line
+void kush_edit_show_search(kush_editor *ed) {
+    size_t text_len = 0;
+    const char *text = ed->match >= 0 ? kush_hist_text(ed->match, &text_len) : "";
+    int len;
+
+    kush_edit_reserve(&ed->view, &ed->view_size, 0, KUSH_SEARCH_SIZE + text_len + 32);
+    len = sprintf(ed->view, "(%sreverse-i-search)`%.*s': ", ed->failed ? "failed " : "", (int) ed->search_len,
+                  ed->search);
+    for (size_t i = 0; i < text_len; i++) ed->view[len++] = text[i] == '\n' ? ' ' : text[i]; // Keep it in one row
+    kush_edit_render(ed, ed->view, len, len);
+}
+
+// Shows the line as it is now
+void kush_edit_update(kush_editor *ed) {
+    if (ed->searching) {
+        kush_edit_show_search(ed);
+        return;
+    }
+    if (ed->prompt_live && ed->len > 0) { // Redrawing the segments would clear the line, so they stay as they are
+        kush_prompt_done();
+        ed->prompt_live = 0;
+    }
+    kush_edit_render(ed, ed->line, ed->len, ed->pos);
+}
+
+// Replaces the line with len bytes of text and puts the cursor at its end
+void kush_edit_set(kush_editor *ed, const char *text, size_t len) {
+    kush_edit_reserve(&ed->line, &ed->size, 0, len + 2);
+    memmove(ed->line, text, len);
+    ed->len = len;
+    ed->pos = len;
+}
+
+// Inserts len bytes of text at the cursor
+void kush_edit_insert(kush_editor *ed, const char *text, size_t len) {
+    kush_edit_reserve(&ed->line, &ed->size, ed->len, len + 2); // Room for the newline and terminator added at last
+    memmove(ed->line + ed->pos + len, ed->line + ed->pos, ed->len - ed->pos);
+    memcpy(ed->line + ed->pos, text, len);
+    ed->len += len;
+    ed->pos += len;
+}
+
+// Inserts pasted text at the cursor. Carriage returns are turned into newlines and other control characters
+// except tabs are dropped.
+void kush_edit_paste(kush_editor *ed, const char *text, size_t len) {
+    size_t start = 0;
+
+    for (size_t i = 0; i <= len; i++) {
+        if (i < len && ((unsigned char) text[i] >= 0x20 || text[i] == '\t')) {
+            ed->paste_cr = 0;
+            continue;
+        }
+        kush_edit_insert(ed, text + start, i - start);
+        start = i + 1;
+        if (i == len) break;
+
+        if (text[i] == '\r' || (text[i] == '\n' && !ed->paste_cr)) kush_edit_insert(ed, "\n", 1);
+        ed->paste_cr = text[i] == '\r';
+    }
+}
+
+// Deletes the bytes from offset start to end of the line and puts the cursor at start
+void kush_edit_delete(kush_editor *ed, size_t start, size_t end) {
+    memmove(ed->line + start, ed->line + end, ed->len - end);
+    ed->len -= end - start;
+    ed->pos = start;
+}
+
+// Returns the offset of the character before offset pos of the line
+size_t kush_edit_char_prev(const kush_editor *ed, size_t pos) {
+    while (pos > 0 && ((unsigned char) ed->line[--pos] & 0xC0) == 0x80);
+    return pos;
+}
+
+// Returns the offset of the character after offset pos of the line
+size_t kush_edit_char_next(const kush_editor *ed, size_t pos) {
+    while (pos < ed->len && ((unsigned char) ed->line[++pos] & 0xC0) == 0x80);
+    return pos < ed->len ? pos : ed->len;
+}
+
+// Returns the offset of the start of the word before offset pos of the line. Words are separated by blanks.
+size_t kush_edit_word_prev(const kush_editor *ed, size_t pos) {
+    while (pos > 0 && isspace((unsigned char) ed->line[pos - 1])) pos--;
+    while (pos > 0 && !isspace((unsigned char) ed->line[pos - 1])) pos--;
+    return pos;
+}
+
+// Returns the offset of the end of the word after offset pos of the line
+size_t kush_edit_word_next(const kush_editor *ed, size_t pos) {
+    while (pos < ed->len && isspace((unsigned char) ed->line[pos])) pos++;
+    while (pos < ed->len && !isspace((unsigned char) ed->line[pos])) pos++;
+    return pos;
+}
+
+// Shows the history entry before (older is true) or after the one shown. The line being edited is put aside
+// while entries are shown and comes back after the newest one.
+void kush_edit_browse(kush_editor *ed, int older) {
+    ssize_t entry;
+    size_t len;
+
+    if (ed->browse < 0 && !older) return;
+    if (ed->browse < 0) kush_hist_refresh();
+    if (ed->browse >= 0 && ed->browse_ino != hist_ino) return; // The history file has been replaced
+
+    entry = kush_hist_adjacent(ed->browse, older);
+    if (entry < 0 && older) return; // Nothing older
+
+    if (ed->browse < 0) { // Put the line aside
+        ed->saved = kush_arena_alloc(&line_arena, ed->len + 1);
+        memcpy(ed->saved, ed->line, ed->len);
+        ed->saved_len = ed->len;
+    }
+    ed->browse = entry;
+    ed->browse_ino = hist_ino;
+    if (entry < 0) kush_edit_set(ed, ed->saved, ed->saved_len);
+    else {
+        const char *text = kush_hist_text(entry, &len);
+
+        kush_edit_set(ed, text, len);
+    }
+}
+
+// Searches the history for the next entry containing the search text, starting at the current match if keep is
+// true and with the entry before it otherwise. Entries with the same text as the current match are skipped.
+void kush_edit_search(kush_editor *ed, int keep) {
+    size_t before = SIZE_MAX;
+    size_t match_len = 0;
+    const char *match_text = NULL;
+    ssize_t found;
+
+    if (ed->match >= 0 && ed->match_ino != hist_ino) ed->match = -1; // The history file has been replaced
+    if (ed->match >= 0) {
+        match_text = kush_hist_text(ed->match, &match_len);
+        if (keep && memmem(match_text, match_len, ed->search, ed->search_len)) {
+            ed->failed = 0;
+            return;
+        }
+        before = ed->match;
+    }
+
+    while ((found = kush_hist_search(ed->search, ed->search_len, before)) >= 0) {
+        size_t len;
+        const char *text = kush_hist_text(found, &len);
+
+        // Looked up again, the search may have mapped the history anew
+        if (ed->match >= 0) match_text = kush_hist_text(ed->match, &match_len);
+        if (ed->match < 0 || len != match_len || memcmp(text, match_text, len) != 0) break;
+        before = found;
+    }
+
+    if (found >= 0) {
+        ed->match = found;
+        ed->match_ino = hist_ino;
+    }
+    ed->failed = found < 0;
+}
+
+// Ends the history search. The entry found replaces the line if accept is true.
+void kush_edit_search_end(kush_editor *ed, int accept) {
+    ed->searching = 0;
+    if (accept && ed->match >= 0 && ed->match_ino == hist_ino) {
+        size_t len;
+        const char *text = kush_hist_text(ed->match, &len);
+
+        kush_edit_set(ed, text, len);
+        ed->browse = -1;
+    }
+    kush_edit_clear(ed);
+    kush_edit_prompt(ed);
+}
+
+// Handles a key pressed during a history search. Returns 1 if the line is complete and -1 if the key has to be
+// handled by the editor as usual, after the search has ended.
+int kush_edit_search_key(kush_editor *ed, char c) {
+    switch (c) {
+        case 0x12: // Ctrl-R, the next older match
+            kush_edit_search(ed, 0);
+            return 0;
+        case 0x7f: // Backspace, start over with the shorter text
+        case 0x08:
+            if (ed->search_len > 0) ed->search_len--;
+            ed->match = -1;
+            kush_edit_search(ed, 1);
+            return 0;
+        case 0x07: // Ctrl-G, back to the line as it was
+            kush_edit_search_end(ed, 0);
+            return 0;
+        case '\r': // Run the entry found
+        case '\n':
+            kush_edit_search_end(ed, 1);
+            return 1;
+        default:
+            break;
+    }
+
+    if ((unsigned char) c < 0x20) { // Any other control key keeps the entry found for editing
+        kush_edit_search_end(ed, 1);
+        return -1;
+    }
+    if (ed->search_len < KUSH_SEARCH_SIZE) ed->search[ed->search_len++] = c;
+    kush_edit_search(ed, 1);
+    return 0;
+}
+
+// Completion is further down, see the completion section
+void kush_edit_complete(kush_editor *ed, int again);
+
+// Handles the escape sequence of a key, without its ESC
+void kush_edit_sequence(kush_editor *ed, const char *seq) {
+    if (ed->pasting) { // Nothing in a paste is a key, but its end
+        if (strcmp(seq, "[201~") == 0) ed->pasting = 0;
+        return;
+    }
+
+    if (strcmp(seq, "[200~") == 0) ed->pasting = 1;
+    else if (strcmp(seq, "[D") == 0 || strcmp(seq, "OD") == 0) ed->pos = kush_edit_char_prev(ed, ed->pos);
+    else if (strcmp(seq, "[C") == 0 || strcmp(seq, "OC") == 0) ed->pos = kush_edit_char_next(ed, ed->pos);
+    else if (strcmp(seq, "[A") == 0 || strcmp(seq, "OA") == 0) kush_edit_browse(ed, 1);
+    else if (strcmp(seq, "[B") == 0 || strcmp(seq, "OB") == 0) kush_edit_browse(ed, 0);
+    else if (strcmp(seq, "[H") == 0 || strcmp(seq, "OH") == 0 || strcmp(seq, "[1~") == 0) ed->pos = 0;
+    else if (strcmp(seq, "[F") == 0 || strcmp(seq, "OF") == 0 || strcmp(seq, "[4~") == 0) ed->pos = ed->len;
+    else if (strcmp(seq, "[3~") == 0 && ed->pos < ed->len) {
+        kush_edit_delete(ed, ed->pos, kush_edit_char_next(ed, ed->pos));
+    } else if (strcmp(seq, "[1;5D") == 0 || strcmp(seq, "b") == 0) ed->pos = kush_edit_word_prev(ed, ed->pos);
+    else if (strcmp(seq, "[1;5C") == 0 || strcmp(seq, "f") == 0) ed->pos = kush_edit_word_next(ed, ed->pos);
+    else if (strcmp(seq, "d") == 0) kush_edit_delete(ed, ed->pos, kush_edit_word_next(ed, ed->pos));
+    // Other keys aren't bound
+}
+
+// Handles a key pressed while editing the line. Returns 1 if the line is complete and -1 at the end of the input.
+int kush_edit_key(kush_editor *ed, char c) {
+    int tabbed = ed->tabbed;
+
+    ed->tabbed = c == '\t';
+    if (ed->seq_len >= 0) { // Part of an escape sequence
+        if (ed->seq_len < (int) sizeof(ed->seq) - 1) ed->seq[ed->seq_len++] = c;
+        // A CSI or SS3 sequence goes on up to its final byte, any other key pressed with Alt is done
+        if ((ed->seq_len == 1 && (c == '[' || c == 'O')) || (ed->seq_len > 1 && (c < 0x40 || c > 0x7e))) return 0;
+        ed->seq[ed->seq_len] = '\0';
+        ed->seq_len = -1;
+        kush_edit_sequence(ed, ed->seq);
+        return 0;
+    }
+
+    switch (c) {
+        case '\r':
+        case '\n':
+            return 1;
+        case 0x1b:
+            ed->seq_len = 0;
+            return 0;
+        case 0x01: // Ctrl-A
+            ed->pos = 0;
+            return 0;
+        case 0x05: // Ctrl-E
+            ed->pos = ed->len;
+            return 0;
+        case 0x02: // Ctrl-B
+            ed->pos = kush_edit_char_prev(ed, ed->pos);
+            return 0;
+        case 0x06: // Ctrl-F
+            ed->pos = kush_edit_char_next(ed, ed->pos);
+            return 0;
+        case 0x10: // Ctrl-P
+            kush_edit_browse(ed, 1);
+            return 0;
+        case 0x0e: // Ctrl-N
+            kush_edit_browse(ed, 0);
+            return 0;
+        case 0x7f: // Backspace
+        case 0x08:
+            kush_edit_delete(ed, kush_edit_char_prev(ed, ed->pos), ed->pos);
+            return 0;
+        case 0x04: // Ctrl-D ends the input on an empty line and deletes the character at the cursor otherwise
+            if (ed->len == 0) return -1;
+            kush_edit_delete(ed, ed->pos, kush_edit_char_next(ed, ed->pos));
+            return 0;
+        case 0x15: // Ctrl-U
+            kush_edit_delete(ed, 0, ed->pos);
+            return 0;
+        case 0x0b: // Ctrl-K
+            ed->len = ed->pos;
+            return 0;
+        case 0x17: // Ctrl-W
+            kush_edit_delete(ed, kush_edit_word_prev(ed, ed->pos), ed->pos);
+            return 0;
+        case 0x0c: // Ctrl-L
+            kush_edit_out(ed, "\x1b[H\x1b[2J", 7);
+            kush_edit_prompt(ed);
+            return 0;
+        case '\t':
+            kush_edit_complete(ed, tabbed);
+            return 0;
+        case 0x12: // Ctrl-R
+            ed->searching = 1;
+            ed->search_len = 0;
+            ed->match = -1;
+            ed->failed = 0;
+            kush_edit_clear(ed);
+            ed->prompt_width = 0;
+            return 0;
+        default: // Other control keys aren't bound
+            return 0;
+    }
+}
+
+// Starts over after a SIGINT: the line is left on screen as it was and a new, empty one begins below it
+void kush_edit_interrupt(kush_editor *ed) {
+    static const char exit_text[] = "\r\nTo exit kush type 'exit'.\r\n";
+
+    if (ed->searching) kush_edit_search_end(ed, 0);
+    kush_edit_update(ed);
+    kush_edit_render(ed, ed->line, ed->len, ed->len);
+    kush_edit_out(ed, exit_text, sizeof(exit_text) - 1);
+
+    ed->len = 0;
+    ed->pos = 0;
+    ed->seq_len = -1;
+    ed->pasting = 0;
+    ed->browse = -1;
+    ed->prompt = NULL; // Lines typed before are gone too
+    kush_edit_prompt(ed);
+}
+
+// Adapts to a new width of the terminal. The terminal may have moved the text around, so the prompt and the line
+// are drawn anew.
+void kush_edit_resize(kush_editor *ed) {
+    struct winsize size;
+    int resized;
+
+    pthread_mutex_lock(&seg_lock);
+    resized = term_resized;
+    if (resized) {
+        term_resized = 0;
+        term_cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 ? size.ws_col : 0;
+    }
+    pthread_mutex_unlock(&seg_lock);
+    if (!resized) return;
+
+    kush_edit_clear(ed);
+    ed->cols = term_cols > 0 ? term_cols : 80;
+    if (!ed->searching) kush_edit_prompt(ed);
+}
+
+// Reads a line from the terminal with the line editor, after printing prompt (or the prompt line of the shell if it
+// is NULL). Returns the line, including its newline, or NULL if the input has ended.
+char *kush_edit_line(const char *prompt) {
+    kush_editor ed = {.prompt = prompt, .seq_len = -1, .browse = -1, .match = -1};
+    struct termios edit_tmodes = shell_tmodes;
+    int done = 0;
+
+    // Every key arrives right away and without echo, the editor shows it itself. Carriage returns are kept, so
+    // line endings of pastes can be told apart.
+    edit_tmodes.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+    edit_tmodes.c_iflag &= ~(ICRNL | INLCR);
+    edit_tmodes.c_cc[VMIN] = 1;
+    edit_tmodes.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &edit_tmodes);
+
+    kush_edit_reserve(&ed.line, &ed.size, 0, 2);
+    kush_edit_out(&ed, "\x1b[?2004h", 8); // Bracketed paste
+    kush_edit_prompt(&ed);
+
+    while (!done) {
+        if (in_start == in_end) {
+            ssize_t num_read;
+
+            if (!ed.pasting) kush_edit_update(&ed); // A paste is shown once it's complete
+            kush_edit_flush(&ed);
+            num_read = kush_read_input();
+            if (num_read == 0) { // The terminal has been closed
+                done = -1;
+                break;
+            }
+            if (num_read < 0) {
+                kush_edit_interrupt(&ed);
+                line_interrupted = 1;
+            }
+            kush_edit_resize(&ed);
+            continue;
+        }
+
+        if (ed.pasting && ed.seq_len < 0 && in_buff[in_start] != 0x1b) { // Pasted text goes in as it is
+            const char *esc = memchr(in_buff + in_start, 0x1b, in_end - in_start);
+            size_t end = esc ? (size_t) (esc - in_buff) : in_end;
+
+            if (ed.searching) kush_edit_search_end(&ed, 1);
+            kush_edit_paste(&ed, in_buff + in_start, end - in_start);
+            in_start = end;
+            ed.tabbed = 0;
+            continue;
+        }
+        if (!ed.searching && ed.seq_len < 0 && (unsigned char) in_buff[in_start] >= 0x20 &&
+            in_buff[in_start] != 0x7f) { // So does typed text, as much as is there
+            size_t end = in_start;
+
+            while (end < in_end && (unsigned char) in_buff[end] >= 0x20 && in_buff[end] != 0x7f) end++;
+            kush_edit_insert(&ed, in_buff + in_start, end - in_start);
+            ed.tabbed = 0;
+            in_start = end;
+            continue;
+        }
+
+        char c = in_buff[in_start++];
+
+        if (ed.searching) {
+            done = kush_edit_search_key(&ed, c);
+            if (done >= 0) continue;
+        }
+        done = kush_edit_key(&ed, c);
+    }
+
+    // The cursor is left below the line, where the output of the commands starts
+    kush_edit_update(&ed);
+    if (!ed.searching) kush_edit_render(&ed, ed.line, ed.len, ed.len);
+    kush_edit_out(&ed, "\r\n\x1b[?2004l", 10);
+    kush_edit_flush(&ed);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    if (ed.prompt_live) kush_prompt_done();
+    if (done < 0 && ed.len == 0) return NULL;
+
+    ed.line[ed.len++] = '\n';
+    ed.line[ed.len] = '\0';
+    return ed.line;
+}
+// -----------------------------------------------------------------------------------------
+
+// Reads a whole line from stdin into the line arena and returns a pointer to it, or NULL at the end of the input.
+// Interactive shells read it with the line editor, showing prompt first (or the prompt line of the shell if it is
+// NULL). The returned line is only valid until the line arena is reset.
+char *kush_read_line(const char *prompt) {
+    char *line = NULL;
+    size_t len = 0;
+    size_t buff_size = 0; // Current size of the line buffer
+
+    if (interactive) return kush_edit_line(prompt);
+
+    while (1) {
+        // All buffered input has been used up, so read more. If eof was reached (for example when reading commands
+        // from a file) the read was finished successfully.
+        if (in_start == in_end && kush_read_input() == 0) {
+            if (len > 0) break; // Unless the last line wasn't terminated, which still has to be handled
+            return NULL;
+        }
+
+        // Take everything up to and including the next newline
+        char *newline = memchr(in_buff + in_start, '\n', in_end - in_start);
+        size_t chunk = (newline ? (size_t) (newline - in_buff) + 1 : in_end) - in_start;
+
+        if (len + chunk + 1 > buff_size) { // Grow the line geometrically to keep long lines linear
+            size_t new_size = buff_size ? buff_size * 2 : KUSH_IN_BUFF_SIZE;
+
+            if (new_size < len + chunk + 1) new_size = len + chunk + 1;
+            line = kush_arena_grow(&line_arena, line, len, new_size);
+            buff_size = new_size;
+        }
+        memcpy(line + len, in_buff + in_start, chunk);
+        len += chunk;
+        in_start += chunk;
+
+        if (newline) break;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+// Character classes used by kush_tokenize()
+enum kush_char_class {
+    KUSH_CC_ORD = 0, // Ordinary character that becomes part of the current token
+    KUSH_CC_DELIM, // Delimits one token from the next
+    KUSH_CC_SQUOTE, // Single-quote
+    KUSH_CC_DQUOTE, // Double-quote
+    KUSH_CC_ESCAPE, // Backslash
+    KUSH_CC_OP, // Starts an operator
+    KUSH_CC_DOLLAR, // Starts a parameter expansion
+    KUSH_CC_COMMENT, // Starts a comment, if it is at the start of a token
+    KUSH_CC_MARK, // One of the KUSH_MARK_* bytes, which has to be escaped in a token
+    KUSH_CC_GLOB, // A wildcard of a pattern, if it isn't quoted
+    KUSH_CC_END // End of the input string
+};
+
+// Class of every possible input byte. Characters not listed are ordinary characters.
+const unsigned char kush_char_class[256] = {
+        ['\0'] = KUSH_CC_END,
+        [' '] = KUSH_CC_DELIM, ['\t'] = KUSH_CC_DELIM, ['\r'] = KUSH_CC_DELIM, ['\a'] = KUSH_CC_DELIM,
+        ['\''] = KUSH_CC_SQUOTE,
+        ['"'] = KUSH_CC_DQUOTE,
+        ['\\'] = KUSH_CC_ESCAPE,
+        ['$'] = KUSH_CC_DOLLAR,
+        ['#'] = KUSH_CC_COMMENT,
+        ['\x01'] = KUSH_CC_MARK, ['\x02'] = KUSH_CC_MARK, ['\x03'] = KUSH_CC_MARK, ['\x04'] = KUSH_CC_MARK,
+        ['\x05'] = KUSH_CC_MARK,
+        ['*'] = KUSH_CC_GLOB, ['?'] = KUSH_CC_GLOB, ['['] = KUSH_CC_GLOB,
+        ['|'] = KUSH_CC_OP, ['<'] = KUSH_CC_OP, ['>'] = KUSH_CC_OP, ['&'] = KUSH_CC_OP, [';'] = KUSH_CC_OP,
+        ['('] = KUSH_CC_OP, [')'] = KUSH_CC_OP, ['\n'] = KUSH_CC_OP
+};
+
+// Operators recognized by kush_tokenize()
+enum kush_op {
+    KUSH_OP_PIPE, // '|', connects the output of one command with the input of the next
+    KUSH_OP_IN, // '<', reads stdin from a file
+    KUSH_OP_OUT, // '>', writes stdout to a file
+    KUSH_OP_APPEND, // '>>', appends stdout to a file
+    KUSH_OP_ERR, // '2>', writes stderr to a file
+    KUSH_OP_ERR_APPEND, // '2>>', appends stderr to a file
+    KUSH_OP_ERR_TO_OUT, // '2>&1', sends stderr to wherever stdout goes
+    KUSH_OP_OUT_TO_ERR, // '>&2', sends stdout to wherever stderr goes
+    KUSH_OP_HERESTRING, // '<<<', feeds the following word and a newline to stdin
+    KUSH_OP_BACKGROUND, // '&', runs the pipeline in front of it in the background
+    KUSH_OP_AND, // '&&', runs the following pipeline only if the one in front of it succeeded
+    KUSH_OP_OR, // '||', runs the following pipeline only if the one in front of it failed
+    KUSH_OP_SEMICOLON, // ';', ends a command like a newline does
+    KUSH_OP_NEWLINE, // A line break, which ends a command
+    KUSH_OP_CASE_END, // ';;', ends an item of a case statement
+    KUSH_OP_LPAREN, // '(', used for function definitions and case patterns
+    KUSH_OP_RPAREN, // ')', used for function definitions and case patterns
+    KUSH_NUM_OPS
+};
+
+// Text of every operator. For an unquoted operator the tokenizer emits a pointer into this table instead of a pointer
+// into the token buffer. That way an operator can be told apart from a quoted word with the same text by its address.
+const char kush_ops[KUSH_NUM_OPS][5] = {
+        [KUSH_OP_PIPE] = "|",
+        [KUSH_OP_IN] = "<",
+        [KUSH_OP_OUT] = ">",
+        [KUSH_OP_APPEND] = ">>",
+        [KUSH_OP_ERR] = "2>",
+        [KUSH_OP_ERR_APPEND] = "2>>",
+        [KUSH_OP_ERR_TO_OUT] = "2>&1",
+        [KUSH_OP_OUT_TO_ERR] = ">&2",
+        [KUSH_OP_HERESTRING] = "<<<",
+        [KUSH_OP_BACKGROUND] = "&",
+        [KUSH_OP_AND] = "&&",
+        [KUSH_OP_OR] = "||",
+        [KUSH_OP_SEMICOLON] = ";",
+        [KUSH_OP_NEWLINE] = "\n",
+        [KUSH_OP_CASE_END] = ";;",
+        [KUSH_OP_LPAREN] = "(",
+        [KUSH_OP_RPAREN] = ")"
+};
+
+// Returns the operator the given token stands for or -1 if the token is a word
+int kush_op_type(const char *token) {
+    uintptr_t addr = (uintptr_t) token;
+
+    if (addr < (uintptr_t) kush_ops[0] || addr >= (uintptr_t) kush_ops[KUSH_NUM_OPS]) return -1;
+    return (int) ((addr - (uintptr_t) kush_ops[0]) / sizeof(kush_ops[0]));
+}
+
+// Returns the longest operator the string starts with or -1 if there is none
+int kush_op_match(const char *str) {
+    int match = -1;
+    size_t match_len = 0;
+
+    for (int i = 0; i < KUSH_NUM_OPS; i++) {
+        size_t len = strlen(kush_ops[i]);
+
+        if (len > match_len && strncmp(str, kush_ops[i], len) == 0) {
+            match = i;
+            match_len = len;
+        }
+    }
+
+    return match;
+}
+
+// Bytes marking parameters and wildcards in tokens. The tokenizer leaves parameters in the tokens it returns, so they
+// can be expanded every time a command runs, see kush_expand(). A parameter is stored as KUSH_MARK_PARAM or
+// KUSH_MARK_QPARAM, its text without the '$' and KUSH_MARK_END. Input bytes that happen to be marks are escaped with
+// KUSH_MARK_LITERAL.
+#define KUSH_MARK_PARAM '\x01' // Unquoted parameter, its value is split into words
+#define KUSH_MARK_END '\x02'
+#define KUSH_MARK_QPARAM '\x03' // Double-quoted parameter
+#define KUSH_MARK_LITERAL '\x04'
+#define KUSH_MARK_GLOB '\x05' // Precedes an unquoted '*', '?' or '[', see kush_glob_paths()
+// Marks that can appear in a token, for strpbrk()
+#define KUSH_MARKS "\x01\x03\x04\x05"
+
+// Positional parameters of the running function, pos_args[0] being its name. NULL outside of functions.
+char **pos_args = NULL;
+int pos_num = 0; // Number of positional parameters, not counting pos_args[0]
+
+// Pathname expansion
+// -----------------------------------------------------------------------------------------
+// Unquoted '*', '?' and '[' make a word a pattern. The tokenizer marks them with KUSH_MARK_GLOB, and once the
+// parameters of the word have been expanded, kush_expand_globs() replaces it with the paths matching it, sorted
+// byte-wise. A component that is just '**' matches any number of directories, see the directory walk below.
+// Each component of the pattern is compiled once into segments, which are the parts between the '*'s. A segment
+// matches a fixed number of characters, so a name is matched by anchoring the first and last segment at its ends
+// and placing every other one as far left as it fits, without ever backtracking. Directories are read with
+// getdents64() into one buffer that is kept for the next expansion.
+
+// Size of the buffer directories are read into
+#define KUSH_GLOB_BUFF_SIZE (256 * 1024)
+// Below this number of strings kush_sort_strings() uses an insertion sort
+#define KUSH_SORT_SMALL 16
+
+// Kinds of pattern elements
+enum kush_pat_type {
+    KUSH_PAT_BYTE, // A byte that has to match exactly
+    KUSH_PAT_ANY, // '?', any single character
+    KUSH_PAT_CLASS // '[...]', a character from a set
+};
+
+// An element of a compiled pattern, which matches a single character
+typedef struct kush_pat_elem {
+    unsigned char type;
+    unsigned char byte; // The byte of a KUSH_PAT_BYTE element
+    unsigned char negated; // Boolean value telling if a KUSH_PAT_CLASS matches the characters not in its set
+    uint64_t set[2]; // The ASCII characters of a KUSH_PAT_CLASS, other characters can't be part of the set
+} kush_pat_elem;
+
+// The elements between two '*'s of a pattern
+typedef struct kush_pat_seg {
+    kush_pat_elem *elems;
+    size_t num_elems;
+    const char *text; // The bytes of a segment that only has KUSH_PAT_BYTE elements, NULL otherwise
+} kush_pat_seg;
+
+// A compiled pattern, allocated from the line arena
+typedef struct kush_pattern {
+    kush_pat_seg *segs;
+    size_t num_segs;
+    int star_start; // Boolean value telling if the pattern starts with a '*'
+    int star_end; // Boolean value telling if the pattern ends with a '*'
+    int wild; // Boolean value telling if the pattern has wildcards, without any it only matches its own text
+    int dot; // Boolean value telling if the pattern starts with a '.', which it needs to match hidden files
+} kush_pattern;
+
+// State of a pathname expansion
+typedef struct kush_glob {
+    char **paths; // Paths found, allocated from the line arena
+    size_t num_paths;
+    size_t paths_size;
+    int wild; // Boolean value telling if a component with wildcards has been seen
+    char path[PATH_MAX]; // Directory currently looked at, with a trailing '/' unless it's the working directory
+} kush_glob;
+
+char *glob_buff = NULL; // Buffer for getdents64(), allocated with the first expansion
+
+// Returns the byte at *pos of a pattern and moves *pos past it. Marks are skipped, so the byte is taken literally.
+unsigned char kush_pat_byte(const char *pattern, size_t len, size_t *pos) {
+    if ((pattern[*pos] == KUSH_MARK_GLOB || pattern[*pos] == KUSH_MARK_LITERAL) && *pos + 1 < len) (*pos)++;
+    return (unsigned char) pattern[(*pos)++];
+}
+
+// Parses the set of a '[' at pattern[pos] into elem. Returns where the set ends, or 0 if the '[' isn't closed and
+// has to be taken literally.
+size_t kush_pat_class(kush_pat_elem *elem, const char *pattern, size_t len, size_t pos) {
+    int first = 1; // A ']' right at the start is part of the set
+
+    memset(elem, 0, sizeof(kush_pat_elem));
+    elem->type = KUSH_PAT_CLASS;
+    if (pos < len && (pattern[pos] == '!' || pattern[pos] == '^')) {
+        elem->negated = 1;
+        pos++;
+    }
+
+    while (pos < len) {
+        unsigned char low, high;
+
+        if (pattern[pos] == ']' && !first) return pos + 1;
+        first = 0;
+        low = high = kush_pat_byte(pattern, len, &pos);
+        if (pos + 1 < len && pattern[pos] == '-' && pattern[pos + 1] != ']') { // A range
+            pos++;
+            high = kush_pat_byte(pattern, len, &pos);
+        }
+        for (unsigned c = low; c <= high && c < 0x80; c++) elem->set[c >> 6] |= (uint64_t) 1 << (c & 63);
+    }
+
+    return 0;
+}
+
+// Compiles the len bytes of a pattern, in which the wildcards are marked with KUSH_MARK_GLOB
+void kush_pattern_compile(kush_pattern *pat, const char *pattern, size_t len) {
+    kush_pat_elem *elems = kush_arena_alloc(&line_arena, (len + 1) * sizeof(kush_pat_elem));
+    char *text = kush_arena_alloc(&line_arena, len + 1);
+    size_t num_elems = 0;
+    size_t seg_start = 0; // First element of the current segment
+    int literal = 1; // Boolean value telling if the current segment only has KUSH_PAT_BYTE elements
+
+    memset(pat, 0, sizeof(kush_pattern));
+    pat->segs = kush_arena_alloc(&line_arena, (len + 1) * sizeof(kush_pat_seg));
+
+    for (size_t pos = 0; pos <= len;) {
+        kush_pat_elem *elem = &elems[num_elems];
+        size_t end;
+
+        if (pos == len || (pattern[pos] == KUSH_MARK_GLOB && pattern[pos + 1] == '*')) { // The segment ends
+            if (num_elems > seg_start) {
+                kush_pat_seg *seg = &pat->segs[pat->num_segs++];
+
+                seg->elems = &elems[seg_start];
+                seg->num_elems = num_elems - seg_start;
+                seg->text = literal ? &text[seg_start] : NULL;
+            }
+            if (pos == len) break;
+            if (num_elems == 0) pat->star_start = 1;
+            pat->star_end = 1; // Until another element follows
+            pat->wild = 1;
+            seg_start = num_elems;
+            literal = 1;
+            pos += 2;
+            continue;
+        }
+        pat->star_end = 0;
+
+        if (pattern[pos] == KUSH_MARK_GLOB && pattern[pos + 1] == '?') {
+            elem->type = KUSH_PAT_ANY;
+            pos += 2;
+        } else if (pattern[pos] == KUSH_MARK_GLOB && pattern[pos + 1] == '[' &&
+                   (end = kush_pat_class(elem, pattern, len, pos + 2)) > 0) {
+            pos = end;
+        } else {
+            elem->type = KUSH_PAT_BYTE;
+            elem->byte = text[num_elems] = (char) kush_pat_byte(pattern, len, &pos);
+            num_elems++;
+            continue;
+        }
+        literal = 0;
+        pat->wild = 1;
+        num_elems++;
+    }
+
+    pat->dot = !pat->star_start && pat->num_segs > 0 && pat->segs[0].elems[0].type == KUSH_PAT_BYTE &&
+               pat->segs[0].elems[0].byte == '.';
+}
+
+// Returns the number of bytes of the UTF-8 character at str, which has len bytes left
+size_t kush_pat_char_len(const char *str, size_t len) {
+    unsigned char c = (unsigned char) *str;
+    size_t char_len = c < 0xC0 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+
+    return char_len <= len ? char_len : 1;
+}
+
+// Returns true if elem matches the character of char_len bytes starting with byte c
+int kush_pat_elem_match(const kush_pat_elem *elem, unsigned char c, size_t char_len) {
+    switch (elem->type) {
+        case KUSH_PAT_BYTE:
+            return c == elem->byte;
+        case KUSH_PAT_ANY:
+            return 1;
+        default:
+            if (char_len > 1 || c >= 0x80) return elem->negated;
+            return ((elem->set[c >> 6] >> (c & 63)) & 1) != elem->negated;
+    }
+}
+
+// Matches seg against name from offset pos on, but not beyond end. Returns where the match ends, or -1.
+// A KUSH_PAT_BYTE element matches one byte, as multi-byte characters of the pattern are one element per byte.
+ssize_t kush_pat_seg_at(const kush_pat_seg *seg, const char *name, size_t pos, size_t end) {
+    if (seg->text) return end - pos >= seg->num_elems && memcmp(name + pos, seg->text, seg->num_elems) == 0 ?
+                          (ssize_t) (pos + seg->num_elems) : -1;
+
+    for (size_t i = 0; i < seg->num_elems; i++) {
+        const kush_pat_elem *elem = &seg->elems[i];
+        size_t char_len;
+
+        if (pos >= end) return -1;
+        char_len = elem->type == KUSH_PAT_BYTE ? 1 : kush_pat_char_len(name + pos, end - pos);
+        if (!kush_pat_elem_match(elem, (unsigned char) name[pos], char_len)) return -1;
+        pos += char_len;
+    }
+
+    return (ssize_t) pos;
+}
+
+// Matches seg against name so the match ends at offset end and doesn't start before start. Returns where the match
+// starts, or -1.
+ssize_t kush_pat_seg_before(const kush_pat_seg *seg, const char *name, size_t start, size_t end) {
+    for (size_t i = seg->num_elems; i-- > 0;) {
+        const kush_pat_elem *elem = &seg->elems[i];
+        size_t char_start = end;
+
+        if (end <= start) return -1;
+        do char_start--;
+        while (elem->type != KUSH_PAT_BYTE && char_start > start && ((unsigned char) name[char_start] & 0xC0) == 0x80);
+        if (!kush_pat_elem_match(elem, (unsigned char) name[char_start], end - char_start)) return -1;
+        end = char_start;
+    }
+
+    return (ssize_t) end;
+}
+
+// Returns true if the len bytes of name match a compiled pattern
+int kush_pattern_match(const kush_pattern *pat, const char *name, size_t len) {
+    size_t start = 0;
+    size_t end = len;
+    size_t first = 0; // Segments from first to last are placed as far left as they fit
+    size_t last = pat->num_segs;
+    ssize_t pos;
+
+    if (pat->num_segs == 0) return pat->star_start || len == 0;
+    if (!pat->star_start) {
+        if ((pos = kush_pat_seg_at(&pat->segs[0], name, 0, len)) < 0) return 0;
+        if (pat->num_segs == 1 && !pat->star_end) return (size_t) pos == len;
+        start = pos;
+        first = 1;
+    }
+    if (!pat->star_end) {
+        if ((pos = kush_pat_seg_before(&pat->segs[last - 1], name, start, len)) < 0) return 0;
+        end = pos;
+        last--;
+    }
+
+    for (size_t i = first; i < last; i++) {
+        const kush_pat_seg *seg = &pat->segs[i];
+
+        if (seg->text) { // A plain string is looked for at once
+            const char *found = memmem(name + start, end - start, seg->text, seg->num_elems);
+
+            if (!found) return 0;
+            start = found - name + seg->num_elems;
+            continue;
+        }
+        while ((pos = kush_pat_seg_at(seg, name, start, end)) < 0) {
+            if (start >= end) return 0;
+            start += kush_pat_char_len(name + start, end - start);
+        }
+        start = pos;
+    }
+
+    return 1;
+}
+
+// Sorts strings byte-wise. A multikey quicksort partitions them by one byte at a time, so a byte that all strings
+// of a partition share is looked at once, instead of again in every comparison. depth is the number of bytes all
+// strings are known to share.
+void kush_sort_strings(char **strs, size_t num, size_t depth) {
+    while (num > 1) {
+        size_t lt = 0, i = 0, gt = num;
+        unsigned char a, b, c, pivot;
+
+        if (num < KUSH_SORT_SMALL) {
+            for (size_t j = 1; j < num; j++) {
+                char *str = strs[j];
+                size_t k = j;
+
+                for (; k > 0 && strcmp(strs[k - 1] + depth, str + depth) > 0; k--) strs[k] = strs[k - 1];
+                strs[k] = str;
+            }
+            return;
+        }
+
+        // The median of three bytes as pivot
+        a = strs[0][depth];
+        b = strs[num / 2][depth];
+        c = strs[num - 1][depth];
+        pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+
+        while (i < gt) { // Partition into strings with a smaller, the same and a larger byte
+            unsigned char byte = strs[i][depth];
+            char *tmp = strs[i];
+
+            if (byte < pivot) {
+                strs[i++] = strs[lt];
+                strs[lt++] = tmp;
+            } else if (byte > pivot) {
+                strs[i] = strs[--gt];
+                strs[gt] = tmp;
+            } else i++;
+        }
+
+        kush_sort_strings(strs, lt, depth);
+        kush_sort_strings(strs + gt, num - gt, depth);
+        if (pivot == 0) return; // The strings in the middle have ended, so they are equal
+        strs += lt;
+        num = gt - lt;
+        depth++;
+    }
+}
+
+// Adds the current path followed by len bytes of name to the paths found
+void kush_glob_add(kush_glob *glob, size_t path_len, const char *name, size_t len) {
+    char *path = kush_arena_alloc(&line_arena, path_len + len + 1);
+
+    if (glob->num_paths == glob->paths_size) {
+        size_t new_size = glob->paths_size ? 2 * glob->paths_size : 64;
+
+        glob->paths = kush_arena_grow(&line_arena, glob->paths, glob->paths_size * sizeof(char *),
+                                      new_size * sizeof(char *));
+        glob->paths_size = new_size;
+    }
+    memcpy(path, glob->path, path_len);
+    memcpy(path + path_len, name, len);
+    path[path_len + len] = '\0';
+    glob->paths[glob->num_paths++] = path;
+}
+
+// Finds the paths matching the pattern rest in the directory glob->path (of length path_len) and all directories
+// below it. Used for a '**' component, defined with the directory walk.
+void kush_glob_star(kush_glob *glob, size_t path_len, const char *rest);
+
+// Finds the paths in the directory glob->path (of length path_len) that match the pattern rest, which is what is
+// left of the pattern after that directory
+void kush_glob_dir(kush_glob *glob, size_t path_len, const char *rest) {
+    const char *slash = strchr(rest, '/');
+    size_t len = slash ? (size_t) (slash - rest) : strlen(rest);
+    kush_pattern pat;
+    char **dirs = NULL; // Subdirectories matching the pattern if it goes on after this component
+    size_t num_dirs = 0;
+    size_t dirs_size = 0;
+    ssize_t num_read;
+    int fd;
+
+    if (len == 0 && !slash) { // A pattern ending with a '/' only matches directories, which path has to be
+        kush_glob_add(glob, path_len, "", 0);
+        return;
+    }
+    if (len == 4 && memcmp(rest, "\x05*\x05*", 4) == 0) { // '**' on its own matches everything below the directory
+        struct stat st;
+
+        // At the end of the pattern, with or without a '/' after it, it matches the directory itself as well, unless
+        // that's the working directory. Like in bash the directory keeps its '/', except for a '**' at the very end
+        // of a pattern that had wildcards before.
+        glob->path[path_len] = '\0';
+        if ((!slash || !slash[1]) && path_len > 0 && stat(glob->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            kush_glob_add(glob, path_len - (!slash && glob->wild && path_len > 1), "", 0);
+        }
+        kush_glob_star(glob, path_len, slash ? slash + 1 : "\x05*");
+        return;
+    }
+
+    kush_pattern_compile(&pat, rest, len);
+    glob->wild |= pat.wild;
+    // Nothing to match, the component just has to exist. Without any wildcards in front of it the word is its own
+    // result either way, so that isn't even checked.
+    if (!pat.wild) {
+        struct stat st;
+        size_t text_len = 0;
+
+        for (size_t pos = 0; pos < len && path_len + text_len + 1 < sizeof(glob->path);) {
+            glob->path[path_len + text_len++] = (char) kush_pat_byte(rest, len, &pos);
+        }
+        glob->path[path_len + text_len] = '\0';
+        if (slash && path_len + text_len + 1 < sizeof(glob->path)) {
+            glob->path[path_len + text_len] = '/';
+            kush_glob_dir(glob, path_len + text_len + 1, slash + 1);
+        } else if (!slash && (!glob->wild || fstatat(AT_FDCWD, glob->path, &st, AT_SYMLINK_NOFOLLOW) == 0)) {
+            kush_glob_add(glob, path_len + text_len, "", 0);
+        }
+        return;
+    }
+
+    glob->path[path_len] = '\0';
+    fd = open(path_len ? glob->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    if (!glob_buff) {
+        glob_buff = malloc(KUSH_GLOB_BUFF_SIZE);
+        if (!glob_buff) {
+            fprintf(stderr, "kush: Glob buffer allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    while ((num_read = getdents64(fd, glob_buff, KUSH_GLOB_BUFF_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < num_read;) {
+            struct dirent64 *entry = (struct dirent64 *) (glob_buff + pos);
+            const char *name = entry->d_name;
+            size_t name_len = strlen(name);
+            struct stat st;
+
+            pos += entry->d_reclen;
+            if (name[0] == '.' && (!pat.dot || name_len == 1 || (name_len == 2 && name[1] == '.'))) continue;
+            if (!kush_pattern_match(&pat, name, name_len)) continue;
+
+            if (!slash) kush_glob_add(glob, path_len, name, name_len);
+            else if (entry->d_type == DT_DIR || ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) &&
+                                                 fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode))) {
+                // Looked at once the directory has been read, as that reuses the buffer
+                if (num_dirs == dirs_size) {
+                    size_t new_size = dirs_size ? 2 * dirs_size : 16;
+
+                    dirs = kush_arena_grow(&line_arena, dirs, dirs_size * sizeof(char *), new_size * sizeof(char *));
+                    dirs_size = new_size;
+                }
+                dirs[num_dirs] = kush_arena_alloc(&line_arena, name_len + 1);
+                memcpy(dirs[num_dirs++], name, name_len + 1);
+            }
+        }
+    }
+    close(fd);
+
+    for (size_t i = 0; i < num_dirs; i++) {
+        size_t name_len = strlen(dirs[i]);
+
+        if (path_len + name_len + 1 >= sizeof(glob->path)) continue;
+        memcpy(glob->path + path_len, dirs[i], name_len);
+        glob->path[path_len + name_len] = '/';
+        kush_glob_dir(glob, path_len + name_len + 1, slash + 1);
+    }
+}
+
+// Returns the paths matching pattern, in which the wildcards are marked with KUSH_MARK_GLOB, sorted byte-wise and
+// allocated from the line arena. Sets *num to their number, which is 0 if no path matches.
+char **kush_glob_paths(const char *pattern, size_t *num) {
+    kush_glob *glob = kush_arena_alloc(&line_arena, sizeof(kush_glob));
+
+    glob->paths = NULL;
+    glob->num_paths = 0;
+    glob->paths_size = 0;
+    glob->wild = 0;
+    if (*pattern == '/') { // An absolute path starts at the root directory
+        glob->path[0] = '/';
+        kush_glob_dir(glob, 1, pattern + 1);
+    } else kush_glob_dir(glob, 0, pattern);
+
+    kush_sort_strings(glob->paths, glob->num_paths, 0);
+    if (glob->num_paths > 1) { // Several '**' can find a path more than once
+        size_t kept = 1;
+
+        for (size_t i = 1; i < glob->num_paths; i++) {
+            if (strcmp(glob->paths[i], glob->paths[kept - 1]) != 0) glob->paths[kept++] = glob->paths[i];
+        }
+        glob->num_paths = kept;
+    }
+    *num = glob->num_paths;
+    return glob->paths;
+}
+
+// Removes the marks from a word in place, leaving the characters they mark
+void kush_glob_unmark(char *word) {
+    char *out = word;
+
+    for (char *in = word; *in; in++) {
+        if ((*in == KUSH_MARK_GLOB || *in == KUSH_MARK_LITERAL) && in[1] != '\0') in++;
+        *out++ = *in;
+    }
+    *out = '\0';
+}
+// -----------------------------------------------------------------------------------------
+
+// Directory walk
+// -----------------------------------------------------------------------------------------
+// A '**' component matches any number of directories, so expanding it means reading every directory of a tree.
+// That takes one openat() and a few getdents64() per directory, each waiting for the file system, so the walk runs
+// on several threads. Every thread has a deque of directories it found and still has to read. It works on the
+// directory it found last, which keeps the walk depth first and the number of open directories low, and a thread
+// that runs out of work steals the oldest directory of another one, which is usually the root of a large subtree.
+// Directories are opened relative to the open directory containing them, so no path is resolved twice. The walk
+// starts on the shell's own thread and only starts the others once enough directories are waiting. The paths found
+// are sorted afterwards, so the result doesn't depend on how the work was split up.
+
+// Maximum number of threads of a walk
+#define KUSH_WALK_MAX_THREADS 32
+// Number of directories waiting to be read that makes a walk start its other threads
+#define KUSH_WALK_SPAWN 16
+// Size of the buffer each thread of a walk reads directories into
+#define KUSH_WALK_BUFF_SIZE (64 * 1024)
+
+// A directory found by a walk
+typedef struct kush_walk_dir {
+    struct kush_walk_dir *parent; // Directory containing this one, kept open until this one has been opened
+    int fd; // -1 until the directory is read
+    atomic_int refs; // The directory itself and its subdirectories that haven't been opened yet
+    size_t name; // Offset of the name of the directory in path
+    size_t path_len;
+    char path[]; // Path relative to where the walk started, ending with a '/' unless it is empty
+} kush_walk_dir;
+
+// Directories a thread of a walk still has to read. The owner adds and takes directories at the bottom, other
+// threads steal them from the top.
+typedef struct kush_walk_deque {
+    pthread_mutex_t lock;
+    kush_walk_dir **dirs;
+    size_t top;
+    size_t bottom;
+    size_t size;
+} kush_walk_deque;
+
+// A thread of a walk
+typedef struct kush_walk_worker {
+    struct kush_walk *walk;
+    int id;
+    pthread_t thread;
+    kush_walk_deque deque;
+    char *buff; // Buffer for getdents64()
+    char *found; // Paths found by the thread, each terminated with '\0'
+    size_t found_len;
+    size_t found_size;
+    size_t num_found;
+} kush_walk_worker;
+
+// State of a walk
+typedef struct kush_walk {
+    const kush_pattern *pat; // Pattern the entries of every directory are matched against, NULL to find directories
+    int num_workers; // Number of threads the walk may use
+    int started; // Number of threads running, only touched by the first one
+    int spawned; // Boolean value telling if the first thread has tried to start the others
+    atomic_size_t pending; // Directories that have been found but not read yet
+    kush_walk_worker workers[KUSH_WALK_MAX_THREADS];
+} kush_walk;
+
+// Returns a new directory named name (of length len) inside parent, or the directory the walk starts at if parent
+// is NULL
+kush_walk_dir *kush_walk_dir_new(kush_walk_dir *parent, const char *name, size_t len) {
+    size_t parent_len = parent ? parent->path_len : 0;
+    kush_walk_dir *dir = malloc(sizeof(kush_walk_dir) + parent_len + len + 2);
+
+    if (!dir) {
+        fprintf(stderr, "kush: Directory walk allocation error");
+        exit(EXIT_FAILURE);
+    }
+    dir->parent = parent;
+    dir->fd = -1;
+    atomic_init(&dir->refs, 1);
+    dir->name = parent_len;
+    memcpy(dir->path, parent ? parent->path : "", parent_len);
+    memcpy(dir->path + parent_len, name, len);
+    dir->path_len = parent_len + len;
+    if (len > 0) dir->path[dir->path_len++] = '/';
+    dir->path[dir->path_len] = '\0';
+    if (parent) atomic_fetch_add(&parent->refs, 1);
+
+    return dir;
+}
+
+// Drops a reference to dir, closing and freeing it with the last one
+void kush_walk_dir_release(kush_walk_dir *dir) {
+    if (atomic_fetch_sub(&dir->refs, 1) != 1) return;
+    if (dir->fd >= 0) close(dir->fd);
+    free(dir);
+}
+
+// Adds dir to the bottom of a deque
+void kush_walk_push(kush_walk_deque *deque, kush_walk_dir *dir) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->size) {
+        if (deque->top > 0) { // Make room by moving the directories to the front
+            memmove(deque->dirs, deque->dirs + deque->top, (deque->bottom - deque->top) * sizeof(kush_walk_dir *));
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        } else {
+            deque->size = deque->size ? 2 * deque->size : 64;
+            deque->dirs = realloc(deque->dirs, deque->size * sizeof(kush_walk_dir *)); // NOLINT
+            if (!deque->dirs) {
+                fprintf(stderr, "kush: Directory walk allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    deque->dirs[deque->bottom++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Takes a directory from the bottom (steal is false) or the top of a deque. Returns NULL if it is empty.
+kush_walk_dir *kush_walk_take(kush_walk_deque *deque, int steal) {
+    kush_walk_dir *dir = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) dir = steal ? deque->dirs[deque->top++] : deque->dirs[--deque->bottom];
+    if (deque->top == deque->bottom) deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+
+    return dir;
+}
+
+// Adds the path of dir followed by len bytes of name to the paths a thread found
+void kush_walk_found(kush_walk_worker *worker, const kush_walk_dir *dir, const char *name, size_t len) {
+    size_t path_len = dir->path_len + len;
+
+    if (worker->found_len + path_len + 1 > worker->found_size) {
+        while (worker->found_len + path_len + 1 > worker->found_size) {
+            worker->found_size = worker->found_size ? 2 * worker->found_size : KUSH_WALK_BUFF_SIZE;
+        }
+        worker->found = realloc(worker->found, worker->found_size); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!worker->found) {
+            fprintf(stderr, "kush: Directory walk allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(worker->found + worker->found_len, dir->path, dir->path_len);
+    memcpy(worker->found + worker->found_len + dir->path_len, name, len);
+    worker->found_len += path_len;
+    worker->found[worker->found_len++] = '\0';
+    worker->num_found++;
+}
+
+// Reads dir, adding the entries matching the pattern of the walk to the paths found and the subdirectories to the
+// deque of the thread. Hidden directories and symbolic links to directories aren't walked into.
+void kush_walk_read(kush_walk_worker *worker, kush_walk_dir *dir) {
+    kush_walk *walk = worker->walk;
+    ssize_t num_read;
+
+    if (dir->parent) {
+        dir->fd = openat(dir->parent->fd, dir->path + dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        kush_walk_dir_release(dir->parent);
+        dir->parent = NULL;
+    }
+    if (dir->fd < 0) {
+        kush_walk_dir_release(dir);
+        return;
+    }
+    if (!walk->pat && dir->path_len > 0) kush_walk_found(worker, dir, "", 0);
+
+    while ((num_read = getdents64(dir->fd, worker->buff, KUSH_WALK_BUFF_SIZE)) > 0) {
+        for (ssize_t pos = 0; pos < num_read;) {
+            struct dirent64 *entry = (struct dirent64 *) (worker->buff + pos);
+            const char *name = entry->d_name;
+            size_t name_len = strlen(name);
+            struct stat st;
+
+            pos += entry->d_reclen;
+            if (name[0] == '.') {
+                if (name_len == 1 || (name_len == 2 && name[1] == '.')) continue;
+                if (walk->pat && walk->pat->dot && kush_pattern_match(walk->pat, name, name_len)) {
+                    kush_walk_found(worker, dir, name, name_len);
+                }
+                continue;
+            }
+            if (walk->pat && kush_pattern_match(walk->pat, name, name_len)) {
+                kush_walk_found(worker, dir, name, name_len);
+            }
+            if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN &&
+                                            fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                                            S_ISDIR(st.st_mode))) {
+                atomic_fetch_add(&walk->pending, 1);
+                kush_walk_push(&worker->deque, kush_walk_dir_new(dir, name, name_len));
+            }
+        }
+    }
+    kush_walk_dir_release(dir);
+}
+
+void *kush_walk_run(void *arg);
+
+// Starts the threads of a walk other than the first one
+void kush_walk_spawn(kush_walk *walk) {
+    sigset_t all, old;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (; walk->started < walk->num_workers; walk->started++) {
+        kush_walk_worker *worker = &walk->workers[walk->started];
+
+        if (pthread_create(&worker->thread, NULL, &kush_walk_run, worker) != 0) break;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    walk->spawned = 1; // The deques of threads that couldn't be started just stay empty
+}
+
+// Main function of a thread of a walk. Reads directories until no directory of the walk is left.
+void *kush_walk_run(void *arg) {
+    kush_walk_worker *worker = arg;
+    kush_walk *walk = worker->walk;
+    unsigned idle = 0; // Number of times in a row no directory has been found
+
+    while (atomic_load(&walk->pending) > 0) {
+        kush_walk_dir *dir = kush_walk_take(&worker->deque, 0);
+
+        for (int i = 1; !dir && i < walk->num_workers; i++) {
+            dir = kush_walk_take(&walk->workers[(worker->id + i) % walk->num_workers].deque, 1);
+        }
+        if (!dir) { // Another thread is still reading a directory that may contain more
+            if (++idle < 64) sched_yield();
+            else nanosleep(&(struct timespec) {.tv_nsec = 50000}, NULL);
+            continue;
+        }
+        idle = 0;
+
+        kush_walk_read(worker, dir);
+        atomic_fetch_sub(&walk->pending, 1);
+        if (worker->id == 0 && !walk->spawned && atomic_load(&walk->pending) >= KUSH_WALK_SPAWN) {
+            kush_walk_spawn(walk);
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the number of threads a walk may use, which is the value of KUSH_GLOB_THREADS if it is set or else the
+// number of online CPUs
+int kush_walk_threads() {
+    const char *value = kush_var_get("KUSH_GLOB_THREADS");
+    long num = value && *value ? strtol(value, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (num < 1) return 1;
+    return num > KUSH_WALK_MAX_THREADS ? KUSH_WALK_MAX_THREADS : (int) num;
+}
+
+// Walks the directory glob->path (of length path_len) and all directories below it. If pat isn't NULL, the paths of
+// the entries that match it are added to glob, otherwise the paths of the directories below glob->path are added
+// to found. found is allocated from the line arena and *num_found is set to the number of its paths.
+void kush_walk_tree(kush_glob *glob, size_t path_len, const kush_pattern *pat, char ***found, size_t *num_found) {
+    kush_walk *walk = calloc(1, sizeof(kush_walk));
+    kush_walk_dir *root = kush_walk_dir_new(NULL, "", 0);
+
+    if (!walk) {
+        fprintf(stderr, "kush: Directory walk allocation error");
+        exit(EXIT_FAILURE);
+    }
+    glob->path[path_len] = '\0';
+    root->fd = open(path_len ? glob->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    walk->pat = pat;
+    walk->num_workers = kush_walk_threads();
+    walk->started = 1;
+    walk->spawned = walk->num_workers == 1;
+    atomic_init(&walk->pending, 1);
+    for (int i = 0; i < walk->num_workers; i++) {
+        kush_walk_worker *worker = &walk->workers[i];
+
+        worker->walk = walk;
+        worker->id = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->buff = malloc(KUSH_WALK_BUFF_SIZE);
+        if (!worker->buff) {
+            fprintf(stderr, "kush: Directory walk allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    kush_walk_push(&walk->workers[0].deque, root);
+    kush_walk_run(&walk->workers[0]);
+    for (int i = 1; i < walk->started; i++) pthread_join(walk->workers[i].thread, NULL);
+
+    if (!pat) {
+        size_t num = 0;
+
+        for (int i = 0; i < walk->num_workers; i++) num += walk->workers[i].num_found;
+        *found = kush_arena_alloc(&line_arena, num * sizeof(char *));
+        *num_found = 0;
+    }
+    for (int i = 0; i < walk->num_workers; i++) {
+        kush_walk_worker *worker = &walk->workers[i];
+
+        for (size_t pos = 0; pos < worker->found_len;) {
+            size_t len = strlen(worker->found + pos);
+
+            if (pat) kush_glob_add(glob, path_len, worker->found + pos, len);
+            else (*found)[(*num_found)++] = strcpy(kush_arena_alloc(&line_arena, len + 1), worker->found + pos);
+            pos += len + 1;
+        }
+        pthread_mutex_destroy(&worker->deque.lock);
+        free(worker->deque.dirs);
+        free(worker->buff);
+        free(worker->found);
+    }
+    free(walk);
+}
+
+// Finds the paths matching the pattern rest in the directory glob->path (of length path_len) and all directories
+// below it. If rest is a single component, its matches are found while walking the directories, otherwise the
+// rest of the pattern is looked up in every directory once they are all known.
+void kush_glob_star(kush_glob *glob, size_t path_len, const char *rest) {
+    kush_pattern pat;
+    char **dirs;
+    size_t num_dirs;
+
+    glob->wild = 1;
+    if (!strchr(rest, '/') && *rest) {
+        kush_pattern_compile(&pat, rest, strlen(rest));
+        kush_walk_tree(glob, path_len, &pat, NULL, NULL);
+        return;
+    }
+
+    kush_walk_tree(glob, path_len, NULL, &dirs, &num_dirs);
+    if (*rest) kush_glob_dir(glob, path_len, rest); // '**' also matches no directory at all
+    for (size_t i = 0; i < num_dirs; i++) {
+        size_t len = strlen(dirs[i]);
+
+        if (path_len + len >= sizeof(glob->path)) continue;
+        memcpy(glob->path + path_len, dirs[i], len);
+        kush_glob_dir(glob, path_len + len, rest);
+    }
+}
+// -----------------------------------------------------------------------------------------
+
+// States of the tokenizer
+enum kush_lex_state {
+    KUSH_LEX_BLANK, // Between two tokens
+    KUSH_LEX_WORD, // Inside an unquoted part of a token
+    KUSH_LEX_SQUOTE, // Inside a single-quoted part of a token
+    KUSH_LEX_DQUOTE // Inside a double-quoted part of a token
+};
+
+// State of kush_tokenize() and kush_expand() that is shared with the helpers writing tokens
+typedef struct kush_lexer {
+    char **tokens; // Token list, allocated from the line arena
+    int pos; // Current token position in the token list
+    int buff_size; // Current size of the token list
+    enum kush_lex_state state;
+    char *out; // Next position to write a token character to
+    int error; // Boolean value telling if the line is invalid
+    int split; // Boolean value telling if kush_expand() splits unquoted expansions into words
+    int glob; // Boolean value telling if kush_expand() marks the wildcards of unquoted expansions
+} kush_lexer;
+
+// Appends token to the token list, growing it if it is full
+void kush_lex_push(kush_lexer *lex, char *token) {
+    // Keep one slot for the terminating NULL
+    if (lex->pos + 1 >= lex->buff_size) {
+        lex->tokens = kush_arena_grow(&line_arena, lex->tokens, lex->buff_size * sizeof(char *),
+                                      2 * lex->buff_size * sizeof(char *));
+        lex->buff_size *= 2;
+    }
+    lex->tokens[lex->pos++] = token;
+}
+
+// Ends the current token, if there is one
+void kush_lex_break(kush_lexer *lex) {
+    if (lex->state == KUSH_LEX_WORD) {
+        *lex->out++ = '\0';
+        lex->state = KUSH_LEX_BLANK;
+    }
+}
+
+// Writes the value of an expansion to the current token. Unless the expansion is quoted, whitespace in it splits
+// it into several tokens if lex->split is set, and an expansion that is empty doesn't create a token at all.
+// If lex->glob is set, the wildcards of an unquoted expansion are marked and bytes that are marks are escaped.
+void kush_lex_emit(kush_lexer *lex, const char *str, size_t len, int quoted) {
+    if (quoted && lex->state == KUSH_LEX_BLANK) { // Even an empty quoted expansion is a token
+        kush_lex_push(lex, lex->out);
+        lex->state = KUSH_LEX_WORD;
+    }
+    if (quoted && !lex->glob) {
+        memcpy(lex->out, str, len);
+        lex->out += len;
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+
+        if (!quoted && lex->split && (c == ' ' || c == '\t' || c == '\n')) {
+            kush_lex_break(lex);
+            continue;
+        }
+        if (lex->state == KUSH_LEX_BLANK) {
+            kush_lex_push(lex, lex->out);
+            lex->state = KUSH_LEX_WORD;
+        }
+        if (lex->glob && (c == KUSH_MARK_GLOB || c == KUSH_MARK_LITERAL)) *lex->out++ = KUSH_MARK_LITERAL;
+        else if (lex->glob && !quoted && (c == '*' || c == '?' || c == '[')) *lex->out++ = KUSH_MARK_GLOB;
+        *lex->out++ = c;
+    }
+}
+
+// Parses the parameter at in, which follows a '$', and returns where it ends. The parameter is $NAME, ${NAME},
+// ${NAME:-default} or one of the special parameters ($?, $#, $@, $*, $$ and $0 to $9, more digits need braces).
+// Sets *name and *len to its name, and *def and *def_len to the default text if there is one (NULL otherwise).
+// Returns NULL if a '${' isn't closed or doesn't contain a name.
+const char *kush_param_parse(const char *in, const char **name, size_t *len, const char **def, size_t *def_len) {
+    const char *end;
+    int brace = *in == '{';
+    int depth = 1; // Nesting of braces inside the default
+
+    *def = NULL;
+    *name = in + brace;
+    if (**name != '\0' && strchr("?#@*$", **name)) *len = 1;
+    else if (isdigit((unsigned char) **name)) *len = brace ? strspn(*name, "0123456789") : 1;
+    else *len = kush_var_name_len(*name);
+    end = *name + *len;
+    if (!brace) return end;
+
+    if (*len > 0 && *end == '}') return end + 1;
+    if (*len == 0 || end[0] != ':' || end[1] != '-') return NULL;
+
+    *def = end += 2;
+    for (; *end && (*end != '}' || --depth > 0); end++) {
+        if (*end == '{') depth++;
+    }
+    if (*end != '}') return NULL;
+    *def_len = end - *def;
+
+    return end + 1;
+}
+
+// Returns the value of the parameter name (of length len), or NULL if it isn't set. Numbers are written to buff,
+// which needs room for 24 characters. '$@' and '$*' aren't handled here.
+const char *kush_param_value(const char *name, size_t len, char *buff) {
+    switch (*name) {
+        case '?':
+            snprintf(buff, 24, "%d", last_status);
+            return buff;
+        case '#':
+            snprintf(buff, 24, "%d", pos_num);
+            return buff;
+        case '$':
+            snprintf(buff, 24, "%d", (int) getpid());
+            return buff;
+        default:
+            break;
+    }
+
+    if (isdigit((unsigned char) *name)) {
+        long num = strtol(name, NULL, 10);
+
+        if (num == 0) return pos_args ? pos_args[0] : "kush";
+        return num <= pos_num ? pos_args[num] : NULL;
+    }
+
+    return kush_var_lookup(name, len);
+}
+
+// Expands the parameter at in, which follows a '$' or a parameter mark, into the current token and returns where
+// its text ends.
+const char *kush_expand_param(kush_lexer *lex, const char *in, int quoted) {
+    const char *name, *def, *value;
+    size_t len, def_len;
+    char buff[24];
+    const char *end = kush_param_parse(in, &name, &len, &def, &def_len);
+
+    if (!end || len == 0) { // Only possible in a default, where a '$' without a parameter is just a '$'
+        kush_lex_emit(lex, "$", 1, quoted);
+        return in;
+    }
+
+    if (*name == '@' || *name == '*') { // All positional parameters
+        for (int i = 1; i <= pos_num; i++) {
+            if (i > 1 && quoted && *name == '@') kush_lex_break(lex); // "$@" gives one word per parameter
+            else if (i > 1) kush_lex_emit(lex, " ", 1, quoted);
+            kush_lex_emit(lex, pos_args[i], strlen(pos_args[i]), quoted);
+        }
+        return end;
+    }
+
+    value = kush_param_value(name, len, buff);
+    if ((value == NULL || *value == '\0') && def) { // Use the default, which may contain parameters and quotes itself
+        const char *def_end = def + def_len;
+        int dquoted = 0; // Boolean value telling if the default is inside double-quotes of its own here
+
+        for (const char *c = def; c < def_end; c++) {
+            const char *close;
+
+            if (*c == '$') {
+                c = kush_expand_param(lex, c + 1, quoted || dquoted) - 1;
+            } else if (*c == '"') {
+                dquoted = !dquoted;
+            } else if (*c == '\'' && !quoted && !dquoted && (close = memchr(c + 1, '\'', def_end - c - 1))) {
+                kush_lex_emit(lex, c + 1, close - c - 1, 1);
+                c = close;
+            } else if (*c == '\\' && c + 1 < def_end && (!(quoted || dquoted) || strchr("$\"\\", c[1]))) {
+                kush_lex_emit(lex, ++c, 1, 1);
+            } else kush_lex_emit(lex, c, 1, quoted || dquoted);
+        }
+    } else kush_lex_emit(lex, value ? value : "", value ? strlen(value) : 0, quoted);
+
+    return end;
+}
+
+// Returns an upper bound for the size the token word expands to. Every byte of a value may need a mark.
+size_t kush_expand_bound(const char *word) {
+    size_t bound = strlen(word) + 1;
+
+    for (const char *c = word; *c; c++) {
+        const char *name, *def, *value;
+        size_t len, def_len;
+        char buff[24];
+
+        if (*c != KUSH_MARK_PARAM && *c != KUSH_MARK_QPARAM && *c != '$') continue;
+        if (!kush_param_parse(c + 1, &name, &len, &def, &def_len) || len == 0) continue;
+
+        if (*name == '@' || *name == '*') {
+            for (int i = 1; i <= pos_num; i++) bound += 2 * strlen(pos_args[i]) + 2;
+        } else if ((value = kush_param_value(name, len, buff)) != NULL) bound += 2 * strlen(value);
+        bound += 2; // A token terminator and maybe a word break
+    }
+
+    return bound;
+}
+
+// How kush_expand() turns tokens into words
+enum kush_expand_mode {
+    KUSH_EXPAND_FIELDS, // Unquoted parameters are split into words and patterns are replaced by matching paths
+    KUSH_EXPAND_WORD, // Every token becomes exactly one word, wildcards are taken literally
+    KUSH_EXPAND_PATTERN // Every token becomes exactly one pattern, which keeps the marks of its wildcards
+};
+
+// Replaces the words of lex from first on that contain wildcards by the paths matching them. A pattern that doesn't
+// match anything stays a word of its own, like every other word its marks are taken out.
+void kush_expand_globs(kush_lexer *lex, int first) {
+    int last = lex->pos;
+    char **words;
+
+    for (; first < last && !strpbrk(lex->tokens[first], "\x04\x05"); first++);
+    if (first == last) return;
+    words = kush_arena_alloc(&line_arena, (last - first) * sizeof(char *));
+    memcpy(words, lex->tokens + first, (last - first) * sizeof(char *));
+
+    lex->pos = first;
+    for (int i = 0; i < last - first; i++) {
+        size_t num = 0;
+        char **paths = strchr(words[i], KUSH_MARK_GLOB) ? kush_glob_paths(words[i], &num) : NULL;
+
+        if (num == 0) {
+            kush_glob_unmark(words[i]);
+            kush_lex_push(lex, words[i]);
+        }
+        for (size_t j = 0; j < num; j++) kush_lex_push(lex, paths[j]);
+    }
+}
+
+// Redirections are parsed with the commands, see kush_parse_command()
+int kush_op_is_redir(int op);
+
+// Expands the parameters in a token list returned by kush_tokenize() and returns the resulting token list, which
+// is allocated from the line arena. Tokens without any marks are taken over as they are, so are operators.
+// Assignments in front of a command name are expanded as one word, anything else as mode says. Unless they are
+// quoted, parameters are split into words in KUSH_EXPAND_FIELDS mode, and a token only consisting of unquoted
+// parameters that are empty is dropped.
+char **kush_expand(char **tokens, enum kush_expand_mode mode) {
+    kush_lexer lex = {.pos = 0, .buff_size = KUSH_TOK_BUFF_SIZE, .state = KUSH_LEX_BLANK, .error = 0};
+    size_t bound = 0;
+    int front = 1; // Boolean value telling if no command name has been seen yet, so NAME=value is an assignment
+    int target = 0; // Boolean value telling if the token is the target of a redirection
+
+    for (int i = 0; tokens[i] != NULL; i++) {
+        if (kush_op_type(tokens[i]) < 0 && strpbrk(tokens[i], KUSH_MARKS)) bound += kush_expand_bound(tokens[i]);
+    }
+    lex.tokens = kush_arena_alloc(&line_arena, lex.buff_size * sizeof(char *));
+    lex.out = bound ? kush_arena_alloc(&line_arena, bound) : NULL;
+
+    for (int i = 0; tokens[i] != NULL; i++) {
+        const char *word = tokens[i];
+        int op = kush_op_type(word);
+        enum kush_expand_mode word_mode = mode;
+        int first = lex.pos;
+
+        if (op >= 0) { // Redirections and their targets come anywhere, other operators start the next command
+            front = front || !kush_op_is_redir(op);
+            target = kush_op_is_redir(op) && op != KUSH_OP_ERR_TO_OUT && op != KUSH_OP_OUT_TO_ERR;
+        } else if (target) {
+            target = 0;
+        } else if (front) {
+            size_t name_len = kush_var_name_len(word);
+
+            if (name_len > 0 && word[name_len] == '=') word_mode = KUSH_EXPAND_WORD;
+            else front = 0;
+        }
+
+        if (op >= 0 || !strpbrk(word, KUSH_MARKS)) {
+            kush_lex_push(&lex, tokens[i]);
+            continue;
+        }
+
+        lex.state = KUSH_LEX_BLANK;
+        lex.split = word_mode == KUSH_EXPAND_FIELDS;
+        lex.glob = word_mode != KUSH_EXPAND_WORD;
+        for (const char *c = word; *c; c++) {
+            if (*c == KUSH_MARK_PARAM || *c == KUSH_MARK_QPARAM) {
+                c = kush_expand_param(&lex, c + 1, *c == KUSH_MARK_QPARAM);
+                continue; // c is at the KUSH_MARK_END now
+            }
+            if (*c == KUSH_MARK_GLOB && lex.glob) { // The wildcard stays a wildcard
+                kush_lex_emit(&lex, "", 0, 1);
+                *lex.out++ = *c++;
+            } else if (*c == KUSH_MARK_GLOB || *c == KUSH_MARK_LITERAL) c++;
+            kush_lex_emit(&lex, c, 1, 1);
+        }
+        if (lex.state == KUSH_LEX_BLANK && !lex.split) kush_lex_emit(&lex, "", 0, 1); // Still one word
+        kush_lex_break(&lex);
+        if (word_mode == KUSH_EXPAND_FIELDS) kush_expand_globs(&lex, first);
+    }
+
+    lex.tokens[lex.pos] = NULL;
+    return lex.tokens;
+}
+
+// Copies the parameter at in, which follows a '$', into the current token as a parameter mark for kush_expand().
+// Returns where the parameter ends. A '$' that isn't followed by a parameter is taken literally.
+const char *kush_lex_param(kush_lexer *lex, const char *in, char mark) {
+    const char *name, *def;
+    size_t len, def_len;
+    const char *end = kush_param_parse(in, &name, &len, &def, &def_len);
+
+    if (!end) {
+        fprintf(stderr, "kush: %.*s: bad substitution\n", (int) strcspn(in - 1, " \t\n"), in - 1);
+        lex->error = 1;
+        return in + strlen(in);
+    }
+    if (len == 0) {
+        *lex->out++ = '$';
+        return in;
+    }
+
+    *lex->out++ = mark;
+    memcpy(lex->out, in, end - in);
+    lex->out += end - in;
+    *lex->out++ = KUSH_MARK_END;
+
+    return end;
+}
+
+// Splits the given string into a list of tokens in a single pass, looking at every character exactly once.
+// Tokens are split on delimiter characters (see kush_char_class). Single-quotes, double-quotes and backslash escapes
+// may appear anywhere inside a token (e.g. foo"bar baz"qux is one token). Quotes and escaping backslashes are
+// removed, and the resulting tokens are written back into user_in one after another, so the token list points
+// into one contiguous buffer. Unquoted operators (see kush_ops) end the current token and become tokens of their own.
+// A '#' at the start of a token starts a comment that lasts until the end of the line.
+// Parameters outside of single-quotes are kept in the tokens as parameter marks, to be expanded by kush_expand().
+// So are unquoted wildcards, for kush_glob_paths(). As marks take up more room than what they mark, lines containing a
+// '$' or a wildcard are written to a buffer of their own.
+// The token list is allocated from the line arena. Returns NULL if an expansion is invalid, or if the input ends
+// inside of quotes or after a backslash at the end of a line, in which case *incomplete is set.
+char **kush_tokenize(char *user_in, int *incomplete) {
+    kush_lexer lex = {.pos = 0, .buff_size = KUSH_TOK_BUFF_SIZE, .state = KUSH_LEX_BLANK, .out = user_in, .error = 0};
+    const char *in = user_in; // Next character to read
+
+    *incomplete = 0;
+    lex.tokens = kush_arena_alloc(&line_arena, lex.buff_size * sizeof(char *));
+    // Without parameters and marks 'out' never passes 'in', so the tokens can be written to user_in itself
+    if (strpbrk(user_in, "$*?[\x01\x02\x03\x04\x05")) lex.out = kush_arena_alloc(&line_arena, 2 * strlen(user_in) + 1);
+
+    while (!lex.error) {
+        char c = *in++;
+        enum kush_char_class cls = kush_char_class[(unsigned char) c];
+        int op;
+
+        // A '2' right in front of '>' at the start of a token redirects stderr, a '1' is the same as no number
+        if (c == '2' && *in == '>' && lex.state == KUSH_LEX_BLANK) cls = KUSH_CC_OP;
+        if (c == '1' && *in == '>' && lex.state == KUSH_LEX_BLANK) continue;
+        if (cls == KUSH_CC_COMMENT && lex.state != KUSH_LEX_BLANK) cls = KUSH_CC_ORD;
+
+        if (cls == KUSH_CC_MARK) { // Taken literally anywhere
+            if (lex.state == KUSH_LEX_BLANK) {
+                kush_lex_push(&lex, lex.out);
+                lex.state = KUSH_LEX_WORD;
+            }
+            *lex.out++ = KUSH_MARK_LITERAL;
+            *lex.out++ = c;
+            continue;
+        }
+
+        if (lex.state == KUSH_LEX_SQUOTE) { // Everything up to the closing single-quote is taken literally
+            if (cls == KUSH_CC_SQUOTE) lex.state = KUSH_LEX_WORD;
+            else if (cls == KUSH_CC_END) break;
+            else *lex.out++ = c;
+            continue;
+        }
+
+        if (lex.state == KUSH_LEX_DQUOTE) {
+            if (cls == KUSH_CC_DQUOTE) lex.state = KUSH_LEX_WORD;
+            else if (cls == KUSH_CC_END) break;
+            else if (cls == KUSH_CC_ESCAPE && *in == '\n') in++; // Line continuation
+            else if (cls == KUSH_CC_ESCAPE && (*in == '"' || *in == '\\' || *in == '$')) *lex.out++ = *in++;
+            else if (cls == KUSH_CC_DOLLAR) in = kush_lex_param(&lex, in, KUSH_MARK_QPARAM);
+            else *lex.out++ = c;
+            continue;
+        }
+
+        if (cls == KUSH_CC_COMMENT) { // Skip to the end of the line, which still ends the command
+            in = strchrnul(in, '\n');
+            continue;
+        }
+
+        if (cls == KUSH_CC_ESCAPE && *in == '\n') { // Line continuation, the command goes on in the next line
+            if (*++in == '\0') *incomplete = 1;
+            continue;
+        }
+
+        // Matched first, ending the current token may overwrite the operator when writing to user_in
+        if (cls == KUSH_CC_OP) op = kush_op_match(in - 1);
+        if (cls == KUSH_CC_END || cls == KUSH_CC_DELIM || cls == KUSH_CC_OP) {
+            kush_lex_break(&lex); // The delimiter ends the current token
+            if (cls == KUSH_CC_END) break;
+            if (cls == KUSH_CC_DELIM) continue;
+        }
+
+        if (lex.state == KUSH_LEX_BLANK) { // Any other character starts a new token
+            if (cls == KUSH_CC_OP) { // Operators are complete tokens right away
+                kush_lex_push(&lex, (char *) kush_ops[op]);
+                in += strlen(kush_ops[op]) - 1;
+                continue;
+            }
+            kush_lex_push(&lex, lex.out);
+            lex.state = KUSH_LEX_WORD;
+        }
+
+        if (cls == KUSH_CC_SQUOTE) lex.state = KUSH_LEX_SQUOTE;
+        else if (cls == KUSH_CC_DQUOTE) lex.state = KUSH_LEX_DQUOTE;
+        else if (cls == KUSH_CC_DOLLAR) in = kush_lex_param(&lex, in, KUSH_MARK_PARAM);
+        else if (cls == KUSH_CC_GLOB) {
+            *lex.out++ = KUSH_MARK_GLOB;
+            *lex.out++ = c;
+        } else if (cls == KUSH_CC_ESCAPE) { // A backslash takes the next character literally
+            if (*in != '\0') *lex.out++ = *in++;
+        } else *lex.out++ = c;
+    }
+
+    if (lex.error) return NULL;
+    if (lex.state == KUSH_LEX_SQUOTE || lex.state == KUSH_LEX_DQUOTE) *incomplete = 1;
+    if (*incomplete) return NULL;
+
+    lex.tokens[lex.pos] = NULL; // Terminate the token list with NULL.
+    return lex.tokens;
+}
+
+// Command location cache
+// -----------------------------------------------------------------------------------------
+// Resolving a command through PATH costs one failed lookup per PATH directory in front of the one containing it.
+// The cache remembers where each command was found (or that it wasn't found at all), so that every command
+// after the first one is launched straight from its absolute path.
+
+// A single cached command location
+typedef struct kush_hash_entry {
+    char *name; // Name of the command, NULL if the slot is empty
+    char *path; // Absolute path of the command or NULL if it wasn't found in any PATH directory
+    unsigned long hits; // Number of times the entry has been used
+} kush_hash_entry;
+
+// A directory from PATH together with the modification time it had when the cache was filled
+typedef struct kush_path_dir {
+    char *dir;
+    struct timespec mtime;
+} kush_path_dir;
+
+// Initial number of slots in the cache, has to be a power of two
+#define KUSH_HASH_SIZE 64
+// PATH used if the variable isn't set, the same default as execvp() has
+#define KUSH_DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin"
+// Minimum time in nanoseconds between two checks of the PATH directories for modifications
+#define KUSH_HASH_RECHECK_NS 1000000000L
+
+kush_hash_entry *hash_table = NULL; // Open addressing table of cached command locations
+size_t hash_size = 0; // Number of slots in hash_table
+size_t hash_used = 0; // Number of occupied slots in hash_table
+char *hash_path = NULL; // Copy of the PATH value the cache was filled for
+kush_path_dir *hash_dirs = NULL; // Directories of hash_path
+size_t hash_num_dirs = 0; // Number of entries in hash_dirs
+struct timespec hash_checked; // Time of the last check of the PATH directories
+
+// FNV-1a hash of a command name
+size_t kush_hash_name(const char *name) {
+    size_t hash = 14695981039346656037UL;
+
+    for (; *name; name++) hash = (hash ^ (unsigned char) *name) * 1099511628211UL;
+
+    return hash;
+}
+
+// Duplicates a string and exits the shell if no memory is left
+char *kush_strdup(const char *str) {
+    char *dup = strdup(str);
+
+    if (!dup) {
+        fprintf(stderr, "kush: String allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    return dup;
+}
+
+// Removes every entry from the command location cache
+void kush_hash_clear() {
+    for (size_t i = 0; i < hash_size; i++) {
+        free(hash_table[i].name);
+        free(hash_table[i].path);
+    }
+    if (hash_table) memset(hash_table, 0, hash_size * sizeof(kush_hash_entry));
+    hash_used = 0;
+}
+
+// Reads the modification time of dir into mtime. A missing directory gets a zero time.
+void kush_hash_dir_mtime(const char *dir, struct timespec *mtime) {
+    struct stat st;
+
+    if (stat(dir, &st) == 0) *mtime = st.st_mtim;
+    else mtime->tv_sec = mtime->tv_nsec = 0;
+}
+
+// Splits path into hash_dirs and remembers the current modification time of each directory
+void kush_hash_set_path(const char *path) {
+    const char *start = path;
+
+    for (size_t i = 0; i < hash_num_dirs; i++) free(hash_dirs[i].dir);
+    free(hash_dirs);
+    free(hash_path);
+    hash_path = kush_strdup(path);
+    hash_num_dirs = 0;
+
+    // Every ':' adds one more directory
+    hash_dirs = malloc((strlen(path) + 1) * sizeof(kush_path_dir));
+    if (!hash_dirs) {
+        fprintf(stderr, "kush: PATH allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        const char *end = strchrnul(start, ':');
+
+        // An empty entry in PATH means the current directory
+        if (end == start) hash_dirs[hash_num_dirs].dir = kush_strdup(".");
+        else hash_dirs[hash_num_dirs].dir = strndup(start, end - start);
+        if (!hash_dirs[hash_num_dirs].dir) {
+            fprintf(stderr, "kush: PATH allocation error");
+            exit(EXIT_FAILURE);
+        }
+        kush_hash_dir_mtime(hash_dirs[hash_num_dirs].dir, &hash_dirs[hash_num_dirs].mtime);
+        hash_num_dirs++;
+
+        if (*end == '\0') break;
+        start = end + 1;
+    }
+}
+
+// Makes sure the cache still matches the environment. The cache is dropped if PATH has changed or if one of
+// the PATH directories has been modified since it was filled. The directories are only checked once every
+// KUSH_HASH_RECHECK_NS, so a burst of commands doesn't pay a stat() per directory for every command.
+void kush_hash_validate() {
+    const char *path = kush_var_get("PATH");
+    struct timespec now;
+    long elapsed;
+
+    if (!path) path = KUSH_DEFAULT_PATH;
+
+    if (!hash_path || strcmp(path, hash_path) != 0) {
+        kush_hash_clear();
+        kush_hash_set_path(path);
+        clock_gettime(CLOCK_MONOTONIC, &hash_checked);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - hash_checked.tv_sec) * 1000000000L + (now.tv_nsec - hash_checked.tv_nsec);
+    if (elapsed < KUSH_HASH_RECHECK_NS) return;
+    hash_checked = now;
+
+    for (size_t i = 0; i < hash_num_dirs; i++) {
+        struct timespec mtime;
+
+        kush_hash_dir_mtime(hash_dirs[i].dir, &mtime);
+        if (mtime.tv_sec != hash_dirs[i].mtime.tv_sec || mtime.tv_nsec != hash_dirs[i].mtime.tv_nsec) {
+            // A command might have been added to or removed from this directory, so start over
+            kush_hash_clear();
+            kush_hash_set_path(path);
+            return;
+        }
+    }
+}
+
+// Returns the slot for name in the cache. The slot is empty if name isn't cached yet.
+kush_hash_entry *kush_hash_slot(const char *name) {
+    size_t i = kush_hash_name(name) & (hash_size - 1);
+
+    while (hash_table[i].name && strcmp(hash_table[i].name, name) != 0) i = (i + 1) & (hash_size - 1);
+
+    return &hash_table[i];
+}
+
+// Doubles the number of slots in the cache once it is more than half full
+void kush_hash_grow() {
+    kush_hash_entry *old = hash_table;
+    size_t old_size = hash_size;
+
+    if (hash_table && hash_used * 2 < hash_size) return;
+
+    hash_size = old_size ? old_size * 2 : KUSH_HASH_SIZE;
+    hash_table = calloc(hash_size, sizeof(kush_hash_entry));
+    if (!hash_table) {
+        fprintf(stderr, "kush: Hash table allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].name) *kush_hash_slot(old[i].name) = old[i];
+    }
+    free(old);
+}
+
+// Searches the PATH directories for an executable called name. Returns a newly allocated path or NULL if
+// there is none. *relative is set to true if the result depends on the current working directory.
+char *kush_hash_search(const char *name, int *relative) {
+    struct stat st;
+    size_t name_len = strlen(name);
+
+    *relative = 0;
+    for (size_t i = 0; i < hash_num_dirs; i++) {
+        size_t dir_len = strlen(hash_dirs[i].dir);
+        char *path = malloc(dir_len + name_len + 2);
+
+        if (!path) {
+            fprintf(stderr, "kush: PATH allocation error");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(path, hash_dirs[i].dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+
+        if (hash_dirs[i].dir[0] != '/') *relative = 1;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) return path;
+        free(path);
+    }
+
+    return NULL;
+}
+
+// Returns the location of the command name, consulting the cache first. Names containing a '/' are returned as
+// they are. Returns NULL if the command couldn't be found. The returned string is owned by the cache.
+const char *kush_hash_lookup(const char *name) {
+    kush_hash_entry *entry;
+    char *path;
+    int relative;
+
+    if (strchr(name, '/')) return name;
+
+    kush_hash_validate();
+    kush_hash_grow();
+
+    entry = kush_hash_slot(name);
+    if (entry->name) { // Cache hit, positive or negative
+        entry->hits++;
+        return entry->path;
+    }
+
+    path = kush_hash_search(name, &relative);
+    // Results that depend on the working directory can't be cached
+    if (relative) {
+        static char *uncached = NULL; // Keeps the last uncached result alive until the next lookup
+
+        free(uncached);
+        uncached = path;
+        return path;
+    }
+
+    entry->name = kush_strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    hash_used++;
+
+    return path;
+}
+
+// Drops the cached location of name, for example because the cached file has vanished
+void kush_hash_forget(const char *name) {
+    kush_hash_entry *entry;
+    size_t i;
+
+    if (!hash_table) return;
+    entry = kush_hash_slot(name);
+    if (!entry->name) return;
+
+    free(entry->name);
+    free(entry->path);
+    entry->name = entry->path = NULL;
+    hash_used--;
+
+    // Re-insert the following entries of the probe sequence so that lookups don't stop at the new hole
+    for (i = (entry - hash_table + 1) & (hash_size - 1); hash_table[i].name; i = (i + 1) & (hash_size - 1)) {
+        kush_hash_entry moved = hash_table[i];
+
+        hash_table[i].name = NULL;
+        *kush_hash_slot(moved.name) = moved;
+    }
+}
+// -----------------------------------------------------------------------------------------
+
+// Built-in function definitions
+#define KUSH_BUILTIN(name, func, flags) int func(char **args);
+#include "builtins.def"
+#undef KUSH_BUILTIN
+
+// The built-in only writes output and doesn't change the state of the shell, so in a foreground pipeline it
+// can run inside the shell instead of a child process of its own
+#define KUSH_BUILTIN_INPROC 0x1
+
+// Function implementing a built-in, gets the argument list and returns 1 if the shell should exit
+typedef int (*kush_builtin_func)(char **);
+
+// A built-in command
+typedef struct kush_builtin {
+    const char *name;
+    kush_builtin_func func;
+    int flags; // Combination of KUSH_BUILTIN_* flags
+} kush_builtin;
+
+// All built-ins, in the order of builtins.def. They are looked up through the perfect hash generated from the
+// same list, see kush_find_builtin().
+const kush_builtin builtins[KUSH_NUM_BUILTINS] = {
+#define KUSH_BUILTIN(name, func, flags) {#name, &func, flags},
+#include "builtins.def"
+#undef KUSH_BUILTIN
+};
+
+// Built-in function implementations
+// -----------------------------------------------------------------------------------------
+int kush_exit(char **args) {
+    (void) args; // Suppress 'unused parameter' warning
+
+    return 1;
+}
+
+int kush_cd(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "kush: Expected argument to `cd` command\n");
+        last_status = 1;
+    } else {
+        if (chdir(args[1]) != 0) {
+            perror("kush: Failed to change directory");
+            last_status = 1;
+        } else if (interactive) kush_prompt_update_cwd(); // The prompt only has to learn about a new directory here
+    }
+
+    return 0;
+}
+
+int kush_help(char **args) {
+    (void) args; // Suppress 'unused parameter' warning
+
+    puts(LOGO_ART);
+    puts("Type the program name and arguments and hit enter to start a program.\n"
+         "The usage of single-quotes and double-quotes (e.g. cd 'some dir') is supported.\n"
+         "Characters can also be escaped with a backslash (e.g. cd some\\ dir).\n"
+         "Programs can be connected with '|' (e.g. ls | wc -l) and their input and output can be redirected\n"
+         "with <, >, >>, 2>, 2>>, 2>&1, >&2 and <<< (here-string).\n"
+         "A '&' at the end of a pipeline runs it in the background, see jobs, fg, bg and wait. Setting\n"
+         "KUSH_JOB_SLOTS limits how many run at once and KUSH_JOB_LOAD or KUSH_JOB_PSI throttle them, see jobstat.\n"
+         "KUSH_PLACEMENT pins programs to CPUs: 'cores', 'nodes' or masks like '0-3:4-7', see jobs -l.\n"
+         "Variables are set with NAME=value and expanded with $NAME, ${NAME}, ${NAME:-default} and $?.\n"
+         "Commands are separated by ';' or newlines and chained with && and ||. Scripts can use if, while, until,\n"
+         "for, case, { ... } and functions (name() { ... }, with $1..$9, $# and $@), break, continue and return.\n"
+         "Text after a '#' is a comment.\n");
+    puts("The following built-in commands are supported:");
+    for (int i = 0; i < KUSH_NUM_BUILTINS; ++i) {
+        printf("- %s\n", builtins[i].name);
+    }
+    puts("");
+
+    return 0;
+}
+
+int kush_hash(char **args) {
+    if (args[1] == NULL) { // Without arguments the cached locations are listed
+        if (hash_used == 0) {
+            puts("kush: hash table empty");
+            return 0;
+        }
+        puts("hits\tcommand");
+        for (size_t i = 0; i < hash_size; i++) {
+            if (hash_table[i].name == NULL) continue;
+            if (hash_table[i].path) printf("%4lu\t%s\n", hash_table[i].hits, hash_table[i].path);
+            else printf("%4lu\t%s (not found)\n", hash_table[i].hits, hash_table[i].name);
+        }
+    } else if (strcmp(args[1], "-r") == 0) { // '-r' resets the cache
+        kush_hash_clear();
+    } else { // Every other argument is looked up and added to the cache
+        for (int i = 1; args[i] != NULL; i++) {
+            if (!kush_hash_lookup(args[i])) {
+                fprintf(stderr, "kush: hash: %s: not found\n", args[i]);
+                last_status = 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int kush_memstat(char **args) {
+    (void) args; // Suppress 'unused parameter' warning
+
+    printf("lines handled:        %lu\n", line_arena.resets);
+    printf("arena malloc calls:   %lu\n", line_arena.mallocs);
+    printf("arena bytes reserved: %zu\n", line_arena.reserved);
+    printf("arena bytes in use:   %zu\n", line_arena.in_use);
+    printf("arena peak per line:  %zu\n", line_arena.peak);
+
+    return 0;
+}
+
+// Shell options that can be switched on with 'set -o name' and off with 'set +o name'
+struct {
+    const char *name;
+    int *value;
+} kush_options[] = {
+        {"pipefail", &opt_pipefail}
+};
+
+int kush_set(char **args) {
+    int num_options = sizeof(kush_options) / sizeof(kush_options[0]);
+
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) { // List the options
+        for (int i = 0; i < num_options; i++) {
+            printf("%-15s %s\n", kush_options[i].name, *kush_options[i].value ? "on" : "off");
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i += 2) {
+        int option;
+
+        if ((strcmp(args[i], "-o") != 0 && strcmp(args[i], "+o") != 0) || args[i + 1] == NULL) {
+            fprintf(stderr, "kush: set: Usage: set [-o|+o option]...\n");
+            last_status = 2;
+            return 0;
+        }
+        for (option = 0; option < num_options; option++) {
+            if (strcmp(args[i + 1], kush_options[option].name) == 0) break;
+        }
+        if (option == num_options) {
+            fprintf(stderr, "kush: set: %s: invalid option name\n", args[i + 1]);
+            last_status = 2;
+            return 0;
+        }
+        *kush_options[option].value = args[i][0] == '-';
+    }
+
+    return 0;
+}
+
+// Writes the escape sequence at str, which follows a backslash, to stdout and returns the number of characters it
+// takes up. With echo_octal set, octal values have to start with a 0 (\0nnn) like for echo, otherwise they are
+// written like for printf (\nnn). Sets *stop for '\c', after which no more output should be written.
+size_t kush_put_escape(const char *str, int echo_octal, int *stop) {
+    static const char escapes[] = "\\\\a\ab\be\033f\fn\nr\rt\tv\v"; // Pairs of escape letter and character
+    const char *digits = echo_octal ? str + 1 : str;
+    size_t len = 0;
+    int value = 0;
+
+    for (size_t i = 0; i < sizeof(escapes) - 1; i += 2) {
+        if (*str == escapes[i]) {
+            putchar(escapes[i + 1]);
+            return 1;
+        }
+    }
+
+    if (*str == 'c') {
+        *stop = 1;
+        return 1;
+    }
+
+    if (*str == 'x') { // Up to two hex digits
+        while (len < 2 && isxdigit((unsigned char) str[1 + len])) {
+            char digit = (char) tolower((unsigned char) str[1 + len++]);
+
+            value = value * 16 + (isdigit((unsigned char) digit) ? digit - '0' : digit - 'a' + 10);
+        }
+        if (len == 0) { // Not an escape after all
+            putchar('\\');
+            return 0;
+        }
+        putchar(value);
+        return 1 + len;
+    }
+
+    if (echo_octal ? *str == '0' : *str >= '0' && *str <= '7') { // Up to three octal digits
+        while (len < 3 && digits[len] >= '0' && digits[len] <= '7') value = value * 8 + digits[len++] - '0';
+        putchar(value & 0xff);
+        return (size_t) (digits - str) + len;
+    }
+
+    putchar('\\'); // Unknown escapes are written as they are
+    return 0;
+}
+
+// Writes str to stdout, interpreting backslash escapes like 'echo -e' does. Returns true if '\c' was found.
+int kush_put_escaped(const char *str, int echo_octal) {
+    int stop = 0;
+
+    for (const char *c = str; *c && !stop; c++) {
+        if (*c == '\\' && c[1]) c += kush_put_escape(c + 1, echo_octal, &stop);
+        else putchar(*c);
+    }
+
+    return stop;
+}
+
+int kush_echo(char **args) {
+    int newline = 1;
+    int escapes = 0;
+    int stop = 0;
+    int i = 1;
+
+    // Like in bash, an argument only counts as options if all its letters are options
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) break;
+
+        for (const char *opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'n') newline = 0;
+            else escapes = *opt == 'e';
+        }
+    }
+
+    for (int first = i; args[i] != NULL && !stop; i++) {
+        if (i > first) putchar(' ');
+        if (escapes) stop = kush_put_escaped(args[i], 1);
+        else fputs(args[i], stdout);
+    }
+    if (newline && !stop) putchar('\n');
+
+    return 0;
+}
+
+// Parses the numeric argument of a printf conversion. Like in other shells a leading quote yields the value of
+// the character after it. Sets last_status if value isn't a valid number, but still returns what could be parsed.
+long double kush_printf_number(const char *value, int floating) {
+    char *end;
+    long double number;
+
+    if (value == NULL || *value == '\0') return 0;
+    if (value[0] == '\'' || value[0] == '"') return (unsigned char) value[1];
+
+    errno = 0;
+    if (floating) number = strtold(value, &end);
+    else if (value[0] == '-') number = (long double) strtoll(value, &end, 0);
+    else number = (long double) strtoull(value, &end, 0);
+    if (*end != '\0' || errno != 0) {
+        fprintf(stderr, "kush: printf: %s: invalid number\n", value);
+        last_status = 1;
+    }
+
+    return number;
+}
+
+// Writes the conversion specification starting at spec (a '%') to stdout, taking the values it needs from *arg.
+// Missing values count as empty strings or zero. Sets *stop if a '%b' value contained '\c'. Returns a pointer to
+// the conversion character, or NULL if the specification is invalid.
+const char *kush_printf_conv(const char *spec, char ***arg, int *stop) {
+    char fmt[32];
+    size_t len = 0;
+    int stars[2];
+    int num_stars = 0;
+    const char *c = spec + 1;
+    const char *value;
+
+    if (*c == '%') {
+        putchar('%');
+        return c;
+    }
+
+    fmt[len++] = '%';
+    while (*c && strchr("-+ #0", *c) && len < 8) fmt[len++] = *c++; // Flags
+    for (int part = 0; part < 2; part++) { // Field width and precision
+        if (part == 1) {
+            if (*c != '.') break;
+            fmt[len++] = *c++;
+        }
+        if (*c == '*') {
+            stars[num_stars++] = (int) kush_printf_number(**arg ? *(*arg)++ : NULL, 0);
+            fmt[len++] = *c++;
+        } else while (isdigit((unsigned char) *c) && len < 24) fmt[len++] = *c++;
+    }
+
+    // Calls printf() with the values for the '*'s in front of the one for the conversion
+#define KUSH_PRINTF(value) (num_stars == 0 ? printf(fmt, value) \
+                            : num_stars == 1 ? printf(fmt, stars[0], value) : printf(fmt, stars[0], stars[1], value))
+
+    value = **arg ? *(*arg)++ : NULL;
+    switch (*c) {
+        case 's':
+        case 'c':
+            // An empty or missing value has no character for '%c', so only the padding of the field is written
+            fmt[len++] = *c == 'c' && value && *value ? 'c' : 's';
+            fmt[len] = '\0';
+            if (fmt[len - 1] == 's') KUSH_PRINTF(*c == 's' && value ? value : "");
+            else KUSH_PRINTF(value[0]);
+            break;
+        case 'b': // Field width and precision aren't supported for %b
+            if (value) *stop = kush_put_escaped(value, 1);
+            break;
+        case 'd':
+        case 'i':
+            strcpy(fmt + len, "lld");
+            fmt[len + 2] = *c;
+            KUSH_PRINTF((long long) kush_printf_number(value, 0));
+            break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+            strcpy(fmt + len, "llu");
+            fmt[len + 2] = *c;
+            KUSH_PRINTF((unsigned long long) (long long) kush_printf_number(value, 0));
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            fmt[len++] = 'L';
+            fmt[len++] = *c;
+            fmt[len] = '\0';
+            KUSH_PRINTF(kush_printf_number(value, 1));
+            break;
+        default:
+            fprintf(stderr, "kush: printf: %%%c: invalid format character\n", *c ? *c : ' ');
+            return NULL;
+    }
+#undef KUSH_PRINTF
+
+    return c;
+}
+
+int kush_printf(char **args) {
+    char **arg = &args[2]; // Next value for a conversion
+    char **start; // Value the current pass over the format started with
+    int stop = 0; // Set by '\c', which ends all output
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "kush: printf: Usage: printf format [arguments]\n");
+        last_status = 2;
+        return 0;
+    }
+
+    // The format is used again as long as there are values left, as long as it uses any
+    do {
+        start = arg;
+        for (const char *c = args[1]; *c && !stop; c++) {
+            if (*c == '\\' && c[1]) c += kush_put_escape(c + 1, 0, &stop);
+            else if (*c != '%') putchar(*c);
+            else if ((c = kush_printf_conv(c, &arg, &stop)) == NULL) {
+                last_status = 1;
+                return 0;
+            }
+        }
+    } while (!stop && arg != start && *arg != NULL);
+
+    return 0;
+}
+
+// Unary operators of test
+const char *kush_test_unary[] = {"-b", "-c", "-d", "-e", "-f", "-g", "-h", "-k", "-L", "-n", "-p", "-r", "-s",
+                                 "-S", "-t", "-u", "-w", "-x", "-z", NULL};
+// Binary operators of test
+const char *kush_test_binary[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot",
+                                  "-ef", NULL};
+
+// Returns true if op is in the NULL terminated list ops
+int kush_test_is(const char *op, const char **ops) {
+    for (int i = 0; ops[i] != NULL; i++) {
+        if (strcmp(op, ops[i]) == 0) return 1;
+    }
+
+    return 0;
+}
+
+// State of the parser of a test expression
+typedef struct kush_test_parser {
+    char **args;
+    int pos; // Next argument to look at
+    int end; // Number of arguments of the expression
+    int error; // Boolean value telling if the expression is invalid
+} kush_test_parser;
+
+// Parses an integer operand of test. Flags an error if str isn't an integer.
+long long kush_test_int(kush_test_parser *parser, const char *str) {
+    char *end;
+    long long value;
+
+    errno = 0;
+    value = strtoll(str, &end, 10);
+    while (isspace((unsigned char) *end)) end++;
+    if (end == str || *end != '\0' || errno != 0) {
+        fprintf(stderr, "kush: test: %s: integer expression expected\n", str);
+        parser->error = 1;
+    }
+
+    return value;
+}
+
+// Evaluates a unary file or string test
+int kush_test_unary_op(kush_test_parser *parser, const char *op, const char *arg) {
+    struct stat st;
+
+    switch (op[1]) {
+        case 'n':
+            return *arg != '\0';
+        case 'z':
+            return *arg == '\0';
+        case 't':
+            return isatty((int) kush_test_int(parser, arg));
+        case 'h':
+        case 'L':
+            return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r':
+            return access(arg, R_OK) == 0;
+        case 'w':
+            return access(arg, W_OK) == 0;
+        case 'x':
+            return access(arg, X_OK) == 0;
+        default:
+            break;
+    }
+
+    if (stat(arg, &st) != 0) return 0;
+    switch (op[1]) {
+        case 'b':
+            return S_ISBLK(st.st_mode);
+        case 'c':
+            return S_ISCHR(st.st_mode);
+        case 'd':
+            return S_ISDIR(st.st_mode);
+        case 'f':
+            return S_ISREG(st.st_mode);
+        case 'p':
+            return S_ISFIFO(st.st_mode);
+        case 'S':
+            return S_ISSOCK(st.st_mode);
+        case 's':
+            return st.st_size > 0;
+        case 'g':
+            return (st.st_mode & S_ISGID) != 0;
+        case 'u':
+            return (st.st_mode & S_ISUID) != 0;
+        case 'k':
+            return (st.st_mode & S_ISVTX) != 0;
+        default: // '-e'
+            return 1;
+    }
+}
+
+// Evaluates a binary string, integer or file comparison
+int kush_test_binary_op(kush_test_parser *parser, const char *left, const char *op, const char *right) {
+    struct stat left_st, right_st;
+    int left_ok, right_ok;
+
+    if (op[0] != '-') {
+        int cmp = strcmp(left, right);
+
+        if (op[0] == '<') return cmp < 0;
+        if (op[0] == '>') return cmp > 0;
+        return op[0] == '!' ? cmp != 0 : cmp == 0;
+    }
+
+    if ((op[1] == 'n' && op[2] == 't') || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) { // File comparisons
+        left_ok = stat(left, &left_st) == 0;
+        right_ok = stat(right, &right_st) == 0;
+        if (op[1] == 'e') {
+            return left_ok && right_ok && left_st.st_dev == right_st.st_dev && left_st.st_ino == right_st.st_ino;
+        }
+        if (op[1] == 'o') { // Older than, which is newer than with the operands swapped
+            struct stat tmp = left_st;
+            int tmp_ok = left_ok;
+
+            left_st = right_st;
+            left_ok = right_ok;
+            right_st = tmp;
+            right_ok = tmp_ok;
+        }
+        if (!left_ok) return 0;
+        if (!right_ok) return 1;
+        return left_st.st_mtim.tv_sec > right_st.st_mtim.tv_sec
+               || (left_st.st_mtim.tv_sec == right_st.st_mtim.tv_sec
+                   && left_st.st_mtim.tv_nsec > right_st.st_mtim.tv_nsec);
+    }
+
+    long long a = kush_test_int(parser, left);
+    long long b = kush_test_int(parser, right);
+
+    if (strcmp(op, "-eq") == 0) return a == b;
+    if (strcmp(op, "-ne") == 0) return a != b;
+    if (strcmp(op, "-lt") == 0) return a < b;
+    if (strcmp(op, "-le") == 0) return a <= b;
+    if (strcmp(op, "-gt") == 0) return a > b;
+    return a >= b;
+}
+
+int kush_test_or(kush_test_parser *parser);
+
+// Parses and evaluates a primary of a test expression: a parenthesized expression, a unary or binary test or a
+// single string, which is true if it isn't empty
+int kush_test_primary(kush_test_parser *parser) {
+    char **args = parser->args;
+    int pos = parser->pos;
+    int result;
+
+    if (pos >= parser->end) {
+        fprintf(stderr, "kush: test: argument expected\n");
+        parser->error = 1;
+        return 0;
+    }
+
+    if (parser->end - pos >= 3 && kush_test_is(args[pos + 1], kush_test_binary)) {
+        parser->pos += 3;
+        return kush_test_binary_op(parser, args[pos], args[pos + 1], args[pos + 2]);
+    }
+
+    if (strcmp(args[pos], "(") == 0) {
+        parser->pos++;
+        result = kush_test_or(parser);
+        if (parser->pos >= parser->end || strcmp(args[parser->pos], ")") != 0) {
+            fprintf(stderr, "kush: test: ')' expected\n");
+            parser->error = 1;
+        }
+        parser->pos++;
+        return result;
+    }
+
+    if (parser->end - pos >= 2 && kush_test_is(args[pos], kush_test_unary)) {
+        parser->pos += 2;
+        return kush_test_unary_op(parser, args[pos], args[pos + 1]);
+    }
+
+    parser->pos++;
+    return args[pos][0] != '\0';
+}
+
+// Parses and evaluates a negation, which may be applied any number of times
+int kush_test_not(kush_test_parser *parser) {
+    // A lone '!' is just a non-empty string
+    if (parser->end - parser->pos >= 2 && strcmp(parser->args[parser->pos], "!") == 0) {
+        parser->pos++;
+        return !kush_test_not(parser);
+    }
+
+    return kush_test_primary(parser);
+}
+
+// Parses and evaluates the conjunction of negations with '-a'
+int kush_test_and(kush_test_parser *parser) {
+    int result = kush_test_not(parser);
+
+    while (parser->pos < parser->end - 1 && strcmp(parser->args[parser->pos], "-a") == 0) {
+        parser->pos++;
+        result = kush_test_not(parser) && result;
+    }
+
+    return result;
+}
+
+// Parses and evaluates the disjunction of conjunctions with '-o', the lowest precedence there is
+int kush_test_or(kush_test_parser *parser) {
+    int result = kush_test_and(parser);
+
+    while (parser->pos < parser->end - 1 && strcmp(parser->args[parser->pos], "-o") == 0) {
+        parser->pos++;
+        result = kush_test_and(parser) || result;
+    }
+
+    return result;
+}
+
+// Implements both 'test' and '['. The status is 0 if the expression is true, 1 if it is false and 2 if it is
+// invalid.
+int kush_test(char **args) {
+    kush_test_parser parser = {.args = args, .pos = 1, .end = 0, .error = 0};
+    int result;
+
+    while (args[parser.end] != NULL) parser.end++;
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[parser.end - 1], "]") != 0) {
+            fprintf(stderr, "kush: [: missing ']'\n");
+            last_status = 2;
+            return 0;
+        }
+        parser.end--;
+    }
+
+    if (parser.pos == parser.end) { // No expression at all is false
+        last_status = 1;
+        return 0;
+    }
+
+    result = kush_test_or(&parser);
+    if (!parser.error && parser.pos < parser.end) {
+        fprintf(stderr, "kush: test: %s: unexpected argument\n", args[parser.pos]);
+        parser.error = 1;
+    }
+    last_status = parser.error ? 2 : !result;
+
+    return 0;
+}
+
+int kush_export(char **args) {
+    if (args[1] == NULL) { // List the exported variables
+        for (size_t i = 0; i < var_size; i++) {
+            if (var_table[i].value && (var_table[i].flags & KUSH_VAR_EXPORT)) {
+                printf("export %s='%s'\n", var_table[i].name, var_table[i].value);
+            }
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t name_len = kush_var_name_len(args[i]);
+        const char *value;
+
+        if (name_len == 0 || (args[i][name_len] != '=' && args[i][name_len] != '\0')) {
+            fprintf(stderr, "kush: export: %s: not a valid identifier\n", args[i]);
+            last_status = 1;
+            continue;
+        }
+        // Exporting a variable without a value exports the value it already has, or an empty one
+        value = args[i][name_len] == '=' ? args[i] + name_len + 1 : kush_var_lookup(args[i], name_len);
+        kush_var_set(args[i], name_len, value ? value : "", KUSH_VAR_EXPORT);
+    }
+
+    return 0;
+}
+
+int kush_unset(char **args) {
+    for (int i = 1; args[i] != NULL; i++) {
+        size_t name_len = kush_var_name_len(args[i]);
+
+        if (name_len == 0 || args[i][name_len] != '\0') {
+            fprintf(stderr, "kush: unset: %s: not a valid identifier\n", args[i]);
+            last_status = 1;
+            continue;
+        }
+        kush_var_set(args[i], name_len, NULL, 0);
+    }
+
+    return 0;
+}
+
+int kush_true(char **args) {
+    (void) args; // Suppress 'unused parameter' warning
+
+    return 0;
+}
+
+int kush_false(char **args) {
+    (void) args; // Suppress 'unused parameter' warning
+
+    last_status = 1;
+    return 0;
+}
+
+int kush_pwd(char **args) {
+    char cwd[PATH_MAX];
+
+    (void) args; // Suppress 'unused parameter' warning
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("kush: pwd");
+        last_status = 1;
+    } else puts(cwd);
+
+    return 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// CPU placement
+// -----------------------------------------------------------------------------------------
+// KUSH_PLACEMENT pins the programs the shell launches to CPUs. With 'cores' every process gets the next CPU in
+// turn. With 'nodes' every job gets all CPUs of one NUMA node: the first node that has a CPU to spare for it, or else
+// the least busy one. Anything else is a list of CPU masks like '0-3,8:4-7', which the jobs get in turn. Only CPUs
+// the shell may use itself are handed out. A process inherits its mask from the shell when it's created, so the
+// mask is in place before the program allocates its first memory, which the kernel then takes from the local node.
+
+// A NUMA node with CPUs the shell may use
+typedef struct kush_place_node {
+    int id; // Number of the node
+    cpu_set_t cpus;
+    int num_cpus;
+    int load; // Running processes placed on the node
+} kush_place_node;
+
+cpu_set_t place_allowed; // CPUs the shell may use, read on first use of a placement
+int place_cpus[CPU_SETSIZE]; // The numbers of those CPUs in ascending order
+int place_num_cpus = 0; // 0 until the topology has been read
+kush_place_node *place_nodes = NULL;
+int place_num_nodes = 0;
+unsigned place_next = 0; // Turn of the next CPU ('cores') or mask to hand out
+cpu_set_t place_set; // Mask of the current job, or of the process last placed with 'cores'
+int place_node = -1; // Node of the current job with 'nodes', -1 if it has none
+int place_job = 0; // Boolean value telling if the current job is pinned to place_set
+char *place_bad = NULL; // Last invalid value of KUSH_PLACEMENT, reported only once
+
+// Parses a CPU list like '0-3,8' of length len into set. Returns 0 on success and -1 if the list isn't valid.
+int kush_place_parse(const char *list, size_t len, cpu_set_t *set) {
+    const char *end = list + len;
+
+    CPU_ZERO(set);
+    while (list < end) {
+        char *next;
+        long first = strtol(list, &next, 10);
+        long last = first;
+
+        if (next == list || first < 0) return -1;
+        if (next < end && *next == '-') {
+            list = next + 1;
+            last = strtol(list, &next, 10);
+            if (next == list || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        if (next < end && *next != ',') return -1;
+        list = next < end ? next + 1 : end;
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// Writes set as a CPU list like '0-3,8' into the size bytes at buff
+void kush_place_format(const cpu_set_t *set, char *buff, size_t size) {
+    size_t len = 0;
+
+    buff[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++) {
+        int last = cpu;
+
+        if (!CPU_ISSET(cpu, set)) continue;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) last++;
+        if (last == cpu) len += snprintf(buff + len, size - len, "%s%d", len ? "," : "", cpu);
+        else len += snprintf(buff + len, size - len, "%s%d-%d", len ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// Adds the NUMA node id with the CPUs in list (of length len) to the nodes, as far as the shell may use them
+void kush_place_add_node(int id, const char *list, size_t len) {
+    kush_place_node *node;
+    cpu_set_t cpus;
+
+    if (kush_place_parse(list, len, &cpus) != 0) return;
+    CPU_AND(&cpus, &cpus, &place_allowed);
+    if (CPU_COUNT(&cpus) == 0) return;
+
+    place_nodes = realloc(place_nodes, (place_num_nodes + 1) * sizeof(kush_place_node)); // NOLINT
+    if (!place_nodes) {
+        fprintf(stderr, "kush: Placement allocation error");
+        exit(EXIT_FAILURE);
+    }
+    node = &place_nodes[place_num_nodes++];
+    node->id = id;
+    node->cpus = cpus;
+    node->num_cpus = CPU_COUNT(&cpus);
+    node->load = 0;
+}
+
+// Reads the CPUs the shell may use and the NUMA nodes they belong to, from /sys/devices/system/node. Without NUMA
+// all of them make up node 0.
+void kush_place_init() {
+    DIR *dir;
+    struct dirent *entry;
+    char list[4096];
+
+    if (sched_getaffinity(0, sizeof(place_allowed), &place_allowed) != 0) {
+        CPU_ZERO(&place_allowed);
+        CPU_SET(0, &place_allowed);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &place_allowed)) place_cpus[place_num_cpus++] = cpu;
+    }
+
+    dir = opendir("/sys/devices/system/node");
+    while (dir && (entry = readdir(dir)) != NULL) {
+        char path[64 + sizeof(entry->d_name)];
+        int fd;
+        ssize_t len;
+
+        if (strncmp(entry->d_name, "node", 4) != 0 || !isdigit((unsigned char) entry->d_name[4])) continue;
+        sprintf(path, "/sys/devices/system/node/%s/cpulist", entry->d_name);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        len = fd >= 0 ? read(fd, list, sizeof(list)) : -1;
+        if (fd >= 0) close(fd);
+        while (len > 0 && isspace((unsigned char) list[len - 1])) len--;
+        if (len > 0) kush_place_add_node(atoi(entry->d_name + 4), list, len);
+    }
+    if (dir) closedir(dir);
+
+    // readdir() returns the nodes in any order
+    for (int i = 1; i < place_num_nodes; i++) {
+        kush_place_node node = place_nodes[i];
+        int j = i;
+
+        for (; j > 0 && place_nodes[j - 1].id > node.id; j--) place_nodes[j] = place_nodes[j - 1];
+        place_nodes[j] = node;
+    }
+    if (place_num_nodes == 0) {
+        kush_place_format(&place_allowed, list, sizeof(list));
+        kush_place_add_node(0, list, strlen(list));
+    }
+}
+
+// Returns the index of the node cpu belongs to, -1 if it isn't a CPU the shell may use
+int kush_place_node_of(int cpu) {
+    for (int i = 0; i < place_num_nodes; i++) {
+        if (CPU_ISSET(cpu, &place_nodes[i].cpus)) return i;
+    }
+
+    return -1;
+}
+
+// Chooses where the job that is about to be launched runs, as KUSH_PLACEMENT asks for. Has to be called before
+// the processes of every job are launched. With 'cores' the processes are placed one by one instead.
+void kush_place_job() {
+    const char *value = kush_var_get("KUSH_PLACEMENT");
+    const char *mask;
+    size_t num_masks = 1;
+    size_t len;
+
+    place_job = 0;
+    place_node = -1;
+    if (!value || !*value || strcmp(value, "cores") == 0) return;
+    if (place_num_cpus == 0) kush_place_init();
+
+    if (strcmp(value, "nodes") == 0) {
+        int best = 0;
+
+        for (int i = 0; i < place_num_nodes; i++) {
+            kush_place_node *node = &place_nodes[i];
+
+            if (node->load < node->num_cpus) {
+                best = i;
+                break;
+            }
+            // All nodes so far are busy, so the one with the fewest processes per CPU is taken
+            if ((long) node->load * place_nodes[best].num_cpus < (long) place_nodes[best].load * node->num_cpus) {
+                best = i;
+            }
+        }
+        place_node = best;
+        place_set = place_nodes[best].cpus;
+        place_job = 1;
+        return;
+    }
+
+    for (const char *c = value; *c; c++) num_masks += *c == ':';
+    mask = value;
+    for (size_t i = place_next++ % num_masks; i > 0; i--) mask = strchr(mask, ':') + 1;
+    len = strchrnul(mask, ':') - mask;
+    if (kush_place_parse(mask, len, &place_set) == 0) CPU_AND(&place_set, &place_set, &place_allowed);
+    else CPU_ZERO(&place_set);
+
+    if (CPU_COUNT(&place_set) > 0) place_job = 1;
+    else if (!place_bad || strcmp(place_bad, value) != 0) { // Only reported once, not for every job
+        fprintf(stderr, "kush: KUSH_PLACEMENT: '%.*s' isn't a list of CPUs kush may use\n", (int) len, mask);
+        free(place_bad);
+        place_bad = strdup(value);
+    }
+}
+
+// Returns the mask the next process of the current job is pinned to, or NULL if it keeps the CPUs of the shell.
+// *node is set to the index of the node the process is counted on, -1 if it isn't counted on one. The count has to
+// be released with kush_place_release() once the process is done.
+cpu_set_t *kush_place(int *node) {
+    const char *value;
+    int cpu;
+
+    *node = -1;
+    if (!place_job) {
+        value = kush_var_get("KUSH_PLACEMENT");
+        if (!value || strcmp(value, "cores") != 0) return NULL;
+        if (place_num_cpus == 0) kush_place_init();
+
+        cpu = place_cpus[place_next++ % place_num_cpus];
+        CPU_ZERO(&place_set);
+        CPU_SET(cpu, &place_set);
+        *node = kush_place_node_of(cpu);
+    } else *node = place_node;
+
+    if (*node >= 0) place_nodes[*node].load++;
+    return &place_set;
+}
+
+// Releases the count of a process that was placed on the node with index node, if it was counted on one
+void kush_place_release(int node) {
+    if (node >= 0) place_nodes[node].load--;
+}
+
+// Prints where process pid may run and where it ran last, like 'cpus 0-3, on cpu 2 of node 0'
+void kush_place_print(pid_t pid) {
+    cpu_set_t cpus;
+    char buff[1024];
+    char *fields;
+    int cpu = -1;
+    int node;
+    int fd;
+    ssize_t len;
+
+    if (place_num_cpus == 0) kush_place_init();
+    if (sched_getaffinity(pid, sizeof(cpus), &cpus) != 0) {
+        printf("gone");
+        return;
+    }
+    kush_place_format(&cpus, buff, sizeof(buff));
+    printf("cpus %s", buff);
+
+    // The CPU is the 39th field of the stat file, the 37th after the command name in parentheses
+    sprintf(buff, "/proc/%d/stat", pid);
+    fd = open(buff, O_RDONLY | O_CLOEXEC);
+    len = fd >= 0 ? read(fd, buff, sizeof(buff) - 1) : -1;
+    if (fd >= 0) close(fd);
+    if (len <= 0) return;
+    buff[len] = '\0';
+    fields = strrchr(buff, ')');
+    for (int i = 0; fields && i < 37; i++) fields = strchr(fields + 1, ' ');
+    if (fields) cpu = atoi(fields + 1);
+    node = cpu >= 0 ? kush_place_node_of(cpu) : -1;
+    if (node >= 0) printf(", on cpu %d of node %d", cpu, place_nodes[node].id);
+    else if (cpu >= 0) printf(", on cpu %d", cpu);
+}
+// -----------------------------------------------------------------------------------------
+
+// A redirection of one of the descriptors of a command
+typedef struct kush_redir {
+    int op; // The redirection operator, one of the KUSH_OP_* redirections
+    char *target; // File name or here-string, NULL for '2>&1' and '>&2'
+    int source_fd; // Descriptor the redirected descriptor becomes a copy of, set up by kush_redir_open()
+} kush_redir;
+
+// A single command with its arguments and redirections
+typedef struct kush_command {
+    char **argv; // NULL terminated argument list, argv[0] names the program or built-in to run
+    kush_redir *redirs; // Redirections in the order they have to be applied in
+    int num_redirs;
+    char **assigns; // Variable assignments ('NAME=value') in front of the command
+    int num_assigns;
+} kush_command;
+
+// Descriptor every redirection operator redirects and the flags its target is opened with
+struct {
+    int fd;
+    int flags;
+} kush_redir_ops[KUSH_NUM_OPS] = {
+        [KUSH_OP_IN] = {STDIN_FILENO, O_RDONLY},
+        [KUSH_OP_OUT] = {STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+        [KUSH_OP_APPEND] = {STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND},
+        [KUSH_OP_ERR] = {STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+        [KUSH_OP_ERR_APPEND] = {STDERR_FILENO, O_WRONLY | O_CREAT | O_APPEND},
+        [KUSH_OP_ERR_TO_OUT] = {STDERR_FILENO, 0},
+        [KUSH_OP_OUT_TO_ERR] = {STDOUT_FILENO, 0},
+        [KUSH_OP_HERESTRING] = {STDIN_FILENO, 0}
+};
+
+// Returns true if op is a redirection operator
+int kush_op_is_redir(int op) {
+    return op >= KUSH_OP_IN && op <= KUSH_OP_HERESTRING;
+}
+
+// Moves the redirections and leading variable assignments out of the argument list args and fills cmd with the rest.
+// Prints an error and returns -1 if a redirection is missing its target.
+int kush_parse_command(char **args, kush_command *cmd) {
+    int num_args = 0;
+
+    cmd->argv = args;
+    cmd->redirs = NULL;
+    cmd->num_redirs = 0;
+    cmd->assigns = args; // Assignments are moved in front of the arguments
+    cmd->num_assigns = 0;
+
+    for (int i = 0; args[i] != NULL; i++) {
+        int op = kush_op_type(args[i]);
+
+        // Words in front of the program name that look like NAME=value are assignments
+        size_t name_len = op < 0 && num_args == 0 ? kush_var_name_len(args[i]) : 0;
+
+        if (name_len > 0 && args[i][name_len] == '=') {
+            args[cmd->num_assigns++] = args[i];
+            continue;
+        }
+        if (!kush_op_is_redir(op)) {
+            args[cmd->num_assigns + num_args++] = args[i];
+            continue;
+        }
+
+        if (!cmd->redirs) { // There can't be more redirections than tokens left
+            int left = 0;
+
+            while (args[i + left] != NULL) left++;
+            cmd->redirs = kush_arena_alloc(&line_arena, left * sizeof(kush_redir));
+        }
+        kush_redir *redir = &cmd->redirs[cmd->num_redirs++];
+        redir->op = op;
+        redir->target = NULL;
+        redir->source_fd = -1;
+
+        if (op == KUSH_OP_ERR_TO_OUT || op == KUSH_OP_OUT_TO_ERR) continue;
+        if (args[i + 1] == NULL || kush_op_type(args[i + 1]) >= 0) {
+            fprintf(stderr, "kush: Syntax error near unexpected token '%s'\n", args[i + 1] ? args[i + 1] : "newline");
+            last_status = 2;
+            return -1;
+        }
+        redir->target = args[++i];
+    }
+    cmd->argv = args + cmd->num_assigns;
+    cmd->argv[num_args] = NULL;
+
+    return 0;
+}
+
+// Closes the descriptors opened by kush_redir_open()
+void kush_redir_close(kush_command *cmd) {
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        if (cmd->redirs[i].source_fd > STDERR_FILENO) close(cmd->redirs[i].source_fd);
+        cmd->redirs[i].source_fd = -1;
+    }
+}
+
+// Opens the targets of all redirections of cmd. The descriptors are close-on-exec, a launched program only gets
+// the copies made for the redirected descriptors. Here-strings are put into a memfd, so no temporary file is
+// needed. Prints an error and returns -1 if a target can't be opened.
+int kush_redir_open(kush_command *cmd) {
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        kush_redir *redir = &cmd->redirs[i];
+
+        if (redir->op == KUSH_OP_ERR_TO_OUT) {
+            redir->source_fd = STDOUT_FILENO; // Whatever stdout is at this point of the redirections
+        } else if (redir->op == KUSH_OP_OUT_TO_ERR) {
+            redir->source_fd = STDERR_FILENO;
+        } else if (redir->op == KUSH_OP_HERESTRING) {
+            size_t len = strlen(redir->target);
+
+            redir->source_fd = memfd_create("kush-herestring", MFD_CLOEXEC);
+            if (redir->source_fd < 0
+                || write(redir->source_fd, redir->target, len) != (ssize_t) len
+                || write(redir->source_fd, "\n", 1) != 1
+                || lseek(redir->source_fd, 0, SEEK_SET) != 0) {
+                perror("kush: Error creating here-string");
+                kush_redir_close(cmd);
+                return -1;
+            }
+        } else {
+            redir->source_fd = open(redir->target, kush_redir_ops[redir->op].flags | O_CLOEXEC, 0666);
+            if (redir->source_fd < 0) {
+                fprintf(stderr, "kush: %s: %s\n", redir->target, strerror(errno));
+                kush_redir_close(cmd);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Flags for kush_launch.flags
+// The launch needs child-side setup that posix_spawn() can't express, so it has to go through fork()
+#define KUSH_LAUNCH_FORK 0x1
+
+// Describes a single program launch handed to kush_spawn()
+typedef struct kush_launch {
+    kush_command *cmd; // Command to launch, its redirections have to be opened already
+    const char *path; // Location of the program, resolved by kush_spawn()
+    int flags; // Combination of KUSH_LAUNCH_* flags
+    int stdin_fd; // Descriptor the program gets as stdin, -1 to keep ours
+    int stdout_fd; // Descriptor the program gets as stdout, -1 to keep ours
+    pid_t pgid; // Process group to put the program into, 0 for a new group and -1 to stay in ours
+    int foreground; // Boolean value telling if the process group of the program should get the terminal
+    int (*builtin)(char **); // Built-in to run in a child process instead of a program. Requires KUSH_LAUNCH_FORK.
+    char **envp; // Environment of the program, set by kush_spawn()
+    cpu_set_t *cpus; // CPUs the program is pinned to, set by kush_spawn(). NULL if it keeps those of the shell.
+    int node; // Node kush_spawn() has counted the process on, see kush_place(). -1 if it isn't counted on one.
+} kush_launch;
+
+// Returns the environment for the program cmd runs: environ, with the assignments in front of the command added.
+// An environment with additions is allocated from the line arena.
+char **kush_env_for(kush_command *cmd) {
+    char **envp;
+    int num_env = 0;
+    int pos = 0;
+
+    kush_env_update();
+    if (cmd->num_assigns == 0) return environ;
+
+    while (environ[num_env] != NULL) num_env++;
+    envp = kush_arena_alloc(&line_arena, (num_env + cmd->num_assigns + 1) * sizeof(char *));
+    for (int i = 0; i < num_env; i++) {
+        size_t name_len = strchrnul(environ[i], '=') - environ[i] + 1; // Including the '='
+        int replaced = 0;
+
+        for (int j = 0; j < cmd->num_assigns && !replaced; j++) {
+            replaced = strncmp(environ[i], cmd->assigns[j], name_len) == 0;
+        }
+        if (!replaced) envp[pos++] = environ[i];
+    }
+    // The assignments are NAME=value strings already, just what the environment needs
+    for (int j = 0; j < cmd->num_assigns; j++) envp[pos++] = cmd->assigns[j];
+    envp[pos] = NULL;
+
+    return envp;
+}
+
+// Signals the shell handles or ignores, which have to be reset to their default for launched programs
+sigset_t child_sigdefault;
+extern int job_control; // See the job control section
+extern struct kush_sched_entry *sched_head; // See the job scheduler
+
+// Fallback launch path for launches posix_spawn() can't handle. Forks the shell and executes the program
+// in the child. Returns the pid of the child or -1 on failure.
+pid_t kush_fork_exec(kush_launch *launch) {
+    pid_t pid = fork(); // Forks a child process
+
+    if (pid == 0) { // If we are in the child process...
+        kush_command *cmd = launch->cmd;
+        sigset_t mask;
+
+        if (launch->pgid >= 0) setpgid(0, launch->pgid);
+        if (launch->foreground) tcsetpgrp(STDIN_FILENO, getpgrp()); // SIGTTOU is still ignored at this point
+        // The child shouldn't share our signal handling
+        for (int sig = 1; sig < NSIG; sig++) {
+            if (sigismember(&child_sigdefault, sig) == 1) signal(sig, SIG_DFL);
+        }
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL); // Signals the shell blocks for its signalfd
+        if (launch->cpus) sched_setaffinity(0, sizeof(cpu_set_t), launch->cpus);
+
+        if (launch->stdin_fd >= 0) dup2(launch->stdin_fd, STDIN_FILENO);
+        if (launch->stdout_fd >= 0) dup2(launch->stdout_fd, STDOUT_FILENO);
+        for (int i = 0; i < cmd->num_redirs; i++) {
+            dup2(cmd->redirs[i].source_fd, kush_redir_ops[cmd->redirs[i].op].fd);
+        }
+        closefrom(STDERR_FILENO + 1); // No stray descriptors for the child
+
+        if (launch->builtin) { // Built-ins run right here in the child
+            job_control = 0; // Pipelines of a function belong to the job of the child
+            signal_fd = -1; // Closed above, signals aren't blocked in the child
+            sched_head = NULL; // Jobs the shell has queued aren't the child's to start
+            launch->builtin(cmd->argv);
+            fflush(stdout);
+            _exit(last_status);
+        }
+
+        // Try to execute the given file and pass it all the other parameters.
+        execve(launch->path, cmd->argv, launch->envp);
+
+        // execv will only return on error so if we get here we print the error message and exit the child process
+        perror("kush: Error executing the desired program");
+        _exit(EXIT_FAILURE);
+    } else if (pid < 0) perror("kush: Error forking a child process");
+
+    return pid;
+}
+
+// Starts the program described by launch and returns the pid of the new process or -1 on failure.
+// The program is looked up through the command location cache and started with posix_spawn(), which glibc
+// implements with clone(CLONE_VM | CLONE_VFORK). That way the cost of a launch doesn't grow with the size of the
+// shell's address space like a fork() does, as no page tables have to be copied. Pipes and redirections are
+// set up as file actions of the spawn, and every descriptor above stderr is closed for the new program.
+// A placement mask is set on the shell for the spawn, as there is no spawn attribute for it, so the new process
+// inherits it.
+pid_t kush_spawn(kush_launch *launch) {
+    kush_command *cmd = launch->cmd;
+    pid_t pid;
+    int errcode;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t mask;
+    cpu_set_t shell_cpus;
+
+    launch->envp = kush_env_for(cmd);
+    launch->cpus = NULL;
+    launch->node = -1;
+    if (!launch->builtin) {
+        launch->path = kush_hash_lookup(cmd->argv[0]);
+        if (!launch->path) {
+            fprintf(stderr, "kush: %s: command not found\n", cmd->argv[0]);
+            return -1;
+        }
+    }
+
+    launch->cpus = kush_place(&launch->node);
+    if (launch->builtin || launch->flags & KUSH_LAUNCH_FORK) {
+        pid = kush_fork_exec(launch);
+        if (pid < 0) kush_place_release(launch->node);
+        return pid;
+    }
+
+    // The child should start with an empty signal mask and default signal handling, no matter what the shell does
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &child_sigdefault);
+    if (launch->pgid >= 0) posix_spawnattr_setpgroup(&attr, launch->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF
+                                    | (launch->pgid >= 0 ? POSIX_SPAWN_SETPGROUP : 0));
+
+    posix_spawn_file_actions_init(&actions);
+    // The terminal has to be handed over before the program can run, or it could be stopped by SIGTTIN right away
+    if (launch->foreground) posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+    if (launch->stdin_fd >= 0) posix_spawn_file_actions_adddup2(&actions, launch->stdin_fd, STDIN_FILENO);
+    if (launch->stdout_fd >= 0) posix_spawn_file_actions_adddup2(&actions, launch->stdout_fd, STDOUT_FILENO);
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        posix_spawn_file_actions_adddup2(&actions, cmd->redirs[i].source_fd, kush_redir_ops[cmd->redirs[i].op].fd);
+    }
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+    if (launch->cpus && sched_getaffinity(0, sizeof(shell_cpus), &shell_cpus) != 0) launch->cpus = NULL;
+    if (launch->cpus) sched_setaffinity(0, sizeof(cpu_set_t), launch->cpus);
+    errcode = posix_spawn(&pid, launch->path, &actions, &attr, cmd->argv, launch->envp);
+    if ((errcode == ENOENT || errcode == EACCES) && launch->path != cmd->argv[0]) {
+        // The cached location is stale, so look the command up again and retry once
+        kush_hash_forget(cmd->argv[0]);
+        launch->path = kush_hash_lookup(cmd->argv[0]);
+        if (launch->path) errcode = posix_spawn(&pid, launch->path, &actions, &attr, cmd->argv, launch->envp);
+    }
+    if (launch->cpus) sched_setaffinity(0, sizeof(shell_cpus), &shell_cpus);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    // posix_spawn() reports a failed exec in the child through its return value
+    if (errcode != 0) {
+        fprintf(stderr, "kush: Error executing the desired program: %s\n", strerror(errcode));
+        kush_place_release(launch->node);
+        return -1;
+    }
+
+    return pid;
+}
+
+// Converts a status reported by waitpid() into an exit status the same way other shells report it
+int kush_status_code(int status) {
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    return 128 + WTERMSIG(status);
+}
+
+// Returns the index of the built-in called name or -1 if there is none. The generated perfect hash names the only
+// built-in that can match, so every lookup costs a single strcmp() no matter how many built-ins there are.
+int kush_find_builtin(const char *name) {
+    int builtin = kush_builtin_index(name);
+
+    return builtin >= 0 && strcmp(name, builtins[builtin].name) == 0 ? builtin : -1;
+}
+
+// Functions are defined by scripts, see the scripts section
+struct kush_function *kush_function_find(const char *name);
+int kush_call_function(char **args);
+
+// Returns what runs the command called name inside the shell: kush_call_function() for a function (which take
+// precedence), the built-in of that name or NULL if it is a program
+kush_builtin_func kush_find_inshell(const char *name) {
+    int builtin;
+
+    if (kush_function_find(name)) return kush_call_function;
+    builtin = kush_find_builtin(name);
+    return builtin >= 0 ? builtins[builtin].func : NULL;
+}
+
+// Runs a built-in (or function) inside the shell. For the time it runs, stdin and stdout are replaced by stdin_fd and
+// stdout_fd (unless they are -1) and the redirections of cmd are applied to the descriptors of the shell itself, the
+// original descriptors are put back afterwards.
+int kush_run_builtin(kush_builtin_func func, kush_command *cmd, int stdin_fd, int stdout_fd) {
+    int num_fds = cmd->num_redirs + 2;
+    int *source; // Descriptor that is dup2()'d to target
+    int *target;
+    int *saved;
+    int exit;
+
+    last_status = 0; // Built-ins set a different status if they fail
+    pipe_num_status = 0;
+    if (cmd->num_redirs == 0 && stdin_fd < 0 && stdout_fd < 0) {
+        exit = func(cmd->argv);
+        fflush(stdout); // The output of every built-in is written at once
+        return exit;
+    }
+
+    if (kush_redir_open(cmd) != 0) {
+        last_status = 1;
+        return 0;
+    }
+
+    source = kush_arena_alloc(&line_arena, 3 * num_fds * sizeof(int));
+    target = source + num_fds;
+    saved = target + num_fds;
+    source[0] = stdin_fd;
+    target[0] = STDIN_FILENO;
+    source[1] = stdout_fd;
+    target[1] = STDOUT_FILENO;
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        source[i + 2] = cmd->redirs[i].source_fd;
+        target[i + 2] = kush_redir_ops[cmd->redirs[i].op].fd;
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < num_fds; i++) {
+        if (source[i] < 0) continue;
+
+        saved[i] = fcntl(target[i], F_DUPFD_CLOEXEC, STDERR_FILENO + 1); // -1 if the descriptor wasn't open
+        dup2(source[i], target[i]);
+    }
+
+    exit = func(cmd->argv);
+    fflush(stdout);
+
+    // Undo the redirections in reverse order, so a descriptor redirected twice ends up as it was
+    for (int i = num_fds - 1; i >= 0; i--) {
+        if (source[i] < 0) continue;
+
+        if (saved[i] >= 0) {
+            dup2(saved[i], target[i]);
+            close(saved[i]);
+        } else close(target[i]);
+    }
+    kush_redir_close(cmd);
+
+    return exit;
+}
+
+// Makes sure pipe_status has room for num entries
+void kush_pipe_status_reserve(int num) {
+    static int size = 0;
+
+    if (num <= size) return;
+    pipe_status = realloc(pipe_status, num * sizeof(int)); // NOLINT(bugprone-suspicious-realloc-usage)
+    if (!pipe_status) {
+        fprintf(stderr, "kush: Pipe status allocation error");
+        exit(EXIT_FAILURE);
+    }
+    size = num;
+}
+
+// Job control
+// -----------------------------------------------------------------------------------------
+// Every pipeline started by the shell is a job. With job control (interactive shells) every job gets a process
+// group of its own, which is handed the terminal while the job runs in the foreground. Background jobs are
+// reaped as soon as they exit: a pidfd for every process of the job is registered with an epoll instance, so
+// finding the processes that have exited never needs a waitpid() for every single job.
+
+// States of a process of a job
+enum kush_proc_state {
+    KUSH_PROC_RUNNING,
+    KUSH_PROC_STOPPED,
+    KUSH_PROC_DONE
+};
+
+// A process belonging to a job
+typedef struct kush_proc {
+    pid_t pid; // -1 if the process couldn't be launched
+    int pidfd; // pidfd registered with the epoll instance, -1 if the process isn't watched
+    int status; // Exit status once the process is done
+    enum kush_proc_state state;
+    int node; // Node the process is counted on by the CPU placement, -1 if none
+    struct kush_job *job; // Job the process belongs to
+} kush_proc;
+
+// A pipeline started by the shell
+typedef struct kush_job {
+    int id; // Number of the job, 0 for a foreground job that isn't in the job table
+    pid_t pgid; // Process group of the job, -1 without job control
+    char *text; // Command line of the job, only set for jobs in the job table
+    kush_proc *procs;
+    int num_procs;
+    int num_done; // Number of processes that are done
+    int background; // Boolean value telling if the job runs in the background
+    int notified; // Boolean value telling if the user has been told about the state of the job
+    int slot; // Boolean value telling if the job holds a slot of the job scheduler until it is done
+    struct kush_sched_entry *queued; // Set while the job waits for a slot, see the job scheduler
+} kush_job;
+
+int job_control = 0; // Boolean value telling if job control is enabled
+pid_t shell_pgid = 0; // Process group of the shell
+struct termios shell_tmodes; // Terminal modes of the shell, restored after a foreground job
+kush_job **job_table = NULL; // Jobs that have been put into the background, indexed by job id - 1
+int job_table_size = 0; // Number of slots in job_table
+int max_job_id = 0; // Highest job id in use
+int num_unwatched = 0; // Number of running background processes without a pidfd
+int num_slot_jobs = 0; // Number of background jobs holding a slot of the job scheduler
+int current_job = 0; // Id of the job fg and bg act on by default
+
+// The job scheduler, defined after the job control. It holds back background jobs beyond the number of slots and
+// starts them from the event loop as slots free up.
+int kush_sched_defer(kush_job *job, kush_command *stages, int num_stages);
+void kush_sched_start(kush_job *job);
+int kush_sched_run();
+
+// Prepares job control. Puts the shell into its own process group, takes the terminal and ignores the signals
+// used for job control, which are meant for the foreground job.
+void kush_jobs_init() {
+    if (!interactive) return;
+    job_control = 1;
+
+    // If we have been started in the background, wait until we are put into the foreground
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN);
+
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    setpgid(shell_pgid, shell_pgid); // Fails if we already are a session leader, which is fine
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+}
+
+// Builds the command line of a job from its stages
+char *kush_job_text(kush_command *stages, int num_stages) {
+    size_t len = 0;
+    char *text;
+
+    for (int i = 0; i < num_stages; i++) {
+        for (int j = 0; stages[i].argv[j] != NULL; j++) len += strlen(stages[i].argv[j]) + 1;
+        for (int j = 0; j < stages[i].num_redirs; j++) {
+            len += 6 + (stages[i].redirs[j].target ? strlen(stages[i].redirs[j].target) + 1 : 0);
+        }
+        len += 2;
+    }
+
+    text = malloc(len + 1);
+    if (!text) {
+        fprintf(stderr, "kush: Job allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    len = 0;
+    for (int i = 0; i < num_stages; i++) {
+        if (i > 0) len += sprintf(text + len, "| ");
+        for (int j = 0; stages[i].argv[j] != NULL; j++) len += sprintf(text + len, "%s ", stages[i].argv[j]);
+        for (int j = 0; j < stages[i].num_redirs; j++) {
+            kush_redir *redir = &stages[i].redirs[j];
+
+            len += sprintf(text + len, "%s ", kush_ops[redir->op]);
+            if (redir->target) len += sprintf(text + len, "%s ", redir->target);
+        }
+    }
+    if (len > 0) len--; // Drop the trailing space
+    text[len] = '\0';
+
+    return text;
+}
+
+// Marks a process as done with the given exit status and stops watching it
+void kush_proc_done(kush_proc *proc, int status) {
+    if (proc->state == KUSH_PROC_DONE) return;
+
+    if (proc->pidfd >= 0) {
+        epoll_ctl(event_epoll, EPOLL_CTL_DEL, proc->pidfd, NULL);
+        close(proc->pidfd);
+        proc->pidfd = -1;
+    } else if (proc->job->background) num_unwatched--;
+
+    proc->state = KUSH_PROC_DONE;
+    proc->status = status;
+    proc->job->num_done++;
+    kush_place_release(proc->node);
+    proc->node = -1;
+    if (proc->job->slot && proc->job->num_done == proc->job->num_procs) { // Frees the slot for a queued job
+        proc->job->slot = 0;
+        num_slot_jobs--;
+    }
+}
+
+// Registers the pidfds of all running processes of a background job with the epoll instance. If no pidfd can be
+// opened (for example because we ran out of descriptors), the process is polled with waitpid() instead.
+void kush_job_watch(kush_job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        kush_proc *proc = &job->procs[i];
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = proc};
+
+        if (proc->state == KUSH_PROC_DONE || proc->pidfd >= 0) continue;
+
+        proc->pidfd = pidfd_open(proc->pid, 0);
+        if (proc->pidfd >= 0) fcntl(proc->pidfd, F_SETFD, FD_CLOEXEC);
+        if (proc->pidfd < 0 || epoll_ctl(event_epoll, EPOLL_CTL_ADD, proc->pidfd, &event) != 0) {
+            if (proc->pidfd >= 0) close(proc->pidfd);
+            proc->pidfd = -1;
+            num_unwatched++;
+        }
+    }
+}
+
+// Moves a foreground job, which lives in the line arena, into the job table on the heap and returns it.
+kush_job *kush_job_persist(kush_job *job, kush_command *stages, int num_stages) {
+    kush_job *copy = malloc(sizeof(kush_job));
+    kush_proc *procs = malloc(job->num_procs * sizeof(kush_proc));
+
+    if (!copy || !procs) {
+        fprintf(stderr, "kush: Job allocation error");
+        exit(EXIT_FAILURE);
+    }
+    *copy = *job;
+    memcpy(procs, job->procs, job->num_procs * sizeof(kush_proc));
+    copy->procs = procs;
+    for (int i = 0; i < copy->num_procs; i++) procs[i].job = copy;
+    copy->text = kush_job_text(stages, num_stages);
+
+    // Job ids count up from the highest one in use, like in other shells
+    copy->id = ++max_job_id;
+    if (max_job_id > job_table_size) {
+        job_table_size = job_table_size ? job_table_size * 2 : 16;
+        // NOLINTNEXTLINE(bugprone-suspicious-realloc-usage)
+        job_table = realloc(job_table, job_table_size * sizeof(kush_job *));
+        if (!job_table) {
+            fprintf(stderr, "kush: Job allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    job_table[copy->id - 1] = copy;
+    current_job = copy->id;
+
+    return copy;
+}
+
+// Removes a job from the job table and frees it
+void kush_job_free(kush_job *job) {
+    job_table[job->id - 1] = NULL;
+    while (max_job_id > 0 && job_table[max_job_id - 1] == NULL) max_job_id--;
+    if (current_job == job->id) current_job = max_job_id;
+
+    free(job->text);
+    free(job->procs);
+    free(job);
+}
+
+// Returns true if all processes of a job that aren't done are stopped
+int kush_job_stopped(kush_job *job) {
+    int stopped = 0;
+
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == KUSH_PROC_RUNNING) return 0;
+        if (job->procs[i].state == KUSH_PROC_STOPPED) stopped = 1;
+    }
+
+    return stopped;
+}
+
+// Returns the exit status of a job: that of its last process, or with the pipefail option that of the last one
+// that failed. Also stores the status of every process in pipe_status.
+int kush_job_status(kush_job *job) {
+    int status = 0;
+
+    kush_pipe_status_reserve(job->num_procs);
+    for (int i = 0; i < job->num_procs; i++) pipe_status[i] = job->procs[i].status;
+    status = pipe_status[job->num_procs - 1];
+    for (int i = job->num_procs - 1; opt_pipefail && i >= 0; i--) { // The rightmost stage that failed
+        if (pipe_status[i] != 0) {
+            status = pipe_status[i];
+            break;
+        }
+    }
+    pipe_num_status = job->num_procs > 1 ? job->num_procs : 0;
+
+    return status;
+}
+
+// Returns the process of a background job with the given pid or NULL if there is none
+kush_proc *kush_jobs_find_pid(pid_t pid) {
+    for (int i = 0; i < max_job_id; i++) {
+        if (!job_table[i]) continue;
+        for (int j = 0; j < job_table[i]->num_procs; j++) {
+            if (job_table[i]->procs[j].pid == pid) return &job_table[i]->procs[j];
+        }
+    }
+
+    return NULL;
+}
+
+// Looks for background processes that have been stopped (e.g. by reading from the terminal). Only stopped children
+// are reported here, so this costs one call per stopped process, not one per job.
+void kush_jobs_check_stopped() {
+    siginfo_t info;
+
+    child_changed = 0;
+    while (waitid(P_ALL, 0, &info, WSTOPPED | WNOHANG) == 0 && info.si_pid != 0) {
+        kush_proc *proc = kush_jobs_find_pid(info.si_pid);
+
+        if (proc && proc->state == KUSH_PROC_RUNNING) {
+            proc->state = KUSH_PROC_STOPPED;
+            proc->job->notified = 0;
+        }
+    }
+}
+
+// The event loop of the shell, declared with the signal handling. Reaps background processes that have exited,
+// reads pending signals and notes if stdin has input.
+int kush_event_wait(int timeout) {
+    struct epoll_event events[64];
+    siginfo_t info;
+    int num_events;
+    int interrupted = 0;
+    int retry = kush_sched_run(); // Milliseconds until a throttled job scheduler wants to check the load again
+
+    // Processes without a pidfd have to be asked one by one
+    for (int i = 0; num_unwatched > 0 && i < max_job_id; i++) {
+        for (int j = 0; job_table[i] && j < job_table[i]->num_procs; j++) {
+            kush_proc *proc = &job_table[i]->procs[j];
+            int status;
+
+            if (proc->state == KUSH_PROC_DONE || proc->pidfd >= 0) continue;
+            if (waitpid(proc->pid, &status, WNOHANG) == proc->pid) kush_proc_done(proc, kush_status_code(status));
+        }
+    }
+    if (num_unwatched > 0 && timeout != 0) timeout = timeout < 0 || timeout > 10 ? 10 : timeout;
+    if (retry >= 0 && timeout != 0) timeout = timeout < 0 || timeout > retry ? retry : timeout;
+
+    num_events = epoll_wait(event_epoll, events, sizeof(events) / sizeof(events[0]), timeout);
+    if (num_events < 0) return 0; // EINTR, which only happens on SIGSTOP and SIGCONT as nothing has a handler
+
+    for (int i = 0; i < num_events; i++) {
+        kush_proc *proc = events[i].data.ptr;
+
+        if (events[i].data.ptr == &signal_fd) {
+            if (kush_signals_read()) interrupted = 1;
+            continue;
+        }
+        if (events[i].data.ptr == &stdin_ready) {
+            stdin_ready = 1;
+            continue;
+        }
+
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PIDFD, proc->pidfd, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0) continue;
+        kush_proc_done(proc, info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status);
+    }
+    if (job_control && child_changed && max_job_id > 0) kush_jobs_check_stopped();
+    kush_sched_run(); // Slots of the jobs that are done can be used right away
+
+    return interrupted ? -1 : num_events;
+}
+
+// Prints the state of a job in the format of the jobs built-in
+void kush_job_print(kush_job *job) {
+    const char *state = "Running";
+
+    if (job->queued) state = "Queued";
+    else if (job->num_done == job->num_procs) state = "Done";
+    else if (kush_job_stopped(job)) state = "Stopped";
+
+    printf("[%d]%c  %-22s %s\n", job->id, job->id == current_job ? '+' : ' ', state, job->text);
+}
+
+// Tells the user about background jobs that have finished or been stopped since the last prompt and drops the
+// finished ones from the job table. Only interactive shells report anything.
+void kush_jobs_notify() {
+    if (max_job_id == 0) return;
+
+    kush_event_wait(0);
+    for (int i = 0; i < max_job_id; i++) {
+        kush_job *job = job_table[i];
+
+        if (!job) continue;
+        if (job->num_done == job->num_procs) {
+            if (interactive) kush_job_print(job);
+            kush_job_free(job);
+        } else if (!job->notified && kush_job_stopped(job)) {
+            if (interactive) kush_job_print(job);
+            job->notified = 1;
+        }
+    }
+}
+
+// Waits for a job in the foreground until all its processes are done or it is stopped. With job control, the job
+// gets the terminal for that time. A stopped job is moved into the job table.
+void kush_job_wait_fg(kush_job *job, kush_command *stages, int num_stages) {
+    int status;
+
+    if (job_control) tcsetpgrp(STDIN_FILENO, job->pgid);
+
+    for (int i = 0; i < job->num_procs; i++) {
+        kush_proc *proc = &job->procs[i];
+
+        if (proc->state == KUSH_PROC_DONE) continue;
+        if (waitpid(proc->pid, &status, WUNTRACED) != proc->pid) {
+            if (errno == EINTR) i--; // Try again
+            else kush_proc_done(proc, 127);
+            continue;
+        }
+
+        if (WIFSTOPPED(status)) { // The whole job is stopped, so stop waiting
+            for (int j = i; j < job->num_procs; j++) {
+                if (job->procs[j].state == KUSH_PROC_RUNNING) job->procs[j].state = KUSH_PROC_STOPPED;
+            }
+            break;
+        }
+        kush_proc_done(proc, kush_status_code(status));
+    }
+
+    if (job_control) { // Take the terminal back, with the modes the shell had
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+        // The job got the SIGINT instead of us, so end the line the terminal echoed '^C' on
+        if (job->procs[job->num_procs - 1].status == 128 + SIGINT) putchar('\n');
+    }
+
+    if (job->num_done < job->num_procs) { // Stopped
+        job->background = 1;
+        if (job->id == 0) job = kush_job_persist(job, stages, num_stages);
+        kush_job_watch(job);
+        job->notified = 1;
+        putchar('\n');
+        kush_job_print(job);
+        last_status = 128 + SIGTSTP;
+        pipe_num_status = 0;
+        return;
+    }
+
+    last_status = kush_job_status(job);
+    if (job->id != 0) kush_job_free(job);
+}
+
+// Returns true if stage i of a pipeline can run inside the shell. That's the case for built-ins with the
+// KUSH_BUILTIN_INPROC flag in a foreground job, as long as the stage after them is a program: it is started before
+// the built-in runs, so it is always there to read what the built-in writes.
+int kush_stage_inproc(kush_command *stages, int num_stages, int i, int background) {
+    int builtin = stages[i].argv[0] ? kush_find_builtin(stages[i].argv[0]) : -1;
+
+    if (background || builtin < 0 || !(builtins[builtin].flags & KUSH_BUILTIN_INPROC)) return 0;
+    if (kush_function_find(stages[i].argv[0])) return 0; // Functions run in a child, and may shadow a built-in
+    return i == num_stages - 1 || !stages[i + 1].argv[0] || !kush_find_inshell(stages[i + 1].argv[0]);
+}
+
+// Starts the processes of a job for its num_stages commands, connecting the stdout of every stage to the stdin of
+// the next one. Redirections of a stage are applied after its pipes. All stages are started before waiting for any
+// of them, so they run concurrently. Stages that can run inside the shell are run once all others have been started.
+void kush_job_start(kush_job *job, kush_command *stages, int num_stages, int background) {
+    int prev_read = -1; // Read end of the pipe coming from the previous stage
+    int *inproc_fds = kush_arena_alloc(&line_arena, 2 * num_stages * sizeof(int)); // stdin and stdout of a stage
+
+    kush_place_job();
+    fflush(stdout); // Otherwise built-ins running in a child would write our buffered output again
+
+    for (int i = 0; i < num_stages; i++) {
+        kush_launch launch = {.cmd = &stages[i], .flags = 0, .stdin_fd = prev_read, .stdout_fd = -1,
+                              .pgid = job->pgid, .foreground = job_control && !background && job->pgid == 0};
+        kush_proc *proc = &job->procs[i];
+        int pipefd[2] = {-1, -1};
+        kush_builtin_func builtin = stages[i].argv[0] ? kush_find_inshell(stages[i].argv[0]) : NULL;
+
+        if (i < num_stages - 1) {
+            // All pipe descriptors are close-on-exec, so every stage only keeps the ends it gets as stdin and stdout
+            if (pipe2(pipefd, O_CLOEXEC) != 0) {
+                perror("kush: Error creating a pipe");
+                pipefd[0] = pipefd[1] = -1;
+            }
+            // Programs can move a lot of data through a pipe, so they get a larger buffer to cut down on context
+            // switches. If the system doesn't allow a pipe that large, the default size is kept.
+            if (!builtin && pipefd[1] >= 0) fcntl(pipefd[1], F_SETPIPE_SZ, KUSH_PIPE_SIZE);
+        }
+        launch.stdout_fd = pipefd[1];
+
+        if (builtin) { // Built-ins and functions started as a job run in a child process of their own, like programs
+            launch.builtin = builtin;
+            launch.flags |= KUSH_LAUNCH_FORK;
+        }
+
+        proc->pid = -1;
+        proc->pidfd = -1;
+        proc->node = -1;
+        proc->job = job;
+        proc->state = KUSH_PROC_RUNNING;
+        inproc_fds[2 * i] = inproc_fds[2 * i + 1] = -1;
+        if (kush_stage_inproc(stages, num_stages, i, background)) {
+            // Keeps its pipe ends until it has run
+            inproc_fds[2 * i] = prev_read;
+            inproc_fds[2 * i + 1] = pipefd[1];
+            prev_read = pipefd[0];
+            continue;
+        }
+        if (kush_redir_open(&stages[i]) != 0) kush_proc_done(proc, 1);
+        else if (stages[i].argv[0] == NULL) kush_proc_done(proc, 0); // Nothing to run, only redirections
+        else {
+            proc->pid = kush_spawn(&launch);
+            proc->node = launch.node;
+            if (proc->pid < 0) kush_proc_done(proc, 127);
+            // All processes of the job join the group of the first one. Setting it here too avoids a race with
+            // the child, like other shells do.
+            else if (job->pgid >= 0) {
+                if (job->pgid == 0) job->pgid = proc->pid;
+                setpgid(proc->pid, job->pgid);
+            }
+        }
+        kush_redir_close(&stages[i]);
+
+        // The stages have their own copies of the pipe ends now
+        if (prev_read >= 0) close(prev_read);
+        if (pipefd[1] >= 0) close(pipefd[1]);
+        prev_read = pipefd[0];
+    }
+
+    for (int i = 0; i < num_stages; i++) {
+        if (job->procs[i].state == KUSH_PROC_DONE || job->procs[i].pid >= 0) continue;
+
+        kush_run_builtin(kush_find_inshell(stages[i].argv[0]), &stages[i], inproc_fds[2 * i], inproc_fds[2 * i + 1]);
+        if (inproc_fds[2 * i] >= 0) close(inproc_fds[2 * i]);
+        if (inproc_fds[2 * i + 1] >= 0) close(inproc_fds[2 * i + 1]);
+        kush_proc_done(&job->procs[i], last_status);
+    }
+}
+
+// Launches a pipeline of num_stages commands as a job. Foreground jobs are waited for, background jobs are put into
+// the job table. A background job that finds all slots of the job scheduler taken is queued instead.
+void kush_launch_job(kush_command *stages, int num_stages, int background) {
+    kush_job *job = kush_arena_alloc(&line_arena, sizeof(kush_job));
+
+    job->id = 0;
+    job->pgid = job_control ? 0 : -1;
+    job->text = NULL;
+    job->procs = kush_arena_alloc(&line_arena, num_stages * sizeof(kush_proc));
+    job->num_procs = num_stages;
+    job->num_done = 0;
+    job->background = background;
+    job->notified = 0;
+    job->slot = background;
+    job->queued = NULL;
+
+    if (background && kush_sched_defer(job, stages, num_stages)) return;
+    if (background) num_slot_jobs++;
+    kush_job_start(job, stages, num_stages, background);
+
+    if (!background) {
+        kush_job_wait_fg(job, stages, num_stages);
+        return;
+    }
+
+    job = kush_job_persist(job, stages, num_stages);
+    kush_job_watch(job);
+    if (interactive) printf("[%d] %d\n", job->id, job->procs[job->num_procs - 1].pid);
+    last_status = 0;
+    pipe_num_status = 0;
+}
+
+// Returns the job a job spec like '%2' (or just '2') refers to. Without a spec the current job is returned.
+// Prints an error and returns NULL if there is no such job.
+kush_job *kush_job_from_spec(const char *builtin, const char *spec) {
+    int id = current_job;
+
+    if (spec) id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    if (id <= 0 || id > max_job_id || !job_table[id - 1]) {
+        fprintf(stderr, "kush: %s: %s: no such job\n", builtin, spec ? spec : "current");
+        last_status = 1;
+        return NULL;
+    }
+
+    return job_table[id - 1];
+}
+
+// Lets all stopped processes of a job continue
+void kush_job_continue(kush_job *job) {
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].state == KUSH_PROC_STOPPED) job->procs[i].state = KUSH_PROC_RUNNING;
+    }
+    job->notified = 0;
+
+    if (job->pgid > 0) killpg(job->pgid, SIGCONT);
+    else {
+        for (int i = 0; i < job->num_procs; i++) {
+            if (job->procs[i].state != KUSH_PROC_DONE) kill(job->procs[i].pid, SIGCONT);
+        }
+    }
+}
+
+// With -l the processes of every job are listed too, with the CPUs they may run on and the one they ran on last
+int kush_jobs(char **args) {
+    int procs = args[1] != NULL && strcmp(args[1], "-l") == 0;
+
+    kush_event_wait(0);
+    for (int i = 0; i < max_job_id; i++) {
+        kush_job *job = job_table[i];
+
+        if (!job) continue;
+        kush_job_print(job);
+        for (int j = 0; procs && j < job->num_procs; j++) {
+            if (job->procs[j].pid < 0 || job->procs[j].state == KUSH_PROC_DONE) continue;
+            printf("      %d  ", job->procs[j].pid);
+            kush_place_print(job->procs[j].pid);
+            putchar('\n');
+        }
+    }
+
+    return 0;
+}
+
+int kush_fg(char **args) {
+    kush_job *job;
+
+    if (!job_control) {
+        fprintf(stderr, "kush: fg: no job control\n");
+        last_status = 1;
+        return 0;
+    }
+    job = kush_job_from_spec("fg", args[1]);
+    if (!job) return 0;
+    if (job->queued) kush_sched_start(job); // Doesn't wait for a slot anymore
+
+    puts(job->text);
+    fflush(stdout);
+
+    // The job is waited for in the foreground now, so its processes are reaped by kush_job_wait_fg()
+    for (int i = 0; i < job->num_procs; i++) {
+        if (job->procs[i].pidfd >= 0) {
+            epoll_ctl(event_epoll, EPOLL_CTL_DEL, job->procs[i].pidfd, NULL);
+            close(job->procs[i].pidfd);
+            job->procs[i].pidfd = -1;
+        } else if (job->procs[i].state != KUSH_PROC_DONE) num_unwatched--;
+    }
+    job->background = 0;
+
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+    kush_job_continue(job);
+    kush_job_wait_fg(job, NULL, 0);
+
+    return 0;
+}
+
+int kush_bg(char **args) {
+    kush_job *job;
+
+    if (!job_control) {
+        fprintf(stderr, "kush: bg: no job control\n");
+        last_status = 1;
+        return 0;
+    }
+    job = kush_job_from_spec("bg", args[1]);
+    if (!job) return 0;
+    if (job->queued) kush_sched_start(job);
+
+    kush_job_continue(job);
+    printf("[%d]+ %s &\n", job->id, job->text);
+
+    return 0;
+}
+
+int kush_wait(char **args) {
+    kush_job *job = NULL;
+
+    if (args[1] != NULL) { // Wait for a single job, given by job spec or pid
+        if (args[1][0] == '%') job = kush_job_from_spec("wait", args[1]);
+        else {
+            kush_proc *proc = kush_jobs_find_pid(atoi(args[1]));
+
+            if (!proc) {
+                fprintf(stderr, "kush: wait: pid %s is not a child of this shell\n", args[1]);
+                last_status = 127;
+                return 0;
+            }
+            job = proc->job;
+        }
+        if (!job) return 0;
+    }
+
+    // Stopped jobs would never finish, so they aren't waited for
+    while (1) {
+        int running = 0;
+
+        if (job) running = job->num_done < job->num_procs && !kush_job_stopped(job);
+        for (int i = 0; !job && i < max_job_id; i++) {
+            if (job_table[i] && job_table[i]->num_done < job_table[i]->num_procs && !kush_job_stopped(job_table[i])) {
+                running = 1;
+            }
+        }
+        if (!running) break;
+        if (kush_event_wait(-1) < 0) { // Interrupted, which only ends the wait
+            putchar('\n');
+            last_status = 128 + SIGINT;
+            return 0;
+        }
+    }
+
+    if (job && job->num_done == job->num_procs) {
+        last_status = kush_job_status(job);
+        pipe_num_status = 0;
+    }
+
+    return 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// Job scheduler
+// -----------------------------------------------------------------------------------------
+// Background jobs start right away unless KUSH_JOB_SLOTS limits how many of them may run at once. The jobs beyond
+// that limit wait in a queue, already in the job table, and the event loop starts them as running jobs finish. With
+// KUSH_JOB_LOAD (runnable tasks per CPU) or KUSH_JOB_PSI (percentage of time some task stalls on CPU, memory or I/O)
+// set, the number of slots in use adapts to the load of the machine. Every check that finds the machine above one
+// of those limits halves the slots jobs may use, and every check that doesn't gives one of them back. The load is
+// checked at most every KUSH_SCHED_CHECK_NS and only while jobs are waiting. One job may always run, so the queue
+// keeps moving however loaded the machine is.
+
+// Time between two checks of the load, long enough for the pressure totals to move
+#define KUSH_SCHED_CHECK_NS 250000000L
+// Number of resources in kush_sched_psi
+#define KUSH_SCHED_NUM_PSI 3
+
+// Resources whose pressure stall information is checked
+const char *kush_sched_psi[KUSH_SCHED_NUM_PSI] = {"cpu", "memory", "io"};
+
+// A background job waiting for a slot. The line it comes from is gone by the time it starts, so the entry holds
+// copies of its stages in the same allocation.
+typedef struct kush_sched_entry {
+    kush_job *job;
+    kush_command *stages; // Their assignments start with the exported variables the job was queued with
+    int num_stages;
+    char *dir; // Working directory the job was queued in, NULL if it couldn't be determined
+    long queued_ns; // CLOCK_MONOTONIC time the job was queued at
+    struct kush_sched_entry *next;
+} kush_sched_entry;
+
+kush_sched_entry *sched_head = NULL; // Queue of the jobs waiting for a slot, the oldest first
+kush_sched_entry *sched_tail = NULL;
+
+// State and statistics of the job scheduler
+struct {
+    int limit; // Slots jobs may use at the moment, lowered while the machine is overloaded
+    int adaptive; // Boolean value telling if the limit follows the load
+    long checked_ns; // Time of the last check of the load, 0 before the first
+    double load; // Runnable tasks per CPU at the last check
+    unsigned long long psi_total[KUSH_SCHED_NUM_PSI]; // Microseconds some task stalled on the resource, in total
+    double psi[KUSH_SCHED_NUM_PSI]; // Percentage of the time between the last two checks some task stalled
+    unsigned long num_checks;
+    unsigned long num_throttled; // Checks that found the machine overloaded
+    int depth; // Jobs in the queue
+    int peak_depth;
+    unsigned long num_queued; // Jobs that had to wait for a slot
+    unsigned long num_waited; // Jobs started from the queue
+    long wait_ns; // Time the jobs started from the queue have waited, in total
+    long max_wait_ns;
+} job_sched = {0};
+
+// Returns the CLOCK_MONOTONIC time in nanoseconds
+long kush_sched_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Returns the number of slots for background jobs, which is the value of KUSH_JOB_SLOTS. 0 means there is no limit.
+int kush_sched_slots() {
+    const char *value = kush_var_get("KUSH_JOB_SLOTS");
+    long num = value ? strtol(value, NULL, 10) : 0;
+
+    if (num < 0) return 0;
+    return num > INT_MAX ? INT_MAX : (int) num;
+}
+
+// Returns the limit the variable name sets for the load, or -1 if it isn't set to a number
+double kush_sched_threshold(const char *name) {
+    const char *value = kush_var_get(name);
+    char *end;
+    double num;
+
+    if (!value || !*value) return -1;
+    num = strtod(value, &end);
+    return *end == '\0' && num >= 0 ? num : -1;
+}
+
+// Reads a file from /proc into the size bytes at buff and null terminates it. Returns false if it can't be read.
+int kush_sched_read(const char *path, char *buff, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t len = fd >= 0 ? read(fd, buff, size - 1) : -1;
+
+    if (fd >= 0) close(fd);
+    if (len < 0) return 0;
+    buff[len] = '\0';
+
+    return 1;
+}
+
+// Measures the load of the machine at time now. The load is the number of runnable tasks per CPU, without the shell
+// itself, taken from /proc/loadavg rather than its averages, which lag a minute behind the jobs we start. The
+// pressure on a resource is the share of the time since the last check some task stalled on it, from the totals in
+// /proc/pressure. Without a recent check to compare with, it is the average of the last 10 seconds the kernel keeps.
+// Values that can't be read count as 0.
+void kush_sched_measure(long now) {
+    char buff[256];
+    char path[32];
+    unsigned runnable;
+    int recent = job_sched.checked_ns > 0 && now - job_sched.checked_ns < 10000000000L;
+
+    job_sched.load = 0;
+    if (kush_sched_read("/proc/loadavg", buff, sizeof(buff)) && sscanf(buff, "%*s %*s %*s %u", &runnable) == 1) {
+        job_sched.load = runnable > 1 ? (double) (runnable - 1) / (double) sysconf(_SC_NPROCESSORS_ONLN) : 0;
+    }
+
+    for (int i = 0; i < KUSH_SCHED_NUM_PSI; i++) {
+        double avg10;
+        unsigned long long total;
+
+        sprintf(path, "/proc/pressure/%s", kush_sched_psi[i]);
+        if (!kush_sched_read(path, buff, sizeof(buff))
+            || sscanf(buff, "some avg10=%lf %*s %*s total=%llu", &avg10, &total) != 2) {
+            job_sched.psi[i] = 0;
+            continue;
+        }
+        if (recent && total >= job_sched.psi_total[i]) { // Microseconds of stall per nanosecond, in percent
+            job_sched.psi[i] = (double) (total - job_sched.psi_total[i]) * 1e5 / (double) (now - job_sched.checked_ns);
+            if (job_sched.psi[i] > 100) job_sched.psi[i] = 100;
+        } else job_sched.psi[i] = avg10;
+        job_sched.psi_total[i] = total;
+    }
+}
+
+// Adapts the number of slots jobs may use to the load of the machine, if KUSH_JOB_LOAD or KUSH_JOB_PSI ask for it.
+// Otherwise all slots may be used.
+void kush_sched_adapt(int slots) {
+    double max_load = kush_sched_threshold("KUSH_JOB_LOAD");
+    double max_psi = kush_sched_threshold("KUSH_JOB_PSI");
+    long now;
+    int overloaded;
+
+    job_sched.adaptive = max_load >= 0 || max_psi >= 0;
+    if (!job_sched.adaptive || job_sched.limit <= 0 || job_sched.limit > slots) job_sched.limit = slots;
+    if (!job_sched.adaptive) return;
+
+    now = kush_sched_now();
+    if (job_sched.checked_ns > 0 && now - job_sched.checked_ns < KUSH_SCHED_CHECK_NS) return;
+    kush_sched_measure(now);
+    job_sched.checked_ns = now;
+    job_sched.num_checks++;
+
+    overloaded = max_load >= 0 && job_sched.load > max_load;
+    for (int i = 0; i < KUSH_SCHED_NUM_PSI; i++) overloaded |= max_psi >= 0 && job_sched.psi[i] > max_psi;
+    if (overloaded) { // Halves the slots that are actually in use, not the limit nobody has reached
+        int in_use = num_slot_jobs < job_sched.limit ? num_slot_jobs : job_sched.limit;
+
+        job_sched.limit = in_use > 2 ? in_use / 2 : 1;
+        job_sched.num_throttled++;
+    } else if (job_sched.limit < slots) job_sched.limit++;
+}
+
+// Returns true if another background job may start now, with slots being the number of slots
+int kush_sched_admit(int slots) {
+    if (slots <= 0 || num_slot_jobs == 0) return 1;
+    kush_sched_adapt(slots);
+    return num_slot_jobs < job_sched.limit;
+}
+
+// Copies str to *pos, advances *pos past the copy and returns the copy
+char *kush_sched_strcpy(char **pos, const char *str) {
+    char *copy = *pos;
+
+    *pos = stpcpy(copy, str) + 1;
+    return copy;
+}
+
+// Returns a queue entry with copies of the num_stages stages of a job, which start in the current working directory
+// and with the current environment when they run. The exported variables are added to the assignments of every
+// stage, unless the stage assigns the same variable itself.
+kush_sched_entry *kush_sched_entry_new(kush_command *stages, int num_stages) {
+    char dir[PATH_MAX];
+    int has_dir = getcwd(dir, sizeof(dir)) != NULL;
+    size_t num_env = 0;
+    size_t num_ptrs;
+    size_t num_redirs = 0;
+    size_t chars = has_dir ? strlen(dir) + 1 : 0;
+    kush_sched_entry *entry;
+    char **env; // Copies of the exported variables
+    char **ptrs;
+    kush_redir *redirs;
+    char *str;
+
+    kush_env_update();
+    for (; environ[num_env] != NULL; num_env++) chars += strlen(environ[num_env]) + 1;
+    num_ptrs = num_env;
+    for (int i = 0; i < num_stages; i++) {
+        num_ptrs += num_env + stages[i].num_assigns + 1;
+        for (int j = 0; j < stages[i].num_assigns; j++) chars += strlen(stages[i].assigns[j]) + 1;
+        for (int j = 0; stages[i].argv[j] != NULL; j++, num_ptrs++) chars += strlen(stages[i].argv[j]) + 1;
+        for (int j = 0; j < stages[i].num_redirs; j++) {
+            if (stages[i].redirs[j].target) chars += strlen(stages[i].redirs[j].target) + 1;
+        }
+        num_redirs += stages[i].num_redirs;
+    }
+
+    entry = malloc(sizeof(kush_sched_entry) + num_stages * sizeof(kush_command) + num_ptrs * sizeof(char *)
+                   + num_redirs * sizeof(kush_redir) + chars);
+    if (!entry) {
+        fprintf(stderr, "kush: Job allocation error");
+        exit(EXIT_FAILURE);
+    }
+    entry->stages = (kush_command *) (entry + 1);
+    entry->num_stages = num_stages;
+    env = (char **) (entry->stages + num_stages);
+    ptrs = env + num_env;
+    redirs = (kush_redir *) (env + num_ptrs);
+    str = (char *) (redirs + num_redirs);
+    entry->dir = has_dir ? kush_sched_strcpy(&str, dir) : NULL;
+    for (size_t i = 0; i < num_env; i++) env[i] = kush_sched_strcpy(&str, environ[i]);
+
+    for (int i = 0; i < num_stages; i++) {
+        kush_command *cmd = &entry->stages[i];
+
+        // The arguments follow the assignments, like kush_parse_command() leaves them
+        cmd->assigns = ptrs;
+        cmd->num_assigns = 0;
+        for (size_t j = 0; j < num_env; j++) {
+            size_t name_len = strchrnul(env[j], '=') - env[j] + 1; // Including the '='
+            int replaced = 0;
+
+            for (int k = 0; k < stages[i].num_assigns && !replaced; k++) {
+                replaced = strncmp(env[j], stages[i].assigns[k], name_len) == 0;
+            }
+            if (!replaced) cmd->assigns[cmd->num_assigns++] = env[j];
+        }
+        for (int j = 0; j < stages[i].num_assigns; j++) {
+            cmd->assigns[cmd->num_assigns++] = kush_sched_strcpy(&str, stages[i].assigns[j]);
+        }
+        cmd->argv = cmd->assigns + cmd->num_assigns;
+        for (ptrs = cmd->argv; stages[i].argv[ptrs - cmd->argv] != NULL; ptrs++) {
+            *ptrs = kush_sched_strcpy(&str, stages[i].argv[ptrs - cmd->argv]);
+        }
+        *ptrs++ = NULL;
+
+        cmd->redirs = redirs;
+        cmd->num_redirs = stages[i].num_redirs;
+        for (int j = 0; j < cmd->num_redirs; j++) {
+            cmd->redirs[j].op = stages[i].redirs[j].op;
+            cmd->redirs[j].target = stages[i].redirs[j].target ? kush_sched_strcpy(&str, stages[i].redirs[j].target)
+                                                                : NULL;
+            cmd->redirs[j].source_fd = -1;
+        }
+        redirs += cmd->num_redirs;
+    }
+
+    return entry;
+}
+
+// Starts a job from the queue, even if there is no free slot for it. The shell changes into the working directory
+// the job was queued in for the launch, so relative redirections are opened there too, and changes back right after.
+void kush_sched_start(kush_job *job) {
+    kush_sched_entry *entry = job->queued;
+    kush_sched_entry *prev = NULL;
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+    char cwd[PATH_MAX];
+    int back = -1; // Working directory of the shell while it is in that of the job
+    long waited = kush_sched_now() - entry->queued_ns;
+
+    for (kush_sched_entry *cur = sched_head; cur != entry; cur = cur->next) prev = cur;
+    if (prev) prev->next = entry->next;
+    else sched_head = entry->next;
+    if (sched_tail == entry) sched_tail = prev;
+
+    job_sched.depth--;
+    job_sched.num_waited++;
+    job_sched.wait_ns += waited;
+    if (waited > job_sched.max_wait_ns) job_sched.max_wait_ns = waited;
+
+    job->queued = NULL;
+    if (entry->dir && (!getcwd(cwd, sizeof(cwd)) || strcmp(cwd, entry->dir) != 0)) {
+        back = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (back < 0 || chdir(entry->dir) != 0) { // The job fails like a command that can't be found
+            fprintf(stderr, "kush: Error starting job %d in %s: %s\n", job->id, entry->dir, strerror(errno));
+            for (int i = 0; i < job->num_procs; i++) {
+                job->procs[i].state = KUSH_PROC_DONE;
+                job->procs[i].status = 127;
+            }
+            job->num_done = job->num_procs;
+            if (back >= 0) close(back);
+            back = -2;
+        }
+    }
+    if (back != -2) {
+        job->slot = 1;
+        num_slot_jobs++;
+        kush_job_start(job, entry->stages, entry->num_stages, 1);
+        kush_job_watch(job);
+    }
+    if (back >= 0) {
+        if (fchdir(back) != 0) perror("kush: Error changing back into the working directory");
+        close(back);
+    }
+
+    kush_arena_release(&line_arena, mark);
+    free(entry);
+}
+
+// Starts queued jobs as long as there are free slots. Returns the number of milliseconds after which the load has
+// to be checked again because it holds back jobs, or -1 if nothing has to be checked.
+int kush_sched_run() {
+    int slots;
+
+    if (!sched_head) return -1;
+    slots = kush_sched_slots();
+    while (sched_head && kush_sched_admit(slots)) kush_sched_start(sched_head->job);
+
+    return sched_head && job_sched.adaptive && num_slot_jobs < slots ? KUSH_SCHED_CHECK_NS / 1000000 : -1;
+}
+
+// Queues a background job that finds all slots taken, or jobs queued before it still waiting. A queued job is put
+// into the job table right away and true is returned; otherwise the caller starts the job.
+int kush_sched_defer(kush_job *job, kush_command *stages, int num_stages) {
+    int slots = kush_sched_slots();
+    kush_sched_entry *entry;
+
+    if (slots <= 0) return 0;
+    // Without a terminal nothing reaps jobs between commands, so the ones that are done give back their slots here.
+    // An interactive shell has done that after the last command already.
+    if (signal_fd < 0 && num_slot_jobs >= slots) kush_event_wait(0);
+    kush_sched_run();
+    if (!sched_head && kush_sched_admit(slots)) return 0;
+
+    for (int i = 0; i < num_stages; i++) {
+        job->procs[i].pid = -1;
+        job->procs[i].pidfd = -1;
+        job->procs[i].node = -1;
+        job->procs[i].state = KUSH_PROC_RUNNING;
+    }
+    job->slot = 0;
+    job = kush_job_persist(job, stages, num_stages);
+    entry = kush_sched_entry_new(stages, num_stages);
+    entry->job = job;
+    entry->queued_ns = kush_sched_now();
+    entry->next = NULL;
+    job->queued = entry;
+    if (sched_tail) sched_tail->next = entry;
+    else sched_head = entry;
+    sched_tail = entry;
+
+    job_sched.num_queued++;
+    if (++job_sched.depth > job_sched.peak_depth) job_sched.peak_depth = job_sched.depth;
+    if (interactive) printf("[%d] queued\n", job->id);
+    last_status = 0;
+    pipe_num_status = 0;
+
+    return 1;
+}
+
+// Starts the jobs that are still queued when the shell exits, as slots free up, as they have been asked for.
+// A SIGINT drops the jobs left.
+void kush_sched_drain() {
+    if (!sched_head) return;
+
+    epoll_ctl(event_epoll, EPOLL_CTL_DEL, STDIN_FILENO, NULL); // There is no more input to wait for
+    if (interactive) fprintf(stderr, "kush: Starting %d queued jobs before exiting\n", job_sched.depth);
+    while (sched_head) {
+        if (kush_event_wait(-1) < 0) {
+            fprintf(stderr, "kush: Dropped %d queued jobs\n", job_sched.depth);
+            break;
+        }
+    }
+}
+
+int kush_jobstat(char **args) {
+    int slots = kush_sched_slots();
+    long waiting; // Time the oldest job in the queue has waited so far
+    (void) args; // Suppress 'unused parameter' warning
+
+    kush_event_wait(0);
+    waiting = sched_head ? kush_sched_now() - sched_head->queued_ns : 0;
+    if (slots > 0) printf("job slots:            %d\n", slots);
+    else printf("job slots:            unlimited\n");
+    if (slots > 0 && job_sched.adaptive) printf("slots usable now:     %d\n", job_sched.limit);
+    printf("running jobs:         %d\n", num_slot_jobs);
+    printf("queued jobs:          %d\n", job_sched.depth);
+    printf("queue peak:           %d\n", job_sched.peak_depth);
+    printf("jobs queued:          %lu\n", job_sched.num_queued);
+    printf("average wait:         %.3f s\n", job_sched.num_waited ? job_sched.wait_ns / 1e9 / job_sched.num_waited : 0);
+    printf("longest wait:         %.3f s\n", (waiting > job_sched.max_wait_ns ? waiting : job_sched.max_wait_ns) / 1e9);
+    printf("oldest queued since:  %.3f s\n", waiting / 1e9);
+    if (job_sched.num_checks > 0) {
+        printf("load checks:          %lu (%lu overloaded)\n", job_sched.num_checks, job_sched.num_throttled);
+        printf("runnable per CPU:     %.2f\n", job_sched.load);
+        printf("pressure cpu/mem/io:  %.1f%% %.1f%% %.1f%%\n", job_sched.psi[0], job_sched.psi[1], job_sched.psi[2]);
+    }
+    if (place_num_nodes > 0) { // Processes the CPU placement has counted on every node
+        printf("placed per node:     ");
+        for (int i = 0; i < place_num_nodes; i++) printf(" %d:%d", place_nodes[i].id, place_nodes[i].load);
+        putchar('\n');
+    }
+
+    return 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// Parallel jobs
+// -----------------------------------------------------------------------------------------
+// The parallel built-in runs a command once for every input, with a bounded number of them running at a time. The
+// inputs are the words after ':::', the lines of a file (-a) or the lines of stdin. Every job is started with
+// kush_spawn() like any other command and reaped through its pidfd, so waiting for the next job to finish is one
+// poll() over the running jobs. With -k the output of the jobs is written in the order of the inputs: the oldest job
+// that hasn't been written yet writes straight through, the later ones are buffered in memory until it is their
+// turn, and what doesn't fit into the memory limit (-m) of a job goes to an unlinked temporary file.
+
+// Default number of bytes of output every job keeps in memory with -k
+#define KUSH_PARALLEL_MEM (1024 * 1024)
+// Size of the buffers output and input are read with
+#define KUSH_PARALLEL_BUFF_SIZE (64 * 1024)
+// Highest exit status telling how many jobs failed, like in GNU parallel
+#define KUSH_PARALLEL_MAX_FAILED 101
+
+// A job of the parallel built-in
+typedef struct kush_pjob {
+    pid_t pid;
+    int pidfd; // -1 once the job is done, or if it couldn't be opened
+    int out_fd; // Read end of the pipe of the job's stdout with -k, -1 once it is at its end
+    int spill_fd; // Temporary file with the output that didn't fit into buff, -1 if there is none
+    char *buff; // Output waiting to be written
+    size_t len;
+    size_t size;
+    int status; // Exit status, -1 while the job runs
+    int node; // Node the job is counted on by the CPU placement, -1 if none
+} kush_pjob;
+
+// State of the parallel built-in
+typedef struct kush_par {
+    char **command; // Command template, '{}' in a word stands for the input
+    int num_command;
+    int placeholder; // Boolean value telling if a word of the command contains '{}'
+    int max_jobs; // Number of jobs that may run at the same time
+    int keep; // Boolean value telling if the output is written in the order of the inputs (-k)
+    size_t mem_limit; // Bytes of output a job keeps in memory (-m)
+    char **words; // Inputs given after ':::', NULL if they are read from in_fd
+    int in_fd; // Descriptor the input lines are read from
+    char *in; // Input read from in_fd that hasn't been used yet
+    size_t in_start;
+    size_t in_end;
+    size_t in_size;
+    int in_eof; // Boolean value telling if in_fd is at its end
+    kush_pjob **jobs; // Jobs that run or (with -k) haven't been written yet, in the order of their inputs
+    int num_jobs;
+    int running; // Number of jobs that haven't been reaped yet
+    int failed; // Number of jobs that failed
+    int out_error; // Boolean value telling if writing the output failed, after which it is dropped
+    char buff[KUSH_PARALLEL_BUFF_SIZE];
+} kush_par;
+
+// Writes len bytes of data to stdout. Once that fails, output is dropped instead.
+void kush_parallel_out(kush_par *par, const char *data, size_t len) {
+    while (len > 0 && !par->out_error) {
+        ssize_t written = write(STDOUT_FILENO, data, len);
+
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) {
+            if (errno != EPIPE) perror("kush: parallel: Error writing output");
+            par->out_error = 1;
+            return;
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+// Opens an unlinked temporary file in $TMPDIR (or /tmp). Returns its descriptor or -1.
+int kush_parallel_tmpfile() {
+    const char *dir = kush_var_get("TMPDIR");
+    char path[PATH_MAX];
+    int fd;
+
+    if (!dir || !*dir) dir = "/tmp";
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+
+    // File systems without O_TMPFILE get a named file, which is removed right away
+    if (snprintf(path, sizeof(path), "%s/kush-parallel.XXXXXX", dir) >= (int) sizeof(path)) return -1;
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+// Keeps len bytes of output of a job that isn't written yet: in memory up to the memory limit, and after that in
+// the temporary file of the job. If there is no temporary file, memory it is.
+void kush_parallel_keep(kush_par *par, kush_pjob *job, const char *data, size_t len) {
+    if (job->spill_fd < 0 && job->len + len > par->mem_limit) job->spill_fd = kush_parallel_tmpfile();
+    if (job->spill_fd >= 0) { // Once the file is in use everything goes there, or the order would be lost
+        while (len > 0) {
+            ssize_t written = write(job->spill_fd, data, len);
+
+            if (written < 0 && errno == EINTR) continue;
+            if (written <= 0) {
+                perror("kush: parallel: Error writing a temporary file");
+                return;
+            }
+            data += written;
+            len -= written;
+        }
+        return;
+    }
+
+    if (job->len + len > job->size) {
+        while (job->len + len > job->size) job->size = job->size ? 2 * job->size : KUSH_PARALLEL_BUFF_SIZE;
+        job->buff = realloc(job->buff, job->size); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!job->buff) {
+            fprintf(stderr, "kush: Parallel output allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(job->buff + job->len, data, len);
+    job->len += len;
+}
+
+// Writes the output a job has kept so far, the part in memory first
+void kush_parallel_flush(kush_par *par, kush_pjob *job) {
+    ssize_t num_read;
+
+    kush_parallel_out(par, job->buff, job->len);
+    job->len = 0;
+    if (job->spill_fd < 0) return;
+
+    lseek(job->spill_fd, 0, SEEK_SET);
+    while ((num_read = read(job->spill_fd, par->buff, sizeof(par->buff))) > 0) {
+        kush_parallel_out(par, par->buff, num_read);
+    }
+    close(job->spill_fd);
+    job->spill_fd = -1;
+}
+
+// Frees a job, which has to be done
+void kush_parallel_free(kush_pjob *job) {
+    if (job->out_fd >= 0) close(job->out_fd);
+    if (job->spill_fd >= 0) close(job->spill_fd);
+    free(job->buff);
+    free(job);
+}
+
+// Returns the next input, or NULL if there is none right now. *more is set if more input may follow once in_fd
+// becomes readable. Inputs read from in_fd are copied into the line arena.
+char *kush_parallel_next(kush_par *par, int *more) {
+    char *newline;
+    char *line;
+    size_t len;
+
+    *more = 0;
+    if (par->words) return *par->words ? *par->words++ : NULL;
+
+    newline = memchr(par->in + par->in_start, '\n', par->in_end - par->in_start);
+    if (!newline && !par->in_eof) { // Only complete lines are taken, unless the input has ended
+        *more = 1;
+        return NULL;
+    }
+    len = newline ? (size_t) (newline - (par->in + par->in_start)) : par->in_end - par->in_start;
+    if (!newline && len == 0) return NULL;
+
+    line = kush_arena_alloc(&line_arena, len + 1);
+    memcpy(line, par->in + par->in_start, len);
+    line[len] = '\0';
+    par->in_start += len + (newline != NULL);
+
+    return line;
+}
+
+// Reads more input from in_fd
+void kush_parallel_read(kush_par *par) {
+    ssize_t num_read;
+
+    if (par->in_start > 0) { // Move what's left to the front
+        memmove(par->in, par->in + par->in_start, par->in_end - par->in_start);
+        par->in_end -= par->in_start;
+        par->in_start = 0;
+    }
+    if (par->in_end == par->in_size) { // A line longer than the buffer
+        par->in_size = par->in_size ? 2 * par->in_size : KUSH_PARALLEL_BUFF_SIZE;
+        par->in = realloc(par->in, par->in_size); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!par->in) {
+            fprintf(stderr, "kush: Parallel input allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    num_read = read(par->in_fd, par->in + par->in_end, par->in_size - par->in_end);
+    if (num_read < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if (num_read <= 0) par->in_eof = 1;
+    else par->in_end += num_read;
+}
+
+// Starts a job for input. Returns 0 on success and -1 if the command couldn't be started.
+int kush_parallel_start(kush_par *par, const char *input) {
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+    char **argv = kush_arena_alloc(&line_arena, (par->num_command + 2) * sizeof(char *));
+    size_t input_len = strlen(input);
+    kush_command cmd = {.argv = argv, .assigns = argv};
+    kush_launch launch = {.cmd = &cmd, .stdin_fd = -1, .stdout_fd = -1, .pgid = -1};
+    kush_pjob *job;
+    int pipefd[2] = {-1, -1};
+    int argc = 0;
+    pid_t pid;
+
+    for (int i = 0; i < par->num_command; i++) { // Put the input in place of every '{}'
+        const char *word = par->command[i];
+        const char *at;
+        size_t len = 0;
+
+        if (!par->placeholder || !(at = strstr(word, "{}"))) {
+            argv[argc++] = (char *) word;
+            continue;
+        }
+        for (at = word; (at = strstr(at, "{}")); at += 2) len += input_len;
+        argv[argc] = kush_arena_alloc(&line_arena, strlen(word) + len + 1);
+        len = 0;
+        for (const char *c = word; *c;) {
+            if (c[0] == '{' && c[1] == '}') {
+                memcpy(argv[argc] + len, input, input_len);
+                len += input_len;
+                c += 2;
+            } else argv[argc][len++] = *c++;
+        }
+        argv[argc++][len] = '\0';
+    }
+    if (!par->placeholder) argv[argc++] = (char *) input;
+    argv[argc] = NULL;
+
+    if (par->keep && pipe2(pipefd, O_CLOEXEC) != 0) {
+        perror("kush: parallel: Error creating a pipe");
+        kush_arena_release(&line_arena, mark);
+        return -1;
+    }
+    // Jobs mustn't eat the inputs that are still to come
+    if (!par->words) launch.stdin_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    launch.stdout_fd = pipefd[1];
+    launch.builtin = kush_find_inshell(argv[0]);
+    if (launch.builtin) launch.flags = KUSH_LAUNCH_FORK;
+
+    fflush(stdout);
+    kush_place_job();
+    pid = kush_spawn(&launch);
+    if (launch.stdin_fd >= 0) close(launch.stdin_fd);
+    if (pipefd[1] >= 0) close(pipefd[1]);
+    kush_arena_release(&line_arena, mark);
+    if (pid < 0) {
+        if (pipefd[0] >= 0) close(pipefd[0]);
+        return -1;
+    }
+
+    job = calloc(1, sizeof(kush_pjob));
+    if (!job || (par->num_jobs % 16 == 0 &&
+                 !(par->jobs = realloc(par->jobs, (par->num_jobs + 16) * sizeof(kush_pjob *))))) { // NOLINT
+        fprintf(stderr, "kush: Parallel job allocation error");
+        exit(EXIT_FAILURE);
+    }
+    job->pid = pid;
+    job->pidfd = pidfd_open(pid, 0);
+    if (job->pidfd >= 0) fcntl(job->pidfd, F_SETFD, FD_CLOEXEC);
+    job->out_fd = pipefd[0];
+    job->spill_fd = -1;
+    job->status = -1;
+    job->node = launch.node;
+    par->jobs[par->num_jobs++] = job;
+    par->running++;
+
+    return 0;
+}
+
+// Marks a job as done with the given exit status
+void kush_parallel_done(kush_par *par, kush_pjob *job, int status) {
+    if (job->pidfd >= 0) close(job->pidfd);
+    job->pidfd = -1;
+    job->status = status;
+    if (status != 0) par->failed++;
+    par->running--;
+    kush_place_release(job->node);
+    job->node = -1;
+}
+
+// Reaps the jobs that have exited, either told by their pidfd (ready) or, for jobs without one, by asking waitpid()
+void kush_parallel_reap(kush_par *par, kush_pjob *job, int ready) {
+    siginfo_t info;
+    int status;
+
+    if (job->status >= 0) return;
+    if (job->pidfd < 0) {
+        if (waitpid(job->pid, &status, WNOHANG) == job->pid) kush_parallel_done(par, job, kush_status_code(status));
+        return;
+    }
+    if (!ready) return;
+
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PIDFD, job->pidfd, &info, WEXITED | WNOHANG) != 0 || info.si_pid == 0) return;
+    kush_parallel_done(par, job, info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status);
+}
+
+// Reads the output of a job that is ready. The first job writes it right away, the others keep it for later.
+void kush_parallel_collect(kush_par *par, kush_pjob *job) {
+    ssize_t num_read = read(job->out_fd, par->buff, sizeof(par->buff));
+
+    if (num_read < 0 && errno == EINTR) return;
+    if (num_read <= 0) {
+        close(job->out_fd);
+        job->out_fd = -1;
+    } else if (job == par->jobs[0]) kush_parallel_out(par, par->buff, num_read);
+    else kush_parallel_keep(par, job, par->buff, num_read);
+}
+
+// Drops the jobs at the front that are done, writing their output first. The job that is first then writes what
+// it kept so far, everything it writes from then on goes out right away.
+void kush_parallel_advance(kush_par *par) {
+    int done = 0;
+
+    while (done < par->num_jobs && par->jobs[done]->status >= 0 && par->jobs[done]->out_fd < 0) {
+        kush_parallel_flush(par, par->jobs[done]);
+        kush_parallel_free(par->jobs[done++]);
+    }
+    if (done == 0) return;
+    par->num_jobs -= done;
+    memmove(par->jobs, par->jobs + done, par->num_jobs * sizeof(kush_pjob *));
+    if (par->num_jobs > 0) kush_parallel_flush(par, par->jobs[0]);
+}
+
+// Parses the options of the parallel built-in into par. Returns the index of the command in args, or -1 after
+// printing an error.
+int kush_parallel_options(kush_par *par, char **args) {
+    static const char units[] = "KMG";
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        const char *opt = args[i];
+        unsigned long long value;
+        const char *unit;
+        char *end;
+
+        if (strcmp(opt, "--") == 0) return i + 1;
+        if (strcmp(opt, "-k") == 0) {
+            par->keep = 1;
+            continue;
+        }
+        if ((strcmp(opt, "-j") != 0 && strcmp(opt, "-m") != 0 && strcmp(opt, "-a") != 0) || !args[i + 1]) break;
+
+        i++;
+        if (opt[1] == 'a') {
+            par->in_fd = open(args[i], O_RDONLY | O_CLOEXEC);
+            if (par->in_fd < 0) {
+                fprintf(stderr, "kush: parallel: %s: %s\n", args[i], strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        value = strtoull(args[i], &end, 10);
+        if (opt[1] == 'm' && *end && end[1] == '\0' && (unit = strchr(units, *end))) { // A size may have a unit
+            value <<= 10 * (unit - units + 1);
+            end++;
+        }
+        if (*end || end == args[i] || (opt[1] == 'j' && (value < 1 || value > INT_MAX))) {
+            fprintf(stderr, "kush: parallel: %s: invalid argument for %s\n", args[i], opt);
+            return -1;
+        }
+        if (opt[1] == 'j') par->max_jobs = (int) value;
+        else par->mem_limit = value;
+    }
+
+    if (args[i] && args[i][0] == '-' && args[i][1] != '\0') {
+        fprintf(stderr, "kush: parallel: %s: invalid option\n", args[i]);
+        return -1;
+    }
+    return i;
+}
+
+int kush_parallel(char **args) {
+    kush_par *par = calloc(1, sizeof(kush_par));
+    struct pollfd *fds = NULL;
+    kush_pjob **polled = NULL; // Job of every entry of fds, NULL for the signals and the input
+    int fds_size = 0;
+    int interrupted = 0;
+    int first;
+
+    if (!par) {
+        fprintf(stderr, "kush: Parallel allocation error");
+        exit(EXIT_FAILURE);
+    }
+    par->max_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    par->mem_limit = KUSH_PARALLEL_MEM;
+    par->in_fd = STDIN_FILENO;
+    first = kush_parallel_options(par, args);
+    if (first < 0 || !args[first] || strcmp(args[first], ":::") == 0) {
+        if (first >= 0) fprintf(stderr, "kush: parallel: Usage: parallel [-j jobs] [-k] [-m bytes] [-a file] "
+                                        "command [arg...] [::: input...]\n");
+        last_status = 2;
+        goto end;
+    }
+
+    par->command = args + first;
+    for (; args[first] && strcmp(args[first], ":::") != 0; first++) {
+        if (strstr(args[first], "{}")) par->placeholder = 1;
+    }
+    par->num_command = (int) (args + first - par->command);
+    if (args[first]) par->words = args + first + 1;
+    if (par->max_jobs < 1) par->max_jobs = 1;
+    fflush(stdout);
+
+    while (1) {
+        int more = 0;
+        int num_fds = 0;
+        int timeout = -1;
+
+        // Start jobs for the inputs there are, as long as slots are free
+        while (!interrupted && par->running < par->max_jobs) {
+            kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+            char *input = kush_parallel_next(par, &more);
+
+            if (!input) break;
+            if (kush_parallel_start(par, input) != 0) par->failed++;
+            kush_arena_release(&line_arena, mark);
+        }
+        kush_parallel_advance(par);
+        if (par->num_jobs == 0 && (!more || interrupted)) break;
+
+        if (2 * par->num_jobs + 2 > fds_size) { // Every job may have its pidfd and its output polled
+            fds_size = 2 * par->num_jobs + 2;
+            fds = realloc(fds, fds_size * sizeof(struct pollfd)); // NOLINT(bugprone-suspicious-realloc-usage)
+            polled = realloc(polled, fds_size * sizeof(kush_pjob *)); // NOLINT(bugprone-suspicious-realloc-usage)
+            if (!fds || !polled) {
+                fprintf(stderr, "kush: Parallel allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (signal_fd >= 0) {
+            fds[num_fds] = (struct pollfd) {.fd = signal_fd, .events = POLLIN};
+            polled[num_fds++] = NULL;
+        }
+        if (more && !interrupted) {
+            fds[num_fds] = (struct pollfd) {.fd = par->in_fd, .events = POLLIN};
+            polled[num_fds++] = NULL;
+        }
+        for (int i = 0; i < par->num_jobs; i++) {
+            kush_pjob *job = par->jobs[i];
+
+            if (job->out_fd >= 0) {
+                fds[num_fds] = (struct pollfd) {.fd = job->out_fd, .events = POLLIN};
+                polled[num_fds++] = job;
+            }
+            if (job->status >= 0) continue;
+            if (job->pidfd < 0) timeout = 10; // Has to be asked with waitpid()
+            else {
+                fds[num_fds] = (struct pollfd) {.fd = job->pidfd, .events = POLLIN};
+                polled[num_fds++] = job;
+            }
+        }
+
+        if (poll(fds, num_fds, timeout) < 0 && errno != EINTR) {
+            perror("kush: parallel: poll");
+            break;
+        }
+        for (int i = 0; i < num_fds; i++) {
+            kush_pjob *job = polled[i];
+
+            if (!fds[i].revents) continue;
+            if (fds[i].fd == signal_fd && !job) {
+                if (kush_signals_read()) interrupted = 1;
+            } else if (!job) kush_parallel_read(par);
+            else if (fds[i].fd == job->out_fd) kush_parallel_collect(par, job);
+            else kush_parallel_reap(par, job, 1);
+        }
+        for (int i = 0; i < par->num_jobs; i++) kush_parallel_reap(par, par->jobs[i], 0);
+    }
+
+    last_status = par->failed > KUSH_PARALLEL_MAX_FAILED ? KUSH_PARALLEL_MAX_FAILED : par->failed;
+    if (interrupted) {
+        if (interactive) putchar('\n');
+        last_status = 128 + SIGINT;
+    }
+
+end:
+    for (int i = 0; i < par->num_jobs; i++) kush_parallel_free(par->jobs[i]);
+    if (par->in_fd > STDERR_FILENO) close(par->in_fd);
+    free(par->jobs);
+    free(par->in);
+    free(par);
+    free(fds);
+    free(polled);
+
+    return 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// Tries to run the given command as a function or build-in and if it doesn't match any launches it as a job
+int kush_run(kush_command *cmd) {
+    kush_builtin_func builtin;
+    int exit;
+    char **saved;
+
+    if (cmd->argv[0] == NULL) { // Only redirections, which still create or truncate their files, and assignments
+        pipe_num_status = 0;
+        last_status = kush_redir_open(cmd) == 0 ? 0 : 1;
+        kush_redir_close(cmd);
+        for (int i = 0; i < cmd->num_assigns && last_status == 0; i++) {
+            size_t name_len = kush_var_name_len(cmd->assigns[i]);
+
+            kush_var_set(cmd->assigns[i], name_len, cmd->assigns[i] + name_len + 1, 0);
+        }
+        return 0;
+    }
+
+    builtin = kush_find_inshell(cmd->argv[0]);
+    if (builtin && cmd->num_assigns == 0) return kush_run_builtin(builtin, cmd, -1, -1);
+    if (builtin) { // Assignments in front of a built-in only last while it runs
+        saved = kush_arena_alloc(&line_arena, cmd->num_assigns * sizeof(char *));
+        for (int i = 0; i < cmd->num_assigns; i++) {
+            size_t name_len = kush_var_name_len(cmd->assigns[i]);
+            const char *old = kush_var_lookup(cmd->assigns[i], name_len);
+
+            saved[i] = old ? strcpy(kush_arena_alloc(&line_arena, strlen(old) + 1), old) : NULL;
+            kush_var_set(cmd->assigns[i], name_len, cmd->assigns[i] + name_len + 1, 0);
+        }
+        exit = kush_run_builtin(builtin, cmd, -1, -1);
+        for (int i = cmd->num_assigns - 1; i >= 0; i--) {
+            kush_var_set(cmd->assigns[i], kush_var_name_len(cmd->assigns[i]), saved[i], 0);
+        }
+        return exit;
+    }
+
+    kush_launch_job(cmd, 1, 0);
+    return 0;
+}
+
+// Splits the token list of a pipeline into its stages and runs them, in the background if background is true.
+// Returns 1 if the shell should exit.
+int kush_run_pipeline(char **tokens, int background) {
+    kush_command *stages = NULL;
+    int num_stages = 1;
+    int pos = 0;
+
+    if (tokens[0] == NULL) { // All words expanded to nothing
+        last_status = 0;
+        pipe_num_status = 0;
+        return 0;
+    }
+
+    for (int i = 0; tokens[i] != NULL; i++) {
+        if (kush_op_type(tokens[i]) == KUSH_OP_PIPE) num_stages++;
+    }
+
+    stages = kush_arena_alloc(&line_arena, num_stages * sizeof(kush_command));
+    stages[0].argv = tokens;
+    for (int i = 0; tokens[i] != NULL; i++) {
+        if (kush_op_type(tokens[i]) != KUSH_OP_PIPE) continue;
+
+        tokens[i] = NULL; // Terminates the argument list of the current stage
+        stages[++pos].argv = &tokens[i + 1];
+    }
+
+    for (int i = 0; i < num_stages; i++) {
+        if (stages[i].argv[0] == NULL) {
+            fprintf(stderr, "kush: Syntax error near unexpected token '|'\n");
+            last_status = 2;
+            return 0;
+        }
+        if (kush_parse_command(stages[i].argv, &stages[i]) != 0) return 0;
+    }
+
+    // A single command in the foreground doesn't need any plumbing
+    if (num_stages == 1 && !background) return kush_run(&stages[0]);
+
+    kush_launch_job(stages, num_stages, background);
+    return 0;
+}
+
+// Scripts
+// -----------------------------------------------------------------------------------------
+// Input is compiled before it runs: kush_compile() turns the tokens of one or more lines into a unit of bytecode,
+// and kush_exec() runs it. Control structures become jumps, so a loop body is tokenized and parsed only once no
+// matter how often it runs, and a function keeps the bytecode of its body for every call. Only the expansion of
+// parameters is left for run time, see kush_expand().
+// A unit keeps its words in a string pool and refers to them by offset, operators are stored as -(op + 1).
+
+// Bytecode instructions, followed by their operands
+enum kush_bc {
+    KUSH_BC_PIPELINE, // background, n, n tokens: expands the tokens and runs them as a pipeline
+    KUSH_BC_JUMP, // target
+    KUSH_BC_JUMP_FALSE, // target: jumps if the last status isn't 0
+    KUSH_BC_JUMP_TRUE, // target: jumps if the last status is 0
+    KUSH_BC_NOT, // Negates the last status
+    KUSH_BC_TRUE, // Sets the last status to 0
+    KUSH_BC_FOR_INIT, // n, n words: expands the words and pushes an iteration over them
+    KUSH_BC_FOR_NEXT, // var, target: sets var to the next word of the iteration, jumps to target if there is none
+    KUSH_BC_CASE_WORD, // word: expands word and pushes it as the subject of a case statement
+    KUSH_BC_CASE_MATCH, // pattern, target: jumps to target if the subject matches the pattern
+    KUSH_BC_POP, // Drops the innermost iteration or case subject
+    KUSH_BC_WHILE_INIT, // Pushes the status of a while loop, which is 0 until its body has run
+    KUSH_BC_WHILE_SAVE, // Keeps the last status as that of the innermost while loop, before its condition runs
+    KUSH_BC_WHILE_END, // Drops the innermost while loop and sets the last status to the one it kept
+    KUSH_BC_ITER_TRUNC, // depth: drops iterations and case subjects until depth are left (break and continue)
+    KUSH_BC_FUNC, // name, end: defines a function whose body follows, continues at end
+    KUSH_BC_RETURN, // word: returns from a function or sourced script, with the status word expands to unless it is -1
+    KUSH_BC_END, // End of the unit
+    KUSH_NUM_BC
+};
+
+// Maximum nesting of function calls, deeper calls fail instead of overflowing the stack
+#define KUSH_MAX_FUNC_DEPTH 1000
+
+// Compiled script
+typedef struct kush_unit {
+    int refs; // Number of references, from the run of the unit and from every function it defines
+    int *code;
+    int code_len;
+    int code_size;
+    char *pool; // Words used by the code, each one terminated by '\0'
+    size_t pool_len;
+    size_t pool_size;
+} kush_unit;
+
+// A function defined by a script
+typedef struct kush_function {
+    kush_unit *unit; // Unit holding the body, referenced by the function
+    int start; // Position of the body in the code of unit
+} kush_function;
+
+// Iteration of a for loop, or the subject of a case statement which is an iteration over one word. While loops
+// have an entry without words, for the status of their body.
+typedef struct kush_iter {
+    char **words; // A single allocation holding both the vector and its strings
+    int num_words;
+    int pos; // Next word to assign
+    int status; // Status of the last command of a while loop's body
+} kush_iter;
+
+int func_depth = 0; // Number of functions being run
+int script_interrupted = 0; // Boolean value telling if a foreground job was interrupted while a unit was running
+
+// Releases a reference to unit, freeing it with the last one
+void kush_unit_release(kush_unit *unit) {
+    if (--unit->refs > 0) return;
+
+    free(unit->code);
+    free(unit->pool);
+    free(unit);
+}
+
+// Returns the function called name or NULL if there is none
+kush_function *kush_function_find(const char *name) {
+    kush_var *var;
+
+    if (!var_table) return NULL;
+    var = kush_var_slot(name, strlen(name));
+
+    return var->name ? var->func : NULL;
+}
+
+// Defines the function name with the body at start in unit, replacing an earlier definition
+void kush_function_define(const char *name, kush_unit *unit, int start) {
+    kush_var *var = kush_var_intern(name, strlen(name));
+
+    if (var->func) kush_unit_release(var->func->unit);
+    else if (!(var->func = malloc(sizeof(kush_function)))) {
+        fprintf(stderr, "kush: Function allocation error");
+        exit(EXIT_FAILURE);
+    }
+    unit->refs++;
+    var->func->unit = unit;
+    var->func->start = start;
+}
+
+// State of kush_compile()
+typedef struct kush_compiler {
+    kush_unit *unit; // Unit the code is written to
+    char **tokens; // Tokens to compile
+    int pos; // Current position in tokens
+    int depth; // Number of iterations and case subjects the code at the current position has on the stack
+    struct kush_loop_scope *loop; // Innermost loop around the current position, NULL if there is none
+    int can_return; // Boolean value telling if the current position is in a function body or a sourced script
+    int incomplete; // Boolean value telling if the tokens ended before the command did
+    int error;
+} kush_compiler;
+
+// A loop being compiled, break and continue need to know where to jump to
+typedef struct kush_loop_scope {
+    struct kush_loop_scope *outer; // Loop around this one
+    int depth; // Stack depth outside of the loop
+    int iter; // Boolean value telling if the loop keeps an iteration on the stack while its body runs
+    int next; // Where continue jumps to
+    int breaks; // Jumps to the end of the loop that are yet to be patched, see kush_patch_chain()
+} kush_loop_scope;
+
+// Words that end a list of commands, when they are in command position
+const char *const kush_list_ends[] = {"then", "else", "elif", "fi", "do", "done", "esac", "}", NULL};
+
+// Appends value to the code of the unit being compiled and returns its position
+int kush_emit(kush_compiler *comp, int value) {
+    kush_unit *unit = comp->unit;
+
+    if (unit->code_len == unit->code_size) {
+        unit->code_size = unit->code_size ? 2 * unit->code_size : 64;
+        unit->code = realloc(unit->code, unit->code_size * sizeof(int)); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!unit->code) {
+            fprintf(stderr, "kush: Bytecode allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unit->code[unit->code_len] = value;
+
+    return unit->code_len++;
+}
+
+// Appends a token to the code: the offset of a copy of the word in the pool, or -(op + 1) for an operator
+int kush_emit_token(kush_compiler *comp, const char *token) {
+    kush_unit *unit = comp->unit;
+    int op = kush_op_type(token);
+    size_t len = strlen(token) + 1;
+
+    if (op >= 0) return kush_emit(comp, -(op + 1));
+
+    if (unit->pool_len + len > unit->pool_size) {
+        while (unit->pool_len + len > unit->pool_size) unit->pool_size = unit->pool_size ? 2 * unit->pool_size : 256;
+        unit->pool = realloc(unit->pool, unit->pool_size); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!unit->pool) {
+            fprintf(stderr, "kush: Bytecode allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(unit->pool + unit->pool_len, token, len);
+    unit->pool_len += len;
+
+    return kush_emit(comp, (int) (unit->pool_len - len));
+}
+
+// Emits a jump instruction whose target isn't known yet and returns the position of the target, which has to be
+// set with kush_patch() later
+int kush_emit_jump(kush_compiler *comp, int instruction) {
+    kush_emit(comp, instruction);
+    return kush_emit(comp, -1);
+}
+
+// Sets the jump target at position at to the current end of the code
+void kush_patch(kush_compiler *comp, int at) {
+    comp->unit->code[at] = comp->unit->code_len;
+}
+
+// Emits a jump that is added to the chain of jumps starting at *chain. The targets of the chain link to the next
+// one until kush_patch_chain() sets them all.
+void kush_chain_jump(kush_compiler *comp, int *chain) {
+    int at = kush_emit_jump(comp, KUSH_BC_JUMP);
+
+    comp->unit->code[at] = *chain;
+    *chain = at;
+}
+
+// Sets all jump targets of a chain to the current end of the code
+void kush_patch_chain(kush_compiler *comp, int chain) {
+    while (chain >= 0) {
+        int next = comp->unit->code[chain];
+
+        kush_patch(comp, chain);
+        chain = next;
+    }
+}
+
+// Returns the current token, NULL at the end of the tokens
+const char *kush_comp_token(kush_compiler *comp) {
+    return comp->tokens[comp->pos];
+}
+
+// Returns true if the current token is the operator op
+int kush_comp_op(kush_compiler *comp, int op) {
+    return comp->tokens[comp->pos] && kush_op_type(comp->tokens[comp->pos]) == op;
+}
+
+// Returns true if the current token is the word word
+int kush_comp_word(kush_compiler *comp, const char *word) {
+    return comp->tokens[comp->pos] && kush_op_type(comp->tokens[comp->pos]) < 0 &&
+           strcmp(comp->tokens[comp->pos], word) == 0;
+}
+
+// Skips newlines
+void kush_comp_newlines(kush_compiler *comp) {
+    while (kush_comp_op(comp, KUSH_OP_NEWLINE)) comp->pos++;
+}
+
+// Fails the compilation at the current token. If the tokens have ended, the command may go on in the next line.
+void kush_comp_error(kush_compiler *comp) {
+    const char *token = kush_comp_token(comp);
+
+    if (comp->error) return;
+    comp->error = 1;
+    if (!token) {
+        comp->incomplete = 1;
+        return;
+    }
+    fprintf(stderr, "kush: Syntax error near unexpected token '%s'\n", *token == '\n' ? "newline" : token);
+    last_status = 2;
+}
+
+// Skips the keyword word, failing if it isn't the current token
+void kush_comp_expect(kush_compiler *comp, const char *word) {
+    if (kush_comp_word(comp, word)) comp->pos++;
+    else kush_comp_error(comp);
+}
+
+// Returns true if the current token ends a list of commands
+int kush_comp_list_end(kush_compiler *comp) {
+    const char *token = kush_comp_token(comp);
+
+    if (!token || kush_comp_op(comp, KUSH_OP_RPAREN) || kush_comp_op(comp, KUSH_OP_CASE_END)) return 1;
+    for (int i = 0; kush_list_ends[i] != NULL; i++) {
+        if (kush_comp_word(comp, kush_list_ends[i])) return 1;
+    }
+
+    return 0;
+}
+
+// Returns true if the current token starts a compound command
+int kush_comp_compound(kush_compiler *comp) {
+    return kush_comp_word(comp, "if") || kush_comp_word(comp, "while") || kush_comp_word(comp, "until") ||
+           kush_comp_word(comp, "for") || kush_comp_word(comp, "case") || kush_comp_word(comp, "{");
+}
+
+int kush_compile_list(kush_compiler *comp);
+int kush_compile_pipeline(kush_compiler *comp);
+
+// Compiles the body of a loop, from 'do' to 'done'. Patches the breaks and leaves the rest to the caller.
+void kush_compile_loop_body(kush_compiler *comp, kush_loop_scope *scope) {
+    scope->outer = comp->loop;
+    scope->breaks = -1;
+    comp->loop = scope;
+
+    kush_comp_newlines(comp);
+    kush_comp_expect(comp, "do");
+    if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+    kush_comp_expect(comp, "done");
+
+    comp->loop = scope->outer;
+}
+
+// Compiles 'while list; do list; done' and 'until list; do list; done'. The status of the loop is that of the last
+// command of its body, or 0 if the body never ran, so it is kept on the stack while the condition runs.
+void kush_compile_while(kush_compiler *comp, int until) {
+    kush_loop_scope scope = {.depth = comp->depth, .iter = 1};
+    int exit_jump;
+
+    comp->pos++;
+    kush_emit(comp, KUSH_BC_WHILE_INIT);
+    comp->depth++;
+    scope.next = kush_emit(comp, KUSH_BC_WHILE_SAVE);
+    if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+    exit_jump = kush_emit_jump(comp, until ? KUSH_BC_JUMP_TRUE : KUSH_BC_JUMP_FALSE);
+    kush_compile_loop_body(comp, &scope);
+    kush_emit(comp, KUSH_BC_JUMP);
+    kush_emit(comp, scope.next);
+    kush_patch(comp, exit_jump);
+    kush_emit(comp, KUSH_BC_WHILE_END);
+    comp->depth--;
+    kush_patch_chain(comp, scope.breaks); // Breaks have dropped the loop's status already
+}
+
+// Compiles 'for NAME [in word...]; do list; done'. Without 'in' the loop goes over the positional parameters.
+void kush_compile_for(kush_compiler *comp) {
+    const char *name = comp->tokens[++comp->pos];
+    kush_loop_scope scope = {.depth = comp->depth, .iter = 1};
+    int num_at;
+    int done_jump;
+
+    if (!name || kush_op_type(name) >= 0 || kush_var_name_len(name) != strlen(name)) {
+        kush_comp_error(comp);
+        return;
+    }
+    comp->pos++;
+
+    kush_emit(comp, KUSH_BC_FOR_INIT);
+    num_at = kush_emit(comp, 0);
+    if (kush_comp_word(comp, "in")) {
+        for (comp->pos++; kush_comp_token(comp) && kush_op_type(kush_comp_token(comp)) < 0; comp->pos++) {
+            kush_emit_token(comp, kush_comp_token(comp));
+        }
+        if (!kush_comp_op(comp, KUSH_OP_SEMICOLON) && !kush_comp_op(comp, KUSH_OP_NEWLINE)) {
+            kush_comp_error(comp);
+            return;
+        }
+        comp->pos++;
+    } else {
+        kush_emit_token(comp, (char[]) {KUSH_MARK_QPARAM, '@', KUSH_MARK_END, '\0'}); // "$@"
+        if (kush_comp_op(comp, KUSH_OP_SEMICOLON)) comp->pos++;
+    }
+    comp->unit->code[num_at] = comp->unit->code_len - num_at - 1;
+
+    comp->depth++;
+    scope.next = kush_emit(comp, KUSH_BC_FOR_NEXT);
+    kush_emit_token(comp, name);
+    done_jump = kush_emit(comp, -1);
+    kush_compile_loop_body(comp, &scope);
+    kush_emit(comp, KUSH_BC_JUMP);
+    kush_emit(comp, scope.next);
+    kush_patch(comp, done_jump);
+    kush_emit(comp, KUSH_BC_POP);
+    comp->depth--;
+    kush_patch_chain(comp, scope.breaks); // Breaks have dropped the iteration already
+}
+
+// Compiles 'if list; then list; [elif list; then list;]... [else list;] fi'
+void kush_compile_if(kush_compiler *comp) {
+    int ends = -1; // Jumps from the end of every branch to the end of the statement
+    int next_jump;
+
+    do { // 'if' and every 'elif'
+        comp->pos++;
+        if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+        next_jump = kush_emit_jump(comp, KUSH_BC_JUMP_FALSE);
+        kush_comp_expect(comp, "then");
+        if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+        kush_chain_jump(comp, &ends);
+        kush_patch(comp, next_jump);
+    } while (!comp->error && kush_comp_word(comp, "elif"));
+
+    if (kush_comp_word(comp, "else")) {
+        comp->pos++;
+        if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+    } else kush_emit(comp, KUSH_BC_TRUE); // No branch taken
+    kush_comp_expect(comp, "fi");
+    kush_patch_chain(comp, ends);
+}
+
+// Compiles 'case word in [(]pattern[|pattern]...) list;; ... esac'
+void kush_compile_case(kush_compiler *comp) {
+    int ends = -1; // Jumps from the end of every item to the end of the statement
+
+    if (!comp->tokens[++comp->pos] || kush_op_type(kush_comp_token(comp)) >= 0) {
+        kush_comp_error(comp);
+        return;
+    }
+    kush_emit(comp, KUSH_BC_CASE_WORD);
+    kush_emit_token(comp, comp->tokens[comp->pos++]);
+    comp->depth++;
+    kush_comp_newlines(comp);
+    kush_comp_expect(comp, "in");
+    kush_comp_newlines(comp);
+
+    while (!comp->error && !kush_comp_word(comp, "esac")) {
+        int matches = -1; // Jumps from the patterns to the body of the item
+        int next_jump;
+
+        if (kush_comp_op(comp, KUSH_OP_LPAREN)) comp->pos++;
+        while (1) { // Every pattern jumps to the body if it matches
+            const char *pattern = kush_comp_token(comp);
+
+            if (!pattern || kush_op_type(pattern) >= 0) {
+                kush_comp_error(comp);
+                return;
+            }
+            kush_emit(comp, KUSH_BC_CASE_MATCH);
+            kush_emit_token(comp, pattern);
+            matches = kush_emit(comp, matches);
+            comp->pos++;
+            if (!kush_comp_op(comp, KUSH_OP_PIPE)) break;
+            comp->pos++;
+        }
+        if (!kush_comp_op(comp, KUSH_OP_RPAREN)) {
+            kush_comp_error(comp);
+            return;
+        }
+        comp->pos++;
+
+        next_jump = kush_emit_jump(comp, KUSH_BC_JUMP);
+        kush_patch_chain(comp, matches);
+        kush_compile_list(comp);
+        kush_chain_jump(comp, &ends);
+        kush_patch(comp, next_jump);
+
+        if (kush_comp_op(comp, KUSH_OP_CASE_END)) comp->pos++;
+        else if (!kush_comp_word(comp, "esac")) kush_comp_error(comp);
+        kush_comp_newlines(comp);
+    }
+    comp->pos++;
+
+    kush_emit(comp, KUSH_BC_TRUE); // No pattern matched
+    kush_patch_chain(comp, ends);
+    kush_emit(comp, KUSH_BC_POP);
+    comp->depth--;
+}
+
+// Compiles the definition of the function name, whose body starts at the current token
+void kush_compile_function(kush_compiler *comp, const char *name) {
+    kush_compiler outer = *comp;
+    int end_jump;
+
+    kush_comp_newlines(comp);
+    if (!kush_comp_compound(comp)) { // The body is a compound command
+        kush_comp_error(comp);
+        return;
+    }
+
+    kush_emit(comp, KUSH_BC_FUNC);
+    kush_emit_token(comp, name);
+    end_jump = kush_emit(comp, -1);
+
+    // The body runs in a frame of its own, loops around the definition don't matter to it
+    comp->depth = 0;
+    comp->loop = NULL;
+    comp->can_return = 1;
+    kush_compile_pipeline(comp);
+    comp->depth = outer.depth;
+    comp->loop = outer.loop;
+    comp->can_return = outer.can_return;
+
+    kush_emit(comp, KUSH_BC_RETURN);
+    kush_emit(comp, -1);
+    kush_patch(comp, end_jump);
+    kush_emit(comp, KUSH_BC_TRUE);
+}
+
+// Compiles 'break [n]' and 'continue [n]'
+void kush_compile_loop_jump(kush_compiler *comp, int is_break) {
+    const char *arg = comp->tokens[comp->pos + 1];
+    kush_loop_scope *scope = comp->loop;
+    long num = 1;
+
+    comp->pos++;
+    if (arg && kush_op_type(arg) < 0) {
+        char *end;
+
+        num = strtol(arg, &end, 10);
+        if (*end != '\0' || num < 1) {
+            fprintf(stderr, "kush: %s: %s: loop count out of range\n", is_break ? "break" : "continue", arg);
+            comp->error = 1;
+            return;
+        }
+        comp->pos++;
+    }
+    if (!scope) {
+        fprintf(stderr, "kush: %s: only meaningful in a loop\n", is_break ? "break" : "continue");
+        comp->error = 1;
+        return;
+    }
+    while (--num > 0 && scope->outer) scope = scope->outer; // Too large a count means the outermost loop
+
+    kush_emit(comp, KUSH_BC_ITER_TRUNC);
+    kush_emit(comp, is_break ? scope->depth : scope->depth + scope->iter);
+    kush_emit(comp, KUSH_BC_TRUE);
+    if (is_break) kush_chain_jump(comp, &scope->breaks);
+    else {
+        kush_emit(comp, KUSH_BC_JUMP);
+        kush_emit(comp, scope->next);
+    }
+}
+
+// Compiles a pipeline, which may be preceded by '!'. Compound commands and functions definitions are compiled here
+// too, but they can't be part of a pipeline with several stages. Returns the position of the background flag of the
+// pipeline, or -1 if it is a compound command or negated, as only simple pipelines can run in the background.
+int kush_compile_pipeline(kush_compiler *comp) {
+    const char *token = kush_comp_token(comp);
+    const char *next = token ? comp->tokens[comp->pos + 1] : NULL;
+    int negate = kush_comp_word(comp, "!");
+    int background_at;
+    int n_at;
+
+    if (negate) {
+        token = comp->tokens[++comp->pos];
+        next = token ? comp->tokens[comp->pos + 1] : NULL;
+    }
+
+    if (!token || (kush_op_type(token) >= 0 && !kush_op_is_redir(kush_op_type(token)))) {
+        kush_comp_error(comp);
+        return -1;
+    }
+
+    if (kush_comp_word(comp, "if")) kush_compile_if(comp);
+    else if (kush_comp_word(comp, "while")) kush_compile_while(comp, 0);
+    else if (kush_comp_word(comp, "until")) kush_compile_while(comp, 1);
+    else if (kush_comp_word(comp, "for")) kush_compile_for(comp);
+    else if (kush_comp_word(comp, "case")) kush_compile_case(comp);
+    else if (kush_comp_word(comp, "{")) {
+        comp->pos++;
+        if (kush_compile_list(comp) == 0) kush_comp_error(comp);
+        kush_comp_expect(comp, "}");
+    } else if (kush_comp_word(comp, "function") && next && kush_op_type(next) < 0) { // function name [()] body
+        comp->pos += 2;
+        if (kush_comp_op(comp, KUSH_OP_LPAREN)) {
+            comp->pos++;
+            if (kush_comp_op(comp, KUSH_OP_RPAREN)) comp->pos++;
+            else kush_comp_error(comp);
+        }
+        if (!comp->error) kush_compile_function(comp, next);
+    } else if (next && kush_op_type(next) == KUSH_OP_LPAREN) { // name() body
+        comp->pos += 2;
+        if (kush_comp_op(comp, KUSH_OP_RPAREN)) {
+            comp->pos++;
+            kush_compile_function(comp, token);
+        } else kush_comp_error(comp);
+    } else if (kush_comp_word(comp, "break") || kush_comp_word(comp, "continue")) {
+        kush_compile_loop_jump(comp, *token == 'b');
+    } else if (kush_comp_word(comp, "return")) {
+        if (!comp->can_return) {
+            fprintf(stderr, "kush: return: can only return from a function or sourced script\n");
+            comp->error = 1;
+            return -1;
+        }
+        kush_emit(comp, KUSH_BC_RETURN);
+        if (next && kush_op_type(next) < 0) {
+            kush_emit_token(comp, next);
+            comp->pos++;
+        } else kush_emit(comp, -1);
+        comp->pos++;
+    } else { // Simple pipeline, all tokens up to the end of it are taken as they are
+        kush_emit(comp, KUSH_BC_PIPELINE);
+        background_at = kush_emit(comp, 0);
+        n_at = kush_emit(comp, 0);
+        while ((token = kush_comp_token(comp)) != NULL) {
+            int op = kush_op_type(token);
+
+            if (op >= 0 && op != KUSH_OP_PIPE && !kush_op_is_redir(op)) break;
+            kush_emit_token(comp, token);
+            comp->pos++;
+            // A redirection needs a target, so the line fails here instead of running up to 'echo a >&3'
+            if (kush_op_is_redir(op) && op != KUSH_OP_ERR_TO_OUT && op != KUSH_OP_OUT_TO_ERR &&
+                (!kush_comp_token(comp) || kush_op_type(kush_comp_token(comp)) >= 0)) {
+                kush_comp_error(comp);
+                break;
+            }
+            if (op != KUSH_OP_PIPE) continue;
+
+            kush_comp_newlines(comp); // The pipeline may go on in the next line
+            if (!kush_comp_token(comp)) kush_comp_error(comp);
+            else if (kush_comp_compound(comp)) {
+                fprintf(stderr, "kush: Compound commands can't be part of a pipeline\n");
+                comp->error = 1;
+            }
+            if (comp->error) break;
+        }
+        comp->unit->code[n_at] = comp->unit->code_len - n_at - 1;
+        if (negate) kush_emit(comp, KUSH_BC_NOT);
+        return negate ? -1 : background_at;
+    }
+
+    if (kush_comp_op(comp, KUSH_OP_PIPE)) {
+        fprintf(stderr, "kush: Compound commands can't be part of a pipeline\n");
+        comp->error = 1;
+    } else if (kush_comp_token(comp) && kush_op_is_redir(kush_op_type(kush_comp_token(comp)))) {
+        fprintf(stderr, "kush: Compound commands can't be redirected\n");
+        comp->error = 1;
+    }
+    if (negate) kush_emit(comp, KUSH_BC_NOT);
+    return -1;
+}
+
+// Compiles pipelines connected with '&&' and '||', which run the next pipeline only if the last one succeeded or
+// failed. Returns the position of the background flag of the pipeline, -1 unless it is a single simple pipeline.
+int kush_compile_and_or(kush_compiler *comp) {
+    int background_at = kush_compile_pipeline(comp);
+
+    while (!comp->error && (kush_comp_op(comp, KUSH_OP_AND) || kush_comp_op(comp, KUSH_OP_OR))) {
+        int skip = kush_emit_jump(comp, kush_comp_op(comp, KUSH_OP_AND) ? KUSH_BC_JUMP_FALSE : KUSH_BC_JUMP_TRUE);
+
+        comp->pos++;
+        kush_comp_newlines(comp);
+        kush_compile_pipeline(comp);
+        kush_patch(comp, skip);
+        background_at = -1;
+    }
+
+    return background_at;
+}
+
+// Compiles commands separated by ';', '&' and newlines, up to a token that ends the list. Returns the number of
+// commands compiled.
+int kush_compile_list(kush_compiler *comp) {
+    int num_commands = 0;
+
+    kush_comp_newlines(comp);
+    while (!comp->error && !kush_comp_list_end(comp)) {
+        int background_at = kush_compile_and_or(comp);
+
+        num_commands++;
+        if (comp->error) break;
+        if (kush_comp_op(comp, KUSH_OP_BACKGROUND)) {
+            if (background_at < 0) {
+                fprintf(stderr, "kush: Only simple pipelines can run in the background\n");
+                comp->error = 1;
+                break;
+            }
+            comp->unit->code[background_at] = 1;
+        } else if (!kush_comp_op(comp, KUSH_OP_SEMICOLON) && !kush_comp_op(comp, KUSH_OP_NEWLINE)) break;
+        comp->pos++;
+        kush_comp_newlines(comp);
+    }
+
+    return num_commands;
+}
+
+// Compiles a token list returned by kush_tokenize() into a new unit with one reference. can_return tells if 'return'
+// may end the unit, which it can in a sourced script. Returns NULL if the tokens aren't valid, printing an error, or
+// if they end in the middle of a command, in which case *incomplete is set instead. Then the tokens of the next line
+// have to be added.
+kush_unit *kush_compile(char **tokens, int can_return, int *incomplete) {
+    kush_compiler comp = {.tokens = tokens, .pos = 0, .depth = 0, .loop = NULL, .can_return = can_return,
+                          .incomplete = 0, .error = 0};
+
+    comp.unit = calloc(1, sizeof(kush_unit));
+    if (!comp.unit) {
+        fprintf(stderr, "kush: Bytecode allocation error");
+        exit(EXIT_FAILURE);
+    }
+    comp.unit->refs = 1;
+
+    kush_compile_list(&comp);
+    if (!comp.error && kush_comp_token(&comp)) kush_comp_error(&comp); // Something like a 'fi' without an 'if'
+    kush_emit(&comp, KUSH_BC_END);
+
+    *incomplete = comp.incomplete;
+    if (comp.error) {
+        kush_unit_release(comp.unit);
+        return NULL;
+    }
+
+    return comp.unit;
+}
+
+// Returns the words of n tokens of unit expanded as mode says into a NULL terminated list allocated from the line
+// arena
+char **kush_exec_tokens(kush_unit *unit, const int *tokens, int n, enum kush_expand_mode mode) {
+    char **words = kush_arena_alloc(&line_arena, (n + 1) * sizeof(char *));
+
+    for (int i = 0; i < n; i++) words[i] = tokens[i] >= 0 ? unit->pool + tokens[i] : (char *) kush_ops[-tokens[i] - 1];
+    words[n] = NULL;
+
+    return kush_expand(words, mode);
+}
+
+// Pushes an iteration over words onto the stack *iters, which holds *num_iters of *iters_size iterations. The
+// words are copied, so the iteration outlives the line arena.
+void kush_iter_push(kush_iter **iters, int *num_iters, int *iters_size, char **words) {
+    kush_iter *iter;
+    size_t size = sizeof(char *);
+    int num_words = 0;
+    char *str;
+
+    if (*num_iters == *iters_size) {
+        *iters_size = *iters_size ? 2 * *iters_size : 8;
+        *iters = realloc(*iters, *iters_size * sizeof(kush_iter)); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!*iters) {
+            fprintf(stderr, "kush: Iteration allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (; words[num_words] != NULL; num_words++) size += sizeof(char *) + strlen(words[num_words]) + 1;
+
+    iter = &(*iters)[(*num_iters)++];
+    iter->words = malloc(size);
+    if (!iter->words) {
+        fprintf(stderr, "kush: Iteration allocation error");
+        exit(EXIT_FAILURE);
+    }
+    iter->num_words = num_words;
+    iter->pos = 0;
+    str = (char *) (iter->words + num_words + 1);
+    for (int i = 0; i < num_words; i++) {
+        iter->words[i] = str;
+        str = stpcpy(str, words[i]) + 1;
+    }
+    iter->words[num_words] = NULL;
+}
+
+// Runs the code of unit from position pc on, until its end or until a function returns. Returns 1 if the shell
+// should exit.
+int kush_exec(kush_unit *unit, int pc) {
+    // Every instruction jumps straight to the next one through this table, so the branch predictor can learn the
+    // sequences of instructions in a loop, instead of all of them going through one switch
+    static const void *dispatch[KUSH_NUM_BC] = {
+            [KUSH_BC_PIPELINE] = &&pipeline,
+            [KUSH_BC_JUMP] = &&jump,
+            [KUSH_BC_JUMP_FALSE] = &&jump_false,
+            [KUSH_BC_JUMP_TRUE] = &&jump_true,
+            [KUSH_BC_NOT] = &&not,
+            [KUSH_BC_TRUE] = &&true,
+            [KUSH_BC_FOR_INIT] = &&for_init,
+            [KUSH_BC_FOR_NEXT] = &&for_next,
+            [KUSH_BC_CASE_WORD] = &&case_word,
+            [KUSH_BC_CASE_MATCH] = &&case_match,
+            [KUSH_BC_POP] = &&pop,
+            [KUSH_BC_WHILE_INIT] = &&while_init,
+            [KUSH_BC_WHILE_SAVE] = &&while_save,
+            [KUSH_BC_WHILE_END] = &&while_end,
+            [KUSH_BC_ITER_TRUNC] = &&iter_trunc,
+            [KUSH_BC_FUNC] = &&func,
+            [KUSH_BC_RETURN] = &&ret,
+            [KUSH_BC_END] = &&end
+    };
+    const int *code = unit->code;
+    kush_iter *iters = NULL; // Iterations of the for loops and subjects of the case statements being run
+    int num_iters = 0;
+    int iters_size = 0;
+    int exit = 0;
+
+#define KUSH_DISPATCH() goto *dispatch[code[pc++]]
+    KUSH_DISPATCH();
+
+pipeline: {
+    // Whatever the pipeline allocates is released right after it, so a loop doesn't grow the line arena
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+
+    exit = kush_run_pipeline(kush_exec_tokens(unit, &code[pc + 2], code[pc + 1], KUSH_EXPAND_FIELDS), code[pc]);
+    kush_arena_release(&line_arena, mark);
+    pc += 2 + code[pc + 1];
+    // Like the job, the script gets interrupted by a SIGINT. One that arrived while a built-in ran in the shell is
+    // waiting in the signalfd.
+    if (job_control && last_status == 128 + SIGINT) script_interrupted = 1;
+    else if (signal_fd >= 0 && kush_event_wait(0) < 0) {
+        script_interrupted = 1;
+        last_status = 128 + SIGINT;
+        putchar('\n');
+    }
+    if (exit || script_interrupted) goto end;
+    KUSH_DISPATCH();
+}
+jump:
+    pc = code[pc];
+    KUSH_DISPATCH();
+jump_false:
+    pc = last_status != 0 ? code[pc] : pc + 1;
+    KUSH_DISPATCH();
+jump_true:
+    pc = last_status == 0 ? code[pc] : pc + 1;
+    KUSH_DISPATCH();
+not:
+    last_status = last_status == 0;
+    pipe_num_status = 0;
+    KUSH_DISPATCH();
+true:
+    last_status = 0;
+    pipe_num_status = 0;
+    KUSH_DISPATCH();
+for_init: {
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+    char **words = kush_exec_tokens(unit, &code[pc + 1], code[pc], KUSH_EXPAND_FIELDS);
+
+    kush_iter_push(&iters, &num_iters, &iters_size, words);
+    kush_arena_release(&line_arena, mark);
+    pc += 1 + code[pc];
+    last_status = 0; // A loop without iterations succeeds
+    pipe_num_status = 0;
+    KUSH_DISPATCH();
+}
+for_next: {
+    kush_iter *iter = &iters[num_iters - 1];
+
+    if (iter->pos == iter->num_words) {
+        pc = code[pc + 1];
+        KUSH_DISPATCH();
+    }
+    kush_var_set(unit->pool + code[pc], strlen(unit->pool + code[pc]), iter->words[iter->pos++], 0);
+    pc += 2;
+    KUSH_DISPATCH();
+}
+case_word: {
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+
+    kush_iter_push(&iters, &num_iters, &iters_size, kush_exec_tokens(unit, &code[pc], 1, KUSH_EXPAND_WORD));
+    kush_arena_release(&line_arena, mark);
+    pc++;
+    KUSH_DISPATCH();
+}
+case_match: {
+    kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+    char *pattern = kush_exec_tokens(unit, &code[pc], 1, KUSH_EXPAND_PATTERN)[0];
+    kush_pattern pat;
+    const char *word = iters[num_iters - 1].words[0];
+    int match;
+
+    kush_pattern_compile(&pat, pattern, strlen(pattern));
+    match = kush_pattern_match(&pat, word, strlen(word));
+
+    kush_arena_release(&line_arena, mark);
+    pc = match ? code[pc + 1] : pc + 2;
+    KUSH_DISPATCH();
+}
+pop:
+    free(iters[--num_iters].words);
+    KUSH_DISPATCH();
+while_init:
+    kush_iter_push(&iters, &num_iters, &iters_size, (char *[]) {NULL});
+    last_status = 0; // Kept by the first while_save, for a body that never runs
+    pipe_num_status = 0;
+    KUSH_DISPATCH();
+while_save:
+    iters[num_iters - 1].status = last_status;
+    KUSH_DISPATCH();
+while_end:
+    last_status = iters[--num_iters].status;
+    free(iters[num_iters].words);
+    pipe_num_status = 0;
+    KUSH_DISPATCH();
+iter_trunc:
+    while (num_iters > code[pc]) free(iters[--num_iters].words);
+    pc++;
+    KUSH_DISPATCH();
+func:
+    kush_function_define(unit->pool + code[pc], unit, pc + 2);
+    pc = code[pc + 1];
+    KUSH_DISPATCH();
+ret:
+    if (code[pc] >= 0) {
+        kush_arena_mark mark = kush_arena_mark_get(&line_arena);
+        char **words = kush_exec_tokens(unit, &code[pc], 1, KUSH_EXPAND_WORD);
+        char *num_end;
+
+        last_status = (int) (strtol(words[0], &num_end, 10) & 0xff);
+        if (*num_end != '\0' || *words[0] == '\0') {
+            fprintf(stderr, "kush: return: %s: numeric argument required\n", words[0]);
+            last_status = 2;
+        }
+        pipe_num_status = 0;
+        kush_arena_release(&line_arena, mark);
+    }
+end:
+#undef KUSH_DISPATCH
+    while (num_iters > 0) free(iters[--num_iters].words);
+    free(iters);
+
+    return exit;
+}
+
+// Runs the function args[0] with args as its positional parameters. Used like a built-in.
+int kush_call_function(char **args) {
+    kush_function *func = kush_function_find(args[0]);
+    kush_unit *unit = func->unit;
+    char **outer_args = pos_args;
+    int outer_num = pos_num;
+    int exit;
+
+    if (func_depth >= KUSH_MAX_FUNC_DEPTH) {
+        fprintf(stderr, "kush: %s: maximum function nesting level exceeded\n", args[0]);
+        last_status = 1;
+        return 0;
+    }
+
+    pos_args = args;
+    for (pos_num = 0; args[pos_num + 1] != NULL; pos_num++);
+    unit->refs++; // The function may be redefined while it runs
+    func_depth++;
+    exit = kush_exec(unit, func->start);
+    func_depth--;
+    kush_unit_release(unit);
+    pos_args = outer_args;
+    pos_num = outer_num;
+
+    return exit;
+}
+// -----------------------------------------------------------------------------------------
+
+// Sourced scripts
+// -----------------------------------------------------------------------------------------
+// The source built-in maps a script into memory and hashes its contents. The unit compiled from a script is cached
+// in a file named after that hash, so as long as the script doesn't change, sourcing it again loads the bytecode
+// instead of tokenizing and compiling the script. A cache file is the unit as it is in memory: a header, the code
+// and the string pool, which the code only refers to by offset.
+
+// Identifies cache files, the version has to change whenever the bytecode, the operators or the marks change
+#define KUSH_CACHE_MAGIC "KUSHBC\0"
+#define KUSH_CACHE_VERSION 4
+
+// Header of a cache file, followed by the code and the pool of the unit
+typedef struct kush_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t code_len; // Number of ints in the code
+    uint64_t hash; // Hash of the script the unit was compiled from
+    uint64_t source_len; // Size of the script
+    uint64_t pool_len;
+} kush_cache_header;
+
+// Hash of the contents of a script, the key of its cache file. Mixes in eight bytes at a time, so hashing even a
+// large script takes a small fraction of the time compiling it would.
+uint64_t kush_content_hash(const unsigned char *data, size_t len) {
+    uint64_t hash = 0x9e3779b97f4a7c15UL ^ len;
+    uint64_t word = 0;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdUL;
+        hash ^= hash >> 32;
+    }
+    word = 0;
+    memcpy(&word, data + i, len - i);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdUL;
+
+    // Final avalanche, so every input bit affects every bit of the name of the cache file
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+// Writes the path of the cache file for the script with the given hash to path, creating the cache directory
+// ($XDG_CACHE_HOME/kush or ~/.cache/kush) if needed. Returns -1 if there is no place for a cache.
+int kush_cache_path(uint64_t hash, char *path) {
+    const char *base = kush_var_get("XDG_CACHE_HOME");
+    int len;
+
+    if (base && *base) len = snprintf(path, PATH_MAX, "%s", base);
+    else if ((base = kush_var_get("HOME")) && *base) len = snprintf(path, PATH_MAX, "%s/.cache", base);
+    else return -1;
+    if (len >= PATH_MAX - 32) return -1;
+
+    mkdir(path, 0700); // Fails if it exists already, like it usually does
+    len += snprintf(path + len, PATH_MAX - len, "/kush");
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) return -1;
+
+    snprintf(path + len, PATH_MAX - len, "/%016lx", (unsigned long) hash);
+    return 0;
+}
+
+// Returns true if the code of unit is well formed: every instruction is known, its operands are in range and
+// jumps go to positions inside the code. Guards against cache files written by other versions or cut short.
+int kush_unit_valid(const kush_unit *unit) {
+    const int *code = unit->code;
+    int len = unit->code_len;
+    int pc = 0;
+
+    if (len == 0 || code[len - 1] != KUSH_BC_END) return 0;
+    if (unit->pool_len > 0 && unit->pool[unit->pool_len - 1] != '\0') return 0;
+
+#define KUSH_CHECK(cond) if (!(cond)) return 0
+#define KUSH_TARGET(at) KUSH_CHECK((at) < len && code[at] >= 0 && code[at] < len)
+#define KUSH_WORD(at) KUSH_CHECK((at) < len && code[at] >= 0 && (size_t) code[at] < unit->pool_len)
+#define KUSH_TOKEN(at) KUSH_CHECK((at) < len && code[at] >= -KUSH_NUM_OPS && \
+                                  (code[at] < 0 || (size_t) code[at] < unit->pool_len))
+    while (pc < len) {
+        int op = code[pc++];
+
+        switch (op) {
+            case KUSH_BC_PIPELINE:
+            case KUSH_BC_FOR_INIT: { // Followed by a number of tokens, pipelines have a background flag first
+                int n_at = op == KUSH_BC_PIPELINE ? pc + 1 : pc;
+
+                KUSH_CHECK(n_at < len && code[n_at] >= 0 && code[n_at] < len - n_at);
+                for (int i = 1; i <= code[n_at]; i++) KUSH_TOKEN(n_at + i);
+                pc = n_at + code[n_at] + 1;
+                break;
+            }
+            case KUSH_BC_JUMP:
+            case KUSH_BC_JUMP_FALSE:
+            case KUSH_BC_JUMP_TRUE:
+                KUSH_TARGET(pc);
+                pc++;
+                break;
+            case KUSH_BC_FOR_NEXT:
+            case KUSH_BC_CASE_MATCH:
+            case KUSH_BC_FUNC:
+                KUSH_WORD(pc);
+                KUSH_TARGET(pc + 1);
+                pc += 2;
+                break;
+            case KUSH_BC_CASE_WORD:
+                KUSH_WORD(pc);
+                pc++;
+                break;
+            case KUSH_BC_ITER_TRUNC:
+                KUSH_CHECK(pc < len && code[pc] >= 0);
+                pc++;
+                break;
+            case KUSH_BC_RETURN:
+                KUSH_CHECK(pc < len && (code[pc] == -1 || (code[pc] >= 0 && (size_t) code[pc] < unit->pool_len)));
+                pc++;
+                break;
+            case KUSH_BC_NOT:
+            case KUSH_BC_TRUE:
+            case KUSH_BC_POP:
+            case KUSH_BC_WHILE_INIT:
+            case KUSH_BC_WHILE_SAVE:
+            case KUSH_BC_WHILE_END:
+            case KUSH_BC_END:
+                break;
+            default:
+                return 0;
+        }
+    }
+#undef KUSH_CHECK
+#undef KUSH_TARGET
+#undef KUSH_WORD
+#undef KUSH_TOKEN
+
+    return pc == len;
+}
+
+// Loads the unit cached for a script of source_len bytes with the given hash. Returns NULL if there is none or if
+// the cache file is no good.
+kush_unit *kush_cache_load(uint64_t hash, size_t source_len) {
+    char path[PATH_MAX];
+    kush_cache_header header;
+    kush_unit *unit;
+    struct stat st;
+    struct iovec iov[2];
+    int fd;
+
+    if (kush_cache_path(hash, path) != 0 || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, KUSH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != KUSH_CACHE_VERSION ||
+        header.hash != hash || header.source_len != source_len || header.code_len > INT_MAX ||
+        (uint64_t) st.st_size != sizeof(header) + header.code_len * sizeof(int) + header.pool_len) {
+        close(fd);
+        return NULL;
+    }
+
+    unit = calloc(1, sizeof(kush_unit));
+    if (unit) {
+        unit->code = malloc(header.code_len * sizeof(int) + 1);
+        unit->pool = malloc(header.pool_len + 1);
+    }
+    if (!unit || !unit->code || !unit->pool) {
+        fprintf(stderr, "kush: Bytecode allocation error");
+        exit(EXIT_FAILURE);
+    }
+    unit->refs = 1;
+    unit->code_len = unit->code_size = (int) header.code_len;
+    unit->pool_len = unit->pool_size = header.pool_len;
+
+    // Code and pool are read with a single system call
+    iov[0] = (struct iovec) {unit->code, header.code_len * sizeof(int)};
+    iov[1] = (struct iovec) {unit->pool, header.pool_len};
+    if (preadv(fd, iov, 2, sizeof(header)) != (ssize_t) (iov[0].iov_len + iov[1].iov_len) || !kush_unit_valid(unit)) {
+        kush_unit_release(unit);
+        unit = NULL;
+    }
+    close(fd);
+
+    return unit;
+}
+
+// Writes unit to the cache file for a script of source_len bytes with the given hash. The file is written under a
+// temporary name and renamed, so other shells sourcing the same script never see half of it. Failing to write
+// the cache isn't an error, the script just gets compiled again the next time.
+void kush_cache_store(const kush_unit *unit, uint64_t hash, size_t source_len) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+    kush_cache_header header = {.version = KUSH_CACHE_VERSION, .code_len = unit->code_len, .hash = hash,
+                                .source_len = source_len, .pool_len = unit->pool_len};
+    struct iovec iov[3] = {{&header, sizeof(header)},
+                           {unit->code, unit->code_len * sizeof(int)},
+                           {unit->pool, unit->pool_len}};
+    ssize_t size = (ssize_t) (iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+    int fd;
+
+    if (kush_cache_path(hash, path) != 0) return;
+    memcpy(header.magic, KUSH_CACHE_MAGIC, sizeof(header.magic));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int) getpid());
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    if (writev(fd, iov, 3) != size || close(fd) != 0 || rename(tmp_path, path) != 0) unlink(tmp_path);
+}
+
+// Compiles the script name of len bytes at text. Prints an error and returns NULL if it isn't valid.
+kush_unit *kush_source_compile(const char *name, const char *text, size_t len) {
+    char *copy = kush_arena_alloc(&line_arena, len + 1); // The tokenizer needs a string it may write to
+    char **tokens;
+    kush_unit *unit = NULL;
+    int incomplete;
+
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    tokens = kush_tokenize(copy, &incomplete);
+    if (tokens) unit = kush_compile(tokens, 1, &incomplete);
+    if (incomplete) fprintf(stderr, "kush: %s: Syntax error: unexpected end of file\n", name);
+
+    return unit;
+}
+
+// Runs the commands of a script in the shell itself. Further arguments become the positional parameters while it
+// runs.
+int kush_source(char **args) {
+    char **outer_args = pos_args;
+    int outer_num = pos_num;
+    unsigned char *text = (unsigned char *) ""; // An empty script can't be mapped
+    kush_unit *unit;
+    struct stat st;
+    uint64_t hash;
+    int exit;
+    int fd;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "kush: %s: filename argument required\n", args[0]);
+        last_status = 2;
+        return 0;
+    }
+    if (func_depth >= KUSH_MAX_FUNC_DEPTH) {
+        fprintf(stderr, "kush: %s: maximum nesting level exceeded\n", args[1]);
+        last_status = 1;
+        return 0;
+    }
+
+    fd = open(args[1], O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        (st.st_size > 0 && (text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)) {
+        fprintf(stderr, "kush: %s: %s: %s\n", args[0], args[1], strerror(errno));
+        if (fd >= 0) close(fd);
+        last_status = 1;
+        return 0;
+    }
+    close(fd);
+
+    hash = kush_content_hash(text, st.st_size);
+    unit = kush_cache_load(hash, st.st_size);
+    if (!unit && (unit = kush_source_compile(args[1], (const char *) text, st.st_size))) {
+        kush_cache_store(unit, hash, st.st_size);
+    }
+    if (st.st_size > 0) munmap(text, st.st_size);
+    if (!unit) {
+        last_status = 2;
+        return 0;
+    }
+
+    if (args[2] != NULL) {
+        pos_args = args + 1;
+        for (pos_num = 0; args[pos_num + 2] != NULL; pos_num++);
+    }
+    func_depth++;
+    exit = kush_exec(unit, 0);
+    func_depth--;
+    kush_unit_release(unit);
+    pos_args = outer_args;
+    pos_num = outer_num;
+
+    return exit;
+}
+// -----------------------------------------------------------------------------------------
+
+// History
+// -----------------------------------------------------------------------------------------
+// Every interactive session appends the commands it reads to one shared history file. A command is written as a
+// single record with one O_APPEND write(), so records of concurrent sessions never interleave. Records are framed
+// with their size at both ends, which lets a reader walk the file backwards from its end: the file is only mapped
+// into memory, so loading a history of any length costs the same, and entries are looked at when they are needed.
+// A background thread compacts a file that has grown large, dropping duplicates and the oldest entries, and
+// replaces the file with the result. Appending sessions hold a shared lock for their write and the compaction an
+// exclusive one, so a record is never written to a file that is just being replaced.
+
+// Starts every history record
+#define KUSH_HIST_MAGIC 0x6b687374
+// A history file this large is compacted when a session starts
+#define KUSH_HIST_COMPACT_SIZE (64 * 1024 * 1024)
+// Maximum number of entries kept by a compaction, which also keeps at most half of KUSH_HIST_COMPACT_SIZE bytes
+#define KUSH_HIST_MAX 1000000
+
+// Start of a history record. It is followed by the text, padding to a multiple of 8 bytes and a kush_hist_tail.
+typedef struct kush_hist_head {
+    uint32_t magic;
+    uint32_t len; // Length of the text
+    int64_t time; // When the command was entered
+} kush_hist_head;
+
+// End of a history record
+typedef struct kush_hist_tail {
+    uint32_t check; // Hash of the text, tells a complete record from one cut short
+    uint32_t size; // Size of the whole record
+} kush_hist_tail;
+
+char hist_path[PATH_MAX]; // Location of the history file, empty without history
+int hist_fd = -1; // History file opened for appending, -1 without history
+const char *hist_map = NULL; // hist_size bytes of the history file mapped into memory
+size_t hist_size = 0;
+ino_t hist_ino = 0; // Inode of the mapped file, it changes when the file is replaced by a compaction
+int hist_compacting = 0; // Boolean value telling if this session has started a compaction
+char *hist_pending = NULL; // Records that couldn't be written yet, because a compaction was running
+size_t hist_pending_len = 0;
+size_t hist_pending_size = 0;
+
+// Returns the size of a record with len bytes of text
+size_t kush_hist_record_size(size_t len) {
+    return sizeof(kush_hist_head) + ((len + 7) & ~(size_t) 7) + sizeof(kush_hist_tail);
+}
+
+// Returns the check value of a record's text
+uint32_t kush_hist_check(const char *text, size_t len) {
+    return (uint32_t) kush_content_hash((const unsigned char *) text, len);
+}
+
+// Returns true if a complete record starts at offset start of the size bytes at map
+int kush_hist_valid(const char *map, size_t size, size_t start) {
+    kush_hist_head head;
+    kush_hist_tail tail;
+    size_t record_size;
+
+    if (start % 4 != 0 || size - start < sizeof(head) + sizeof(tail)) return 0;
+    memcpy(&head, map + start, sizeof(head));
+    record_size = kush_hist_record_size(head.len);
+    if (head.magic != KUSH_HIST_MAGIC || record_size > size - start) return 0;
+    memcpy(&tail, map + start + record_size - sizeof(tail), sizeof(tail));
+
+    return tail.size == record_size && tail.check == kush_hist_check(map + start + sizeof(head), head.len);
+}
+
+// Returns the offset of the first complete record at or after offset pos of the size bytes at map, or size if there
+// is none. Damaged parts of the file, which only a crash in the middle of a write leaves behind, are skipped.
+size_t kush_hist_next(const char *map, size_t size, size_t pos) {
+    pos = (pos + 3) & ~(size_t) 3;
+    while (pos < size && !kush_hist_valid(map, size, pos)) pos += 4;
+
+    return pos < size ? pos : size;
+}
+
+// Hash table entry of the compaction, for finding duplicates
+typedef struct kush_hist_seen {
+    const char *text; // NULL for an empty slot
+    uint32_t len;
+    uint32_t check;
+} kush_hist_seen;
+
+// Compacts the history file: keeps the last occurrence of every command, up to KUSH_HIST_MAX entries and half of
+// KUSH_HIST_COMPACT_SIZE bytes, and replaces the file with the result. Runs in a thread of its own. Gives up if any
+// other session is writing to the file or compacting it right now, one of the next sessions will try again.
+void *kush_hist_compact(void *arg) {
+    char tmp_path[PATH_MAX + 32];
+    const char *map;
+    struct stat st;
+    size_t *records = NULL; // Offsets of all complete records
+    size_t num_records = 0;
+    size_t records_size = 0;
+    kush_hist_seen *seen;
+    size_t seen_size = 16;
+    char *keep; // Boolean value for every record telling if it stays
+    size_t kept = 0;
+    size_t kept_bytes = 0;
+    FILE *out;
+    int fd_out;
+    int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+    (void) arg; // Suppress 'unused parameter' warning
+
+    if (fd < 0) return NULL;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0 || st.st_size == 0 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    for (size_t pos = kush_hist_next(map, st.st_size, 0); pos < (size_t) st.st_size;) {
+        kush_hist_head head;
+
+        if (num_records == records_size) {
+            records_size = records_size ? 2 * records_size : 1024;
+            records = realloc(records, records_size * sizeof(size_t)); // NOLINT(bugprone-suspicious-realloc-usage)
+            if (!records) goto fail;
+        }
+        records[num_records++] = pos;
+        memcpy(&head, map + pos, sizeof(head));
+        pos = kush_hist_next(map, st.st_size, pos + kush_hist_record_size(head.len));
+    }
+
+    while (seen_size < 2 * num_records) seen_size *= 2;
+    seen = calloc(seen_size, sizeof(kush_hist_seen));
+    keep = calloc(num_records + 1, 1);
+    if (!seen || !keep) {
+        free(seen);
+        free(keep);
+        goto fail;
+    }
+
+    // Newest first, so the last occurrence of a command is the one that stays
+    for (size_t i = num_records; i-- > 0 && kept < KUSH_HIST_MAX;) {
+        kush_hist_head head;
+        const char *text = map + records[i] + sizeof(head);
+        kush_hist_tail tail;
+        size_t slot;
+
+        memcpy(&head, map + records[i], sizeof(head));
+        memcpy(&tail, text - sizeof(head) + kush_hist_record_size(head.len) - sizeof(tail), sizeof(tail));
+        if (kept_bytes + tail.size > KUSH_HIST_COMPACT_SIZE / 2) break;
+
+        slot = tail.check & (seen_size - 1);
+        while (seen[slot].text && (seen[slot].check != tail.check || seen[slot].len != head.len ||
+                                   memcmp(seen[slot].text, text, head.len) != 0)) {
+            slot = (slot + 1) & (seen_size - 1);
+        }
+        if (seen[slot].text) continue; // A newer entry has the same command
+
+        seen[slot] = (kush_hist_seen) {text, head.len, tail.check};
+        keep[i] = 1;
+        kept++;
+        kept_bytes += tail.size;
+    }
+    free(seen);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", hist_path, (int) getpid());
+    fd_out = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    out = fd_out >= 0 ? fdopen(fd_out, "w") : NULL;
+    if (out) {
+        int failed = 0;
+
+        for (size_t i = 0; i < num_records; i++) {
+            kush_hist_head head;
+
+            if (!keep[i]) continue;
+            memcpy(&head, map + records[i], sizeof(head));
+            fwrite(map + records[i], kush_hist_record_size(head.len), 1, out);
+        }
+        failed = fflush(out) != 0 || fsync(fileno(out)) != 0;
+        if (fclose(out) != 0 || failed || rename(tmp_path, hist_path) != 0) unlink(tmp_path);
+    }
+    free(keep);
+
+fail:
+    free(records);
+    munmap((void *) map, st.st_size);
+    close(fd); // Releases the lock, sessions waiting to append find the new file now
+    return NULL;
+}
+
+// Starts a compaction of the history file in the background, unless this session has started one already
+void kush_hist_compact_start() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    if (hist_compacting || !hist_path[0]) return;
+    hist_compacting = 1;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, &kush_hist_compact, NULL) == 0) pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Returns the offset of the record that ends at offset end of the mapped history, or -1 if there is none. The walk
+// back stops at a damaged record, which makes the history start a compaction to repair the file.
+ssize_t kush_hist_prev(size_t end) {
+    kush_hist_tail tail;
+
+    if (end < sizeof(kush_hist_head) + sizeof(tail)) return -1;
+    memcpy(&tail, hist_map + end - sizeof(tail), sizeof(tail));
+    if (tail.size <= end && kush_hist_valid(hist_map, end, end - tail.size)) return (ssize_t) (end - tail.size);
+
+    kush_hist_compact_start();
+    return -1;
+}
+
+// Returns the text of the record at offset start of the mapped history and sets *len to its length. The text isn't
+// terminated.
+const char *kush_hist_text(size_t start, size_t *len) {
+    kush_hist_head head;
+
+    memcpy(&head, hist_map + start, sizeof(head));
+    *len = head.len;
+
+    return hist_map + start + sizeof(head);
+}
+
+// Returns the offset of the history entry before (older is true) or after the one at offset start, where -1 stands
+// for the end of the history. Returns -1 if there is no such entry.
+ssize_t kush_hist_adjacent(ssize_t start, int older) {
+    size_t len;
+    size_t next;
+
+    if (older) return kush_hist_prev(start < 0 ? hist_size : (size_t) start);
+    if (start < 0) return -1;
+
+    kush_hist_text(start, &len);
+    next = kush_hist_next(hist_map, hist_size, start + kush_hist_record_size(len));
+    return next < hist_size ? (ssize_t) next : -1;
+}
+
+// Opens the history file for appending, creating it if needed. Returns -1 on failure.
+int kush_hist_open() {
+    if (hist_fd >= 0) close(hist_fd);
+    hist_fd = open(hist_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    return hist_fd;
+}
+
+// Maps the current contents of the history file, reopening it first if a compaction has replaced it. The mapping
+// only has to change if the file has grown or been replaced since the last time.
+void kush_hist_refresh() {
+    struct stat st;
+
+    if (hist_fd < 0) return;
+    if (fstat(hist_fd, &st) == 0 && st.st_nlink == 0 && (kush_hist_open() < 0 || fstat(hist_fd, &st) != 0)) return;
+    if (st.st_ino == hist_ino && (size_t) st.st_size == hist_size) return;
+
+    if (hist_map) munmap((void *) hist_map, hist_size);
+    hist_map = NULL;
+    hist_size = 0;
+    hist_ino = st.st_ino;
+    if (st.st_size == 0) return;
+
+    hist_map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, hist_fd, 0);
+    if (hist_map == MAP_FAILED) hist_map = NULL;
+    else hist_size = st.st_size;
+}
+
+// Writes the records waiting in hist_pending to the history file. Unless wait is true, a compaction running right
+// now doesn't hold up the shell: the records keep waiting for the next call.
+void kush_hist_flush(int wait) {
+    struct stat st;
+
+    if (hist_fd < 0 || hist_pending_len == 0) return;
+
+    // A compaction holds the exclusive lock until the new file is in place, after that the old one has no links
+    while (flock(hist_fd, LOCK_SH | (wait ? 0 : LOCK_NB)) == 0) {
+        if (fstat(hist_fd, &st) == 0 && st.st_nlink == 0) {
+            if (kush_hist_open() < 0) return;
+            continue;
+        }
+        // A single write, so the records can't interleave with the ones of other sessions
+        write(hist_fd, hist_pending, hist_pending_len);
+        flock(hist_fd, LOCK_UN);
+        hist_pending_len = 0;
+        return;
+    }
+}
+
+// Appends the command text of len bytes to the history. Blank commands and repeats of the last entry are left out.
+void kush_hist_add(const char *text, size_t len) {
+    kush_hist_head head = {.magic = KUSH_HIST_MAGIC, .len = len, .time = time(NULL)};
+    kush_hist_tail tail = {.check = kush_hist_check(text, len), .size = kush_hist_record_size(len)};
+    ssize_t last;
+
+    if (hist_fd < 0 || len == 0 || len > UINT32_MAX / 2 || text[strspn(text, " \t\n")] == '\0') return;
+
+    kush_hist_refresh();
+    if (hist_pending_len == 0 && (last = kush_hist_prev(hist_size)) >= 0) {
+        size_t last_len;
+        const char *last_text = kush_hist_text(last, &last_len);
+
+        if (last_len == len && memcmp(last_text, text, len) == 0) return;
+    }
+
+    if (hist_pending_len + tail.size > hist_pending_size) {
+        hist_pending_size = 2 * (hist_pending_len + tail.size);
+        hist_pending = realloc(hist_pending, hist_pending_size); // NOLINT(bugprone-suspicious-realloc-usage)
+        if (!hist_pending) {
+            fprintf(stderr, "kush: History allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(hist_pending + hist_pending_len, &head, sizeof(head));
+    memcpy(hist_pending + hist_pending_len + sizeof(head), text, len);
+    memset(hist_pending + hist_pending_len + sizeof(head) + len, 0, tail.size - sizeof(head) - sizeof(tail) - len);
+    memcpy(hist_pending + hist_pending_len + tail.size - sizeof(tail), &tail, sizeof(tail));
+    hist_pending_len += tail.size;
+
+    kush_hist_flush(0);
+}
+
+// Number of posting lists of the history index, has to be a power of two
+#define KUSH_INDEX_BUCKETS 65536
+// Number of the newest candidates of a search that are checked before the other trigram lists are decoded
+#define KUSH_INDEX_PROBE 256
+
+// Entries of the history containing one of the trigrams that hash to a bucket of the index. The entry numbers are
+// stored in ascending order as varint encoded differences, which keeps the index of a million entries compact.
+typedef struct kush_index_list {
+    unsigned char *data;
+    uint32_t len;
+    uint32_t size;
+    uint32_t count; // Number of entries in the list
+    uint32_t last; // Last entry added to the list
+} kush_index_list;
+
+// Trigram index over the entries of the history file, for finding the entries that contain a string without
+// looking at all of them. Trigrams are hashed into a fixed number of buckets, so a lookup yields candidates that
+// still have to be checked, but the index never needs more than one list per bucket.
+typedef struct kush_index {
+    ino_t ino; // History file the index is for
+    size_t end; // Offset in the history file up to which entries have been indexed
+    size_t *entries; // Offsets of the indexed entries, in the order of the file
+    uint32_t num_entries;
+    uint32_t entries_size;
+    kush_index_list lists[KUSH_INDEX_BUCKETS];
+} kush_index;
+
+kush_index *hist_index = NULL; // Index of the history file, NULL until the first one has been built
+kush_index *hist_index_built = NULL; // Index handed over by the thread building it
+int hist_index_building = 0; // Boolean value telling if a thread is building an index
+pthread_mutex_t hist_index_lock = PTHREAD_MUTEX_INITIALIZER; // Protects hist_index_built and hist_index_building
+
+// Returns the bucket of the trigram at str
+uint32_t kush_index_bucket(const char *str) {
+    uint32_t trigram = (unsigned char) str[0] << 16 | (unsigned char) str[1] << 8 | (unsigned char) str[2];
+
+    return (trigram * 2654435761u) >> 16 & (KUSH_INDEX_BUCKETS - 1);
+}
+
+// Adds the history record at offset start of map to the index
+void kush_index_add(kush_index *index, const char *map, size_t start) {
+    kush_hist_head head;
+    const char *text = map + start + sizeof(head);
+    uint32_t id = index->num_entries;
+
+    if (index->num_entries == index->entries_size) {
+        index->entries_size = index->entries_size ? 2 * index->entries_size : 1024;
+        index->entries = realloc(index->entries, index->entries_size * sizeof(size_t)); // NOLINT
+        if (!index->entries) {
+            fprintf(stderr, "kush: History index allocation error");
+            exit(EXIT_FAILURE);
+        }
+    }
+    index->entries[index->num_entries++] = start;
+
+    memcpy(&head, map + start, sizeof(head));
+    for (uint32_t i = 0; i + 3 <= head.len; i++) {
+        kush_index_list *list = &index->lists[kush_index_bucket(text + i)];
+        uint32_t delta = id - list->last;
+
+        if (list->count > 0 && delta == 0) continue; // The entry has another trigram in this bucket
+        if (list->len + 5 > list->size) {
+            list->size = list->size ? 2 * list->size : 16;
+            list->data = realloc(list->data, list->size); // NOLINT(bugprone-suspicious-realloc-usage)
+            if (!list->data) {
+                fprintf(stderr, "kush: History index allocation error");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (; delta >= 0x80; delta >>= 7) list->data[list->len++] = (unsigned char) (delta | 0x80);
+        list->data[list->len++] = (unsigned char) delta;
+        list->last = id;
+        list->count++;
+    }
+}
+
+// Adds the records of the size bytes at map that haven't been indexed yet
+void kush_index_update(kush_index *index, const char *map, size_t size) {
+    for (size_t pos = kush_hist_next(map, size, index->end); pos < size;) {
+        kush_hist_head head;
+
+        kush_index_add(index, map, pos);
+        memcpy(&head, map + pos, sizeof(head));
+        pos = kush_hist_next(map, size, pos + kush_hist_record_size(head.len));
+    }
+    index->end = size;
+}
+
+// Frees an index
+void kush_index_free(kush_index *index) {
+    if (!index) return;
+    for (int i = 0; i < KUSH_INDEX_BUCKETS; i++) free(index->lists[i].data);
+    free(index->entries);
+    free(index);
+}
+
+// Builds an index of the history file in a thread of its own, with a mapping of its own, and hands it over
+// through hist_index_built
+void *kush_index_build(void *arg) {
+    kush_index *index = calloc(1, sizeof(kush_index));
+    int fd = open(hist_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char *map;
+    (void) arg; // Suppress 'unused parameter' warning
+
+    if (index && fd >= 0 && fstat(fd, &st) == 0) {
+        index->ino = st.st_ino;
+        map = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            kush_index_update(index, map, st.st_size);
+            munmap((void *) map, st.st_size);
+        }
+    }
+    if (fd >= 0) close(fd);
+
+    pthread_mutex_lock(&hist_index_lock);
+    kush_index_free(hist_index_built);
+    hist_index_built = index;
+    hist_index_building = 0;
+    pthread_mutex_unlock(&hist_index_lock);
+
+    return NULL;
+}
+
+// Starts building an index of the history file in the background, unless that is happening already
+void kush_index_build_start() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    pthread_mutex_lock(&hist_index_lock);
+    if (hist_index_building) {
+        pthread_mutex_unlock(&hist_index_lock);
+        return;
+    }
+    hist_index_building = 1;
+    pthread_mutex_unlock(&hist_index_lock);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, &kush_index_build, NULL) == 0) pthread_detach(thread);
+    else hist_index_building = 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Brings the history index up to date with the mapped history file. Takes over an index the background thread
+// has finished and adds the entries appended since. If the file has been replaced, a new index is started and
+// there is none until it's done.
+void kush_index_sync() {
+    pthread_mutex_lock(&hist_index_lock);
+    if (hist_index_built) {
+        kush_index_free(hist_index);
+        hist_index = hist_index_built;
+        hist_index_built = NULL;
+    }
+    pthread_mutex_unlock(&hist_index_lock);
+
+    if (hist_index && (hist_index->ino != hist_ino || hist_index->end > hist_size)) {
+        kush_index_free(hist_index);
+        hist_index = NULL;
+    }
+    if (!hist_index) {
+        if (hist_size > 0) kush_index_build_start();
+        return;
+    }
+    kush_index_update(hist_index, hist_map, hist_size);
+}
+
+// Decodes a posting list into ids, which needs room for list->count entries
+void kush_index_decode(const kush_index_list *list, uint32_t *ids) {
+    uint32_t id = 0;
+    uint32_t pos = 0;
+
+    for (uint32_t i = 0; i < list->count; i++) {
+        uint32_t delta = 0;
+        int shift = 0;
+
+        while (list->data[pos] & 0x80) {
+            delta |= (uint32_t) (list->data[pos++] & 0x7f) << shift;
+            shift += 7;
+        }
+        delta |= (uint32_t) list->data[pos++] << shift;
+        id += delta;
+        ids[i] = id;
+    }
+}
+
+// Returns true if the history entry at offset start contains query (of length len)
+int kush_hist_matches(size_t start, const char *query, size_t len) {
+    size_t text_len;
+    const char *text = kush_hist_text(start, &text_len);
+
+    return memmem(text, text_len, query, len) != NULL;
+}
+
+// Returns the offset of the newest history entry before offset before that contains query (of length len), or -1 if
+// there is none. Entries the index doesn't cover yet are searched one by one, and so are all entries for queries
+// shorter than a trigram.
+ssize_t kush_hist_search(const char *query, size_t len, size_t before) {
+    size_t indexed; // Entries before this offset are found through the index
+    ssize_t pos;
+    uint32_t *candidates;
+    uint32_t num_candidates = 0;
+    uint32_t *ids;
+    const kush_index_list *lists[64]; // Enough trigrams to narrow down any query
+    size_t num_lists = 0;
+    ssize_t found = -1;
+
+    kush_hist_refresh();
+    kush_index_sync();
+    if (before > hist_size) before = hist_size;
+    indexed = hist_index && len >= 3 ? hist_index->end : 0;
+
+    for (pos = (ssize_t) before; pos > (ssize_t) indexed && (pos = kush_hist_prev(pos)) >= 0;) {
+        if (kush_hist_matches(pos, query, len)) return pos;
+    }
+    if (indexed == 0) return -1;
+    if (before < indexed) indexed = before;
+
+    // The lists of all trigrams of the query, the shortest first
+    for (size_t i = 0; i + 3 <= len && num_lists < sizeof(lists) / sizeof(lists[0]); i++) {
+        const kush_index_list *list = &hist_index->lists[kush_index_bucket(query + i)];
+        size_t j = num_lists++;
+
+        if (list->count == 0) return -1;
+        for (; j > 0 && lists[j - 1]->count > list->count; j--) lists[j] = lists[j - 1];
+        lists[j] = list;
+    }
+
+    // A query most entries contain is found sooner by looking at the newest entries than by decoding the lists
+    if (lists[0]->count > hist_index->num_entries / 16) {
+        for (pos = (ssize_t) indexed; (pos = kush_hist_prev(pos)) >= 0;) {
+            if (kush_hist_matches(pos, query, len)) return pos;
+        }
+        return -1;
+    }
+
+    candidates = malloc((lists[0]->count + lists[num_lists - 1]->count) * sizeof(uint32_t));
+    if (!candidates) {
+        fprintf(stderr, "kush: History index allocation error");
+        exit(EXIT_FAILURE);
+    }
+    ids = candidates + lists[0]->count;
+    kush_index_decode(lists[0], candidates);
+    num_candidates = lists[0]->count;
+
+    // The match is often among the newest candidates, then decoding the other lists would cost more than it saves.
+    // The candidates checked here don't match, so they are left out of the intersection.
+    for (uint32_t probed = 0; probed < KUSH_INDEX_PROBE && num_candidates > 0; probed++) {
+        size_t start = hist_index->entries[candidates[--num_candidates]];
+
+        if (start < indexed && kush_hist_matches(start, query, len)) {
+            free(candidates);
+            return (ssize_t) start;
+        }
+    }
+
+    // Intersect with the other lists, as long as decoding them is cheaper than checking the candidates
+    for (size_t i = 1; i < num_lists && num_candidates > 0 && lists[i]->count / 8 <= num_candidates; i++) {
+        uint32_t kept = 0;
+
+        if (lists[i] == lists[i - 1]) continue;
+        kush_index_decode(lists[i], ids);
+        for (uint32_t a = 0, b = 0; a < num_candidates && b < lists[i]->count;) {
+            if (candidates[a] < ids[b]) a++;
+            else if (candidates[a] > ids[b]) b++;
+            else {
+                candidates[kept++] = candidates[a++];
+                b++;
+            }
+        }
+        num_candidates = kept;
+    }
+
+    // Newest first
+    for (uint32_t i = num_candidates; i-- > 0;) {
+        size_t start = hist_index->entries[candidates[i]];
+
+        if (start < indexed && kush_hist_matches(start, query, len)) {
+            found = (ssize_t) start;
+            break;
+        }
+    }
+    free(candidates);
+
+    return found;
+}
+
+// Opens and maps the history file, which is $KUSH_HISTFILE or ~/.kush_history. A file that has grown large
+// is compacted in the background.
+void kush_hist_init() {
+    const char *file = kush_var_get("KUSH_HISTFILE");
+    const char *home = kush_var_get("HOME");
+
+    if (file && *file) snprintf(hist_path, sizeof(hist_path), "%s", file);
+    else if (home && *home) snprintf(hist_path, sizeof(hist_path), "%s/.kush_history", home);
+    else return;
+
+    if (kush_hist_open() < 0) {
+        hist_path[0] = '\0';
+        return;
+    }
+    kush_hist_refresh();
+    if (hist_size > KUSH_HIST_COMPACT_SIZE) kush_hist_compact_start();
+    else if (hist_size > 0) kush_index_build_start(); // A compaction replaces the file, the index is built after it
+}
+
+// Lists the history, or only its last n entries with 'history n'
+int kush_history(char **args) {
+    size_t num_entries = 0;
+    size_t first = 0; // Number of the first entry to list
+    long num = args[1] ? strtol(args[1], NULL, 10) : -1;
+
+    if (num == 0 && args[1] && strcmp(args[1], "0") != 0) {
+        fprintf(stderr, "kush: history: %s: numeric argument required\n", args[1]);
+        last_status = 1;
+        return 0;
+    }
+
+    kush_hist_refresh();
+    for (size_t pos = kush_hist_next(hist_map, hist_size, 0); pos < hist_size; num_entries++) {
+        kush_hist_head head;
+
+        memcpy(&head, hist_map + pos, sizeof(head));
+        pos = kush_hist_next(hist_map, hist_size, pos + kush_hist_record_size(head.len));
+    }
+    if (num >= 0 && (size_t) num < num_entries) first = num_entries - num;
+
+    num_entries = 0;
+    for (size_t pos = kush_hist_next(hist_map, hist_size, 0); pos < hist_size; num_entries++) {
+        size_t len;
+        const char *text = kush_hist_text(pos, &len);
+
+        if (num_entries >= first) printf("%5zu  %.*s\n", num_entries + 1, (int) len, text);
+        pos = kush_hist_next(hist_map, hist_size, pos + kush_hist_record_size(len));
+    }
+
+    return 0;
+}
+// -----------------------------------------------------------------------------------------
+
+// Completion
+// -----------------------------------------------------------------------------------------
+// Tab completes the word at the cursor. Command names come from a sorted table of the built-ins and the
+// executables in the PATH directories. A worker thread builds the table at startup and keeps it current: it
+// watches the directories with inotify and only lists a directory again once something in it has changed. A lookup
+// is a binary search for the first name with the prefix. Since the table is sorted byte-wise, the part all names
+// with the prefix have in common is the part the first and the last of them share. Paths are completed from
+// listings of their directory, which are cached until the directory is modified.
+
+// Number of directories whose listings are cached
+#define KUSH_LISTING_CACHE_SIZE 16
+// Maximum number of candidates listed after a second Tab
+#define KUSH_COMPL_LIST_MAX 200
+// Time in milliseconds the worker waits for more changes to the PATH directories before it lists them again
+#define KUSH_COMPL_SETTLE_MS 50
+// Changes to a PATH directory the worker is told about
+#define KUSH_COMPL_WATCH (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | \
+                          IN_MOVE_SELF | IN_ONLYDIR)
+
+// A list of names stored in one block of memory
+typedef struct kush_names {
+    char *pool; // The names, each terminated with '\0'
+    size_t pool_len;
+    size_t pool_size;
+    uint32_t *names; // Offsets of the names in pool
+    size_t num;
+    size_t size;
+} kush_names;
+
+// A PATH directory watched by the completion worker
+typedef struct kush_compl_dir {
+    char *dir;
+    int wd; // inotify watch of the directory, -1 if it isn't watched
+    int dirty; // Boolean value telling if the directory has to be listed again
+    kush_names names; // Executables in the directory
+} kush_compl_dir;
+
+// Cached listing of a directory
+typedef struct kush_listing {
+    char *dir; // The directory as it was given, NULL if the entry is unused
+    ino_t ino;
+    struct timespec mtime; // Modification time of the directory when it was listed
+    kush_names names; // Sorted names in the directory, the names of directories end with '/'
+    unsigned long used; // Value of listing_clock when the entry was last used
+} kush_listing;
+
+// Candidates for the completion of a word
+typedef struct kush_compl {
+    size_t prefix; // Length of the end of the word the candidates start with
+    const char *first; // The first candidate, the only one if num is 1
+    size_t common; // Length of the prefix all candidates share
+    size_t num;
+    const char *list[KUSH_COMPL_LIST_MAX]; // Candidates to list, the first KUSH_COMPL_LIST_MAX of them
+    size_t num_listed;
+} kush_compl;
+
+kush_names *compl_table = NULL; // Command names in use, only touched by the main thread
+kush_names *compl_built = NULL; // Command names handed over by the worker
+char *compl_request = NULL; // PATH the worker has been asked to build a table for
+char *compl_requested = NULL; // Last PATH requested, only touched by the main thread
+int compl_wake_fd = -1; // eventfd that wakes the worker up for a request
+pthread_mutex_t compl_lock = PTHREAD_MUTEX_INITIALIZER; // Protects compl_built and compl_request
+kush_listing listing_cache[KUSH_LISTING_CACHE_SIZE];
+unsigned long listing_clock = 0; // Counter for finding the least recently used listing
+
+// Adds name (of length len) to a list, followed by a '/' if slash is true
+void kush_names_add(kush_names *list, const char *name, size_t len, int slash) {
+    if (list->pool_len + len + 2 > list->pool_size) {
+        list->pool_size = list->pool_size ? 2 * list->pool_size : 4096;
+        if (list->pool_size < list->pool_len + len + 2) list->pool_size = list->pool_len + len + 2;
+        list->pool = realloc(list->pool, list->pool_size); // NOLINT(bugprone-suspicious-realloc-usage)
+    }
+    if (list->num == list->size) {
+        list->size = list->size ? 2 * list->size : 256;
+        list->names = realloc(list->names, list->size * sizeof(uint32_t)); // NOLINT
+    }
+    if (!list->pool || !list->names) {
+        fprintf(stderr, "kush: Completion allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    list->names[list->num++] = list->pool_len;
+    memcpy(list->pool + list->pool_len, name, len);
+    list->pool_len += len;
+    if (slash) list->pool[list->pool_len++] = '/';
+    list->pool[list->pool_len++] = '\0';
+}
+
+// Frees the memory of a list and empties it
+void kush_names_free(kush_names *list) {
+    free(list->pool);
+    free(list->names);
+    memset(list, 0, sizeof(kush_names));
+}
+
+// Compares two names of the pool given as arg by their offsets
+int kush_names_cmp(const void *a, const void *b, void *arg) {
+    return strcmp((char *) arg + *(const uint32_t *) a, (char *) arg + *(const uint32_t *) b);
+}
+
+// Sorts a list byte-wise and drops duplicate names
+void kush_names_sort(kush_names *list) {
+    size_t num = 0;
+
+    qsort_r(list->names, list->num, sizeof(uint32_t), &kush_names_cmp, list->pool);
+    for (size_t i = 0; i < list->num; i++) {
+        if (num == 0 || strcmp(list->pool + list->names[i], list->pool + list->names[num - 1]) != 0) {
+            list->names[num++] = list->names[i];
+        }
+    }
+    list->num = num;
+}
+
+// Returns the index of the first name of a sorted list that isn't less than prefix (of length len), and sets
+// *num to the number of names from there on that start with prefix
+size_t kush_names_find(const kush_names *list, const char *prefix, size_t len, size_t *num) {
+    size_t low = 0;
+    size_t high = list->num;
+    size_t end;
+
+    while (low < high) { // Binary search for the first name with the prefix
+        size_t mid = low + (high - low) / 2;
+
+        if (strncmp(list->pool + list->names[mid], prefix, len) < 0) low = mid + 1;
+        else high = mid;
+    }
+    // And for the first one after them
+    for (high = list->num, end = low; end < high;) {
+        size_t mid = end + (high - end) / 2;
+
+        if (strncmp(list->pool + list->names[mid], prefix, len) == 0) end = mid + 1;
+        else high = mid;
+    }
+
+    *num = end - low;
+    return low;
+}
+
+// Lists the executables in a PATH directory
+void kush_compl_scan(kush_compl_dir *dir) {
+    DIR *stream = opendir(dir->dir);
+    struct dirent *entry;
+
+    dir->names.num = 0;
+    dir->names.pool_len = 0;
+    dir->dirty = 0;
+    if (!stream) return;
+
+    while ((entry = readdir(stream))) {
+        struct stat st;
+
+        if (entry->d_type == DT_DIR) continue;
+        if (entry->d_type != DT_REG &&
+            (fstatat(dirfd(stream), entry->d_name, &st, 0) != 0 || S_ISDIR(st.st_mode))) continue;
+        if (faccessat(dirfd(stream), entry->d_name, X_OK, AT_EACCESS) != 0) continue;
+        kush_names_add(&dir->names, entry->d_name, strlen(entry->d_name), 0);
+    }
+    closedir(stream);
+}
+
+// Replaces the watched directories with the ones of path. Relative directories are left out, as what they
+// contain depends on the working directory.
+void kush_compl_set_path(kush_compl_dir **dirs, size_t *num_dirs, const char *path, int inotify_fd) {
+    const char *start = path;
+
+    for (size_t i = 0; i < *num_dirs; i++) {
+        if ((*dirs)[i].wd >= 0) inotify_rm_watch(inotify_fd, (*dirs)[i].wd);
+        free((*dirs)[i].dir);
+        kush_names_free(&(*dirs)[i].names);
+    }
+    *num_dirs = 0;
+
+    // Every ':' adds one more directory
+    *dirs = realloc(*dirs, (strlen(path) + 1) * sizeof(kush_compl_dir)); // NOLINT
+    if (!*dirs) {
+        fprintf(stderr, "kush: Completion allocation error");
+        exit(EXIT_FAILURE);
+    }
+
+    while (1) {
+        const char *end = strchrnul(start, ':');
+
+        if (*start == '/') {
+            kush_compl_dir *dir = &(*dirs)[(*num_dirs)++];
+
+            memset(dir, 0, sizeof(kush_compl_dir));
+            dir->dir = strndup(start, end - start);
+            if (!dir->dir) {
+                fprintf(stderr, "kush: Completion allocation error");
+                exit(EXIT_FAILURE);
+            }
+            dir->wd = inotify_fd >= 0 ? inotify_add_watch(inotify_fd, dir->dir, KUSH_COMPL_WATCH) : -1;
+            dir->dirty = 1;
+        }
+
+        if (*end == '\0') break;
+        start = end + 1;
+    }
+}
+
+// Merges the executables of all directories and the built-ins into one sorted table and hands it over to the
+// main thread
+void kush_compl_publish(kush_compl_dir *dirs, size_t num_dirs) {
+    kush_names *table = calloc(1, sizeof(kush_names));
+
+    if (!table) {
+        fprintf(stderr, "kush: Completion allocation error");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < KUSH_NUM_BUILTINS; i++) kush_names_add(table, builtins[i].name, strlen(builtins[i].name), 0);
+    for (size_t i = 0; i < num_dirs; i++) {
+        for (size_t j = 0; j < dirs[i].names.num; j++) {
+            const char *name = dirs[i].names.pool + dirs[i].names.names[j];
+
+            kush_names_add(table, name, strlen(name), 0);
+        }
+    }
+    kush_names_sort(table);
+
+    pthread_mutex_lock(&compl_lock);
+    if (compl_built) kush_names_free(compl_built);
+    free(compl_built);
+    compl_built = table;
+    pthread_mutex_unlock(&compl_lock);
+}
+
+// Main function of the completion worker. Waits for a new PATH or for changes to its directories and builds the
+// table of command names again after them.
+void *kush_compl_worker(void *arg) {
+    int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    struct pollfd fds[2] = {{.fd = compl_wake_fd, .events = POLLIN}, {.fd = inotify_fd, .events = POLLIN}};
+    _Alignas(struct inotify_event) char buff[4096];
+    kush_compl_dir *dirs = NULL;
+    size_t num_dirs = 0;
+    int timeout = -1; // Time to wait for more changes, -1 while nothing has changed
+    (void) arg; // Suppress 'unused parameter' warning
+
+    while (1) {
+        int ready = poll(fds, inotify_fd >= 0 ? 2 : 1, timeout);
+        uint64_t count;
+        ssize_t len;
+
+        if (ready < 0) continue; // Interrupted
+        if (ready == 0) { // The directories have settled down, so list the changed ones again
+            for (size_t i = 0; i < num_dirs; i++) {
+                if (dirs[i].dirty) kush_compl_scan(&dirs[i]);
+            }
+            kush_compl_publish(dirs, num_dirs);
+            timeout = -1;
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN && read(compl_wake_fd, &count, sizeof(count)) == sizeof(count)) {
+            char *path;
+
+            pthread_mutex_lock(&compl_lock);
+            path = compl_request;
+            compl_request = NULL;
+            pthread_mutex_unlock(&compl_lock);
+            if (path) {
+                kush_compl_set_path(&dirs, &num_dirs, path, inotify_fd);
+                free(path);
+                timeout = 0; // A new PATH is listed right away
+            }
+        }
+
+        while (inotify_fd >= 0 && (len = read(inotify_fd, buff, sizeof(buff))) > 0) {
+            const struct inotify_event *event;
+
+            for (char *pos = buff; pos < buff + len; pos += sizeof(struct inotify_event) + event->len) {
+                event = (const struct inotify_event *) pos;
+                for (size_t i = 0; i < num_dirs; i++) {
+                    // The same directory may be in PATH more than once, and then it has one watch
+                    if (dirs[i].wd != event->wd && !(event->mask & IN_Q_OVERFLOW)) continue;
+                    dirs[i].dirty = 1;
+                    if (event->mask & IN_IGNORED) dirs[i].wd = -1; // The directory is gone
+                }
+            }
+            if (timeout < 0) timeout = KUSH_COMPL_SETTLE_MS;
+        }
+    }
+
+    return NULL;
+}
+
+// Takes over a table of command names the worker has finished, and asks for a new one if PATH has changed
+void kush_compl_sync() {
+    const char *path = kush_var_get("PATH");
+
+    if (!path) path = KUSH_DEFAULT_PATH;
+
+    pthread_mutex_lock(&compl_lock);
+    if (compl_built) {
+        if (compl_table) kush_names_free(compl_table);
+        free(compl_table);
+        compl_table = compl_built;
+        compl_built = NULL;
+    }
+    pthread_mutex_unlock(&compl_lock);
+
+    if (compl_wake_fd < 0 || (compl_requested && strcmp(compl_requested, path) == 0)) return;
+
+    free(compl_requested);
+    compl_requested = kush_strdup(path);
+    pthread_mutex_lock(&compl_lock);
+    free(compl_request);
+    compl_request = kush_strdup(path);
+    pthread_mutex_unlock(&compl_lock);
+    eventfd_write(compl_wake_fd, 1);
+}
+
+// Starts the completion worker, which builds the first table of command names right away
+void kush_compl_init() {
+    pthread_t thread;
+    sigset_t all, old;
+
+    compl_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (compl_wake_fd < 0) return; // Commands are completed from the built-ins only
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&thread, NULL, &kush_compl_worker, NULL) == 0) pthread_detach(thread);
+    else {
+        close(compl_wake_fd);
+        compl_wake_fd = -1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    kush_compl_sync();
+}
+
+// Returns the listing of dir, from the cache if dir hasn't been modified since it was listed. Returns NULL if dir
+// can't be listed.
+kush_listing *kush_listing_get(const char *dir) {
+    kush_listing *listing = &listing_cache[0];
+    struct stat st;
+    DIR *stream;
+    struct dirent *entry;
+
+    if (stat(dir, &st) != 0) return NULL;
+
+    for (int i = 0; i < KUSH_LISTING_CACHE_SIZE; i++) {
+        if (listing_cache[i].dir && strcmp(listing_cache[i].dir, dir) == 0) {
+            listing = &listing_cache[i];
+            break;
+        }
+        if (!listing_cache[i].dir || listing_cache[i].used < listing->used) listing = &listing_cache[i];
+    }
+    listing->used = ++listing_clock;
+    if (listing->dir && strcmp(listing->dir, dir) == 0 && listing->ino == st.st_ino &&
+        listing->mtime.tv_sec == st.st_mtim.tv_sec && listing->mtime.tv_nsec == st.st_mtim.tv_nsec) return listing;
+
+    stream = opendir(dir);
+    if (!stream) return NULL;
+
+    free(listing->dir);
+    listing->dir = kush_strdup(dir);
+    listing->ino = st.st_ino;
+    listing->mtime = st.st_mtim;
+    listing->names.num = 0;
+    listing->names.pool_len = 0;
+    while ((entry = readdir(stream))) {
+        int is_dir = entry->d_type == DT_DIR;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) { // Links to directories count as directories
+            is_dir = fstatat(dirfd(stream), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        kush_names_add(&listing->names, entry->d_name, strlen(entry->d_name), is_dir);
+    }
+    closedir(stream);
+    kush_names_sort(&listing->names);
+
+    return listing;
+}
+
+// Adds the count names of a sorted list starting at index first to the candidates
+void kush_compl_add_range(kush_compl *compl, const kush_names *list, size_t first, size_t count) {
+    const char *last;
+    size_t common = 0;
+
+    if (count == 0) return;
+    if (compl->num == 0) {
+        compl->first = list->pool + list->names[first];
+        compl->common = strlen(compl->first);
+    }
+
+    // All names of the range share what its first and last name share
+    last = list->pool + list->names[first + count - 1];
+    while (common < compl->common && compl->first[common] == list->pool[list->names[first] + common] &&
+           compl->first[common] == last[common]) common++;
+    compl->common = common;
+    compl->num += count;
+
+    for (size_t i = first; i < first + count && compl->num_listed < KUSH_COMPL_LIST_MAX; i++) {
+        compl->list[compl->num_listed++] = list->pool + list->names[i];
+    }
+}
+
+// Adds a single name to the candidates
+void kush_compl_add(kush_compl *compl, const char *name) {
+    kush_names list = {.pool = (char *) name, .names = (uint32_t[]) {0}, .num = 1};
+
+    kush_compl_add_range(compl, &list, 0, 1);
+}
+
+// Finds the commands starting with prefix (of length len): built-ins, functions and executables in PATH
+void kush_compl_commands(kush_compl *compl, const char *prefix, size_t len) {
+    size_t num;
+    size_t first;
+
+    compl->prefix = len;
+    kush_compl_sync();
+    if (compl_table) {
+        first = kush_names_find(compl_table, prefix, len, &num);
+        kush_compl_add_range(compl, compl_table, first, num);
+    } else { // The worker hasn't finished the first table yet
+        for (int i = 0; i < KUSH_NUM_BUILTINS; i++) {
+            if (strncmp(builtins[i].name, prefix, len) == 0) kush_compl_add(compl, builtins[i].name);
+        }
+    }
+
+    for (size_t i = 0; i < var_size; i++) {
+        if (var_table[i].func && var_table[i].name_len >= len && memcmp(var_table[i].name, prefix, len) == 0) {
+            kush_compl_add(compl, var_table[i].name);
+        }
+    }
+}
+
+// Finds the files whose path starts with path (of length len). Only directories and executables are candidates
+// if executable is true.
+void kush_compl_files(kush_compl *compl, const char *path, size_t len, int executable) {
+    const char *base = memrchr(path, '/', len);
+    char dir[PATH_MAX];
+    size_t dir_len = base ? (size_t) (base - path) + 1 : 0;
+    const char *home = kush_var_get("HOME");
+    kush_listing *listing;
+    size_t num;
+    size_t first;
+
+    base = path + dir_len;
+    compl->prefix = len - dir_len;
+    if (dir_len == 0) strcpy(dir, ".");
+    else if (path[0] == '~' && path[1] == '/' && home) { // The home directory, the way the shell expands it
+        snprintf(dir, sizeof(dir), "%s%.*s", home, (int) dir_len - 1, path + 1);
+    } else snprintf(dir, sizeof(dir), "%.*s", (int) dir_len, path);
+
+    listing = kush_listing_get(dir);
+    if (!listing) return;
+
+    first = kush_names_find(&listing->names, base, len - dir_len, &num);
+    for (size_t i = first; i < first + num; i++) {
+        const char *name = listing->names.pool + listing->names.names[i];
+        size_t name_len = strlen(name);
+
+        if (name[0] == '.' && base[0] != '.') continue; // Hidden files only if they're asked for
+        if (executable && name[name_len - 1] != '/') {
+            int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            int allowed = dir_fd >= 0 && faccessat(dir_fd, name, X_OK, AT_EACCESS) == 0;
+
+            if (dir_fd >= 0) close(dir_fd);
+            if (!allowed) continue;
+        }
+        kush_compl_add(compl, name);
+    }
+}
+
+// Returns true if the word of the line starting at offset start is in the place of a command name
+int kush_compl_command_pos(const kush_editor *ed, size_t start) {
+    static const char *const keywords[] = {"if", "then", "else", "elif", "while", "until", "do", "!", "{", NULL};
+    size_t end = start;
+    size_t word;
+
+    while (end > 0 && (ed->line[end - 1] == ' ' || ed->line[end - 1] == '\t')) end--;
+    if (end == 0 || strchr(";|&(\n", ed->line[end - 1])) return 1;
+
+    for (word = end; word > 0 && !isspace((unsigned char) ed->line[word - 1]); word--);
+    for (size_t i = 0; keywords[i]; i++) {
+        if (strlen(keywords[i]) == end - word && memcmp(keywords[i], ed->line + word, end - word) == 0) return 1;
+    }
+
+    return 0;
+}
+
+// Inserts len bytes of text at the cursor, with a backslash in front of every character special to the shell
+// unless the word is quoted
+void kush_compl_insert(kush_editor *ed, const char *text, size_t len, int quoted) {
+    for (size_t i = 0; i < len; i++) {
+        if (!quoted && strchr(" \t\n\\'\"$&;|<>()*?[#`", text[i])) kush_edit_insert(ed, "\\", 1);
+        kush_edit_insert(ed, text + i, 1);
+    }
+}
+
+// Compares two strings for qsort()
+int kush_compl_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// Shows the candidates below the line and starts the line over after them
+void kush_compl_list(kush_editor *ed, kush_compl *compl) {
+    int width = 0;
+    int per_row;
+    size_t rows;
+
+    qsort(compl->list, compl->num_listed, sizeof(char *), &kush_compl_cmp);
+    for (size_t i = 0; i < compl->num_listed; i++) {
+        int name_width = kush_text_width(compl->list[i], (int) strlen(compl->list[i]));
+
+        if (name_width > width) width = name_width;
+    }
+    width += 2;
+    per_row = ed->cols / width > 0 ? ed->cols / width : 1;
+    rows = (compl->num_listed + per_row - 1) / per_row;
+
+    if (ed->prompt_live) kush_prompt_done(); // The cursor leaves the prompt line
+    ed->prompt_live = 0;
+    kush_edit_render(ed, ed->line, ed->len, ed->len);
+    kush_edit_out(ed, "\r\n", 2);
+    for (size_t row = 0; row < rows; row++) { // Sorted by columns, like ls does
+        for (size_t i = row; i < compl->num_listed; i += rows) {
+            const char *name = compl->list[i];
+
+            kush_edit_out(ed, name, strlen(name));
+            if (i + rows < compl->num_listed) { // Pad up to the next column
+                kush_edit_outf(ed, "%*s", width - kush_text_width(name, (int) strlen(name)), "");
+            }
+        }
+        kush_edit_out(ed, "\r\n", 2);
+    }
+    if (compl->num > compl->num_listed) kush_edit_outf(ed, "(%zu more)\r\n", compl->num - compl->num_listed);
+    kush_edit_prompt(ed);
+}
+
+// Completes the word in front of the cursor. again tells if Tab has been pressed right before, which lists the
+// candidates if there is more than one.
+void kush_edit_complete(kush_editor *ed, int again) {
+    size_t start = ed->pos;
+    char *word = kush_arena_alloc(&line_arena, ed->pos + 1);
+    size_t len = 0;
+    int quoted = 0; // The quote character the word starts with, 0 if it doesn't
+    kush_compl compl = {.num = 0, .num_listed = 0};
+
+    // The word starts after the last blank or operator character that isn't escaped
+    while (start > 0 && (!strchr(" \t\n;|&<>()", ed->line[start - 1]) || (start > 1 && ed->line[start - 2] == '\\'))) {
+        start--;
+    }
+    for (size_t i = start; i < ed->pos; i++) {
+        if (i == start && (ed->line[i] == '\'' || ed->line[i] == '"')) quoted = ed->line[i];
+        else if (ed->line[i] == '\\' && !quoted && i + 1 < ed->pos) word[len++] = ed->line[++i];
+        else word[len++] = ed->line[i];
+    }
+    word[len] = '\0';
+
+    if (kush_compl_command_pos(ed, start) && !memchr(word, '/', len)) kush_compl_commands(&compl, word, len);
+    else kush_compl_files(&compl, word, len, kush_compl_command_pos(ed, start));
+
+    // Only whole characters are inserted
+    while (compl.common > compl.prefix && ((unsigned char) compl.first[compl.common] & 0xC0) == 0x80) compl.common--;
+
+    if (compl.num == 1) { // The word is complete, and so is a file name unless it's a directory
+        size_t name_len = strlen(compl.first);
+        char end[2] = {(char) quoted, ' '};
+
+        kush_compl_insert(ed, compl.first + compl.prefix, name_len - compl.prefix, quoted);
+        if (compl.first[name_len - 1] != '/') kush_edit_insert(ed, quoted ? end : end + 1, quoted ? 2 : 1);
+    } else if (compl.common > compl.prefix) {
+        kush_compl_insert(ed, compl.first + compl.prefix, compl.common - compl.prefix, quoted);
+    } else if (again && compl.num > 0) {
+        kush_compl_list(ed, &compl);
+    } else kush_edit_out(ed, "\a", 1); // Nothing to add
+}
+// -----------------------------------------------------------------------------------------
+
+// Main command loop for the shell. Lines are collected until they form complete commands, which are compiled and
+// run as one unit.
+void kush_loop() {
+    int exit = 0; // Boolean value to check if the shell should exit
+    char *user_in = NULL; // Raw user input
+    char *script = NULL; // Lines read for the commands so far, NULL before the first one
+    size_t script_len = 0;
+    char **tokens = NULL; // List of parsed tokens
+    kush_unit *unit = NULL;
+    int incomplete = 0; // Boolean value telling if the commands go on in the next line
+
+    do {
+        if (!script) {
+            kush_jobs_notify(); // Report and clean up background jobs that are done
+            fflush(stdout); // Output of built-ins has to come before the prompt
+        }
+
+        line_interrupted = 0;
+        user_in = kush_read_line(script ? "> " : NULL); // Get user input, prompting for the rest of the commands
+        if (!user_in) { // End of the input
+            if (script) fprintf(stderr, "kush: Syntax error: unexpected end of file\n");
+            break;
+        }
+        if (line_interrupted) script = NULL; // The interrupt discarded the lines read before, too
+
+        if (script) { // Add the line to the ones before
+            size_t len = strlen(user_in);
+
+            script = kush_arena_grow(&line_arena, script, script_len + 1, script_len + len + 1);
+            memcpy(script + script_len, user_in, len + 1);
+            script_len += len;
+        } else {
+            script = user_in;
+            script_len = strlen(user_in);
+        }
+        // The tokenizer writes its tokens over its input, so it gets a copy in case more lines have to be added
+        tokens = kush_tokenize(strcpy(kush_arena_alloc(&line_arena, script_len + 1), script), &incomplete);
+        unit = tokens ? kush_compile(tokens, 0, &incomplete) : NULL; // Parse to token list and compile
+        if (incomplete) continue;
+        if (interactive) kush_hist_add(script, script_len - (script[script_len - 1] == '\n'));
+
+        // If unit is NULL a parsing error has occurred and we start over.
+        if (unit != NULL && interactive) { // Measure how long the commands take for the prompt
+            struct timespec start, end;
+
+            script_interrupted = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            exit = kush_exec(unit, 0); // Try to run the given user commands
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            last_duration_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        } else if (unit != NULL) exit = kush_exec(unit, 0);
+        if (unit) kush_unit_release(unit);
+
+        // Everything allocated for these lines lives in the line arena, so this frees it all at once
+        kush_arena_reset(&line_arena);
+        script = NULL;
+    } while (!exit);
+}
+
+int main() {
+    // Output of built-ins is collected in this buffer and written with a single write() per command, instead of
+    // one per line like stdio does for a terminal
+    static char out_buff[KUSH_OUT_BUFF_SIZE];
+
+    setvbuf(stdout, out_buff, _IOFBF, sizeof(out_buff));
+    kush_vars_init();
+    // Commands piped or redirected into kush run in batch mode, without banner, prompt and SIGINT handling
+    interactive = isatty(STDIN_FILENO);
+
+    // Launched programs get the default handling for every signal the shell handles or ignores itself
+    sigemptyset(&child_sigdefault);
+    sigaddset(&child_sigdefault, SIGINT);
+    sigaddset(&child_sigdefault, SIGQUIT);
+    sigaddset(&child_sigdefault, SIGTSTP);
+    sigaddset(&child_sigdefault, SIGTTIN);
+    sigaddset(&child_sigdefault, SIGTTOU);
+    sigaddset(&child_sigdefault, SIGWINCH);
+    sigaddset(&child_sigdefault, SIGPIPE);
+    // Built-ins running inside the shell may write into a pipe nobody reads anymore, which mustn't end the shell
+    signal(SIGPIPE, SIG_IGN);
+    kush_event_init();
+    kush_jobs_init();
+
+    if (interactive) {
+        kush_prompt_update_identity();
+        kush_prompt_update_cwd();
+        kush_seg_init();
+        kush_hist_init();
+        kush_compl_init();
+        kush_help(NULL); // Print help text on startup
+    }
     kush_loop();
+    kush_sched_drain();
+    kush_hist_flush(1); // Commands a compaction has held back
     return EXIT_SUCCESS;
 }
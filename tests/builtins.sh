@@ -0,0 +1,52 @@
+test 1 -eq 1 -o 1 -eq 2 -a 2 -eq 3
+echo "-a before -o: $?"
+test ! 1 -eq 1 -o 1 -eq 1
+echo "! binds tightest: $?"
+test \( 1 -eq 2 -o 1 -eq 1 \) -a 2 -eq 2
+echo "parentheses: $?"
+test ! \( 1 -eq 1 \)
+echo "negated group: $?"
+[ -n "" -o -z "" ]
+echo "-n and -z: $?"
+[ "abc" = abc ] && [ abc != abd ]
+echo "strings: $?"
+[ a \< b ]
+echo "less than: $?"
+[ -d / -a ! -f / ]
+echo "files: $?"
+test
+echo "no arguments: $?"
+test ""
+echo "empty string: $?"
+test -n
+echo "single word: $?"
+[ 1 -lt x ]
+echo "bad integer: $?"
+[ 1 -eq 1
+echo "missing bracket: $?"
+printf '%s|%5s|%-5s|%.2s|\n' a b c defg
+printf '%d %i %5d %-5d| %05d %+d\n' 42 -7 3 4 5 6
+printf '%x %X %o %u %#x %#o\n' 255 255 8 17 255 8
+printf '%.3f %e %g %10.2f|\n' 3.14159 1234.5 0.0001 2.5
+printf '%c%c|%3c|\n' hello world x
+printf '%c|%3c|\n' ''
+printf '%s=%d\n' a 1 b 2 c
+printf '%b|%s\n' 'tab\there' 'no\tescape'
+printf '%*d|%-*s|\n' 4 7 3 x
+printf '%d %d\n' "'A" '"B'
+printf '100%%\n'
+printf 'no newline'
+printf '\n%s\n' "escapes in the format: \\ \101"
+printf '%d\n' abc
+echo "invalid number: $?"
+printf '%z\n'
+echo "invalid conversion: $?"
+echo -n "no newline"
+echo " follows"
+echo -e 'a\tb\nc\\d \x41\0102'
+echo -e 'stop\c here'
+echo
+echo -en 'combined\n'
+echo -E 'raw\t'
+echo -x -n
+echo "-n" in the middle -n
@@ -0,0 +1,9 @@
+#!/bin/sh
+# Runs a script through kush in batch mode and compares its output with the expected one.
+# Usage: check.sh path/to/kush script.sh expected.out
+actual=$("$1" < "$2" 2>&1)
+expected=$(cat "$3")
+if [ "$actual" != "$expected" ]; then
+    printf 'Output of %s differs from %s:\n%s\n' "$2" "$3" "$actual"
+    exit 1
+fi
@@ -0,0 +1,38 @@
+name=world
+echo "hello $name" hello ${name}s '$name' \$name
+echo "${name}" "${name}_x" "$name_x" x${name}x
+echo "[${unset_var:-default}]" "[${name:-default}]" "[$unset_var]"
+empty=
+echo "[${empty:-used for empty}]" "[${unset_var:-$name}]" "[${unset_var:-"quoted $name"}]"
+echo [${unset_var:-'single  $name'}] "[${unset_var:-'kept'}]" [${unset_var:-a\ \ b}] "[${unset_var:-a\$b\x}]"
+false
+echo "status: $?"
+true
+echo "status: $?" "still: $?"
+sh -c 'exit 7'
+echo "status: $?"
+words="a   b	c"
+printf '<%s>' $words
+echo
+printf '<%s>' "$words"
+echo
+printf '<%s>' $unset_var "$unset_var" x$unset_var
+echo
+printf '<%s>' ${unset_var:-two words} ${unset_var:-"one word"} ${unset_var:-'c d'}x
+echo
+printf '<%s>' pre${words}post
+echo
+echo $ "$" a$ "${name}$"
+export EXPORTED=first
+env | grep '^EXPORTED='
+EXPORTED=second
+env | grep '^EXPORTED='
+LOCAL=not-exported
+env | grep -c '^LOCAL='
+export LOCAL
+env | grep '^LOCAL='
+TEMP=only-for-env env | grep '^TEMP='
+echo "after: [$TEMP]"
+unset EXPORTED
+env | grep -c '^EXPORTED='
+echo "[$EXPORTED]"
@@ -0,0 +1,25 @@
+dir=/tmp/kush-glob-$$
+mkdir $dir
+cd $dir
+touch a.c b.c ab.c .hidden.c 'sp ace.c' foo=1 foo=2 x1 x2 x3 '[x]' 'q*'
+mkdir sub sub/deep
+touch sub/s.c sub/deep/d.c
+echo *.c
+echo ?.c
+echo x[12] x[!1] x[a-z3]
+echo "*.c" '*.c' \*.c
+echo *.none "no match: $?"
+echo .*.c
+echo */*.c sub/*
+ls -d foo=*
+echo foo=* ./foo=*
+x=*.c
+echo $x
+echo "$x"
+y=foo=*
+echo "$y"
+case ab.c in a*) echo "case matches" ;; esac
+case ab.c in "a*") echo "quoted pattern matched" ;; *) echo "quoted pattern is literal" ;; esac
+echo \[x\] [[]x] q\* q*
+cd /
+rm -r $dir
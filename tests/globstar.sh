@@ -0,0 +1,21 @@
+dir=/tmp/kush-globstar-$$
+mkdir $dir
+cd $dir
+for a in 0 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17; do
+    mkdir d$a
+    touch d$a/top.c d$a/top.h
+    for b in 0 1 2 3 4 5; do
+        mkdir d$a/e$b d$a/e$b/f
+        touch d$a/e$b/$a$b.c d$a/e$b/f/deep.c d$a/e$b/f/deep.txt
+    done
+done
+mkdir .hidden
+touch root.c .hidden/skipped.c
+KUSH_GLOB_THREADS=1
+echo **/*.c
+KUSH_GLOB_THREADS=8
+echo **/*.c
+echo d3/**/ d3/**
+echo d*/**
+cd /
+rm -r $dir
@@ -0,0 +1,9 @@
+i=0; while test $i = 0; do i=1; false; done; echo "body failed: $?"
+while false; do true; done; echo "never ran: $?"
+false; while false; do true; done; echo "never ran after false: $?"
+i=0; until test $i = 1; do i=1; sh -c 'exit 4'; done; echo "until: $?"
+i=0; while true; do false; break; done; echo "break: $?"
+i=0; while test $i = 0; do i=1; false; continue; done; echo "continue: $?"
+for o in a b; do i=0; while test $i = 0; do i=1; sh -c 'exit 5'; done; done; echo "nested: $?"
+for o in a b; do while true; do break 2; done; done; echo "break 2: $?"
+f() { while true; do return 3; done; }; f; echo "return: $?"
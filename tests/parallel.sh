@@ -0,0 +1,12 @@
+parallel -j 4 -k sh -c 'sleep $1; echo "slept $1"' sh {} ::: 0.3 0.1 0.2 0
+echo "status: $?"
+parallel -j 4 -k sh -c 'sleep $1; echo "first line $1"; sleep $1; echo "second line $1"' sh ::: 0.2 0 0.1
+parallel -j 2 -k echo "item-{}-end" {}{} ::: a b c
+parallel -k echo appended ::: x y
+printf 'line one\nline two\n' | parallel -k echo "from stdin: {}"
+parallel -j 3 -k sh -c 'echo "job $1"; exit $1' sh ::: 0 1 2 0 3
+echo "failed jobs: $?"
+parallel -k no-such-command-kush ::: a b
+echo "not started: $?"
+parallel -k true ::: a b
+echo "all succeeded: $?"
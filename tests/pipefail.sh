@@ -0,0 +1,12 @@
+false | true
+echo "without pipefail: $?"
+set -o pipefail
+false | true
+echo "foreground: $?"
+sh -c 'exit 3' | true
+echo "first stage: $?"
+sh -c 'exit 3' | sh -c 'exit 4' | true
+echo "rightmost failure: $?"
+false | true &
+wait %1
+echo "wait: $?"
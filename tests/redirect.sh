@@ -0,0 +1,8 @@
+echo "stdout to stderr" >&2 2>/dev/null
+echo "1>&2 is the same" 1>&2 2>/dev/null
+echo "dropped" 2>/dev/null >&2
+echo "stderr follows stdout" 2>&1 >&2
+echo "not run" >&3
+echo "status: $?"
+echo "not run either" > | cat
+echo "status: $?"
@@ -0,0 +1,17 @@
+dir=/tmp/kush-source-$$
+mkdir $dir
+XDG_CACHE_HOME=$dir/cache
+echo 'echo "version A, $1"' > $dir/rc
+source $dir/rc compiled
+source $dir/rc cached
+ls $dir/cache/kush | wc -l
+echo 'echo "version B, $1"' > $dir/rc
+source $dir/rc "same size, same second"
+ls $dir/cache/kush | wc -l
+echo 'echo "version A, $1"' > $dir/rc
+source $dir/rc "back to the first cache file"
+ls $dir/cache/kush | wc -l
+echo 'echo "a shorter script"' > $dir/rc
+source $dir/rc
+ls $dir/cache/kush | wc -l
+rm -r $dir